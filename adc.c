@@ -0,0 +1,383 @@
+/*
+ * ADC of PIC32MZ: scan of analog inputs.
+ *
+ * Copyright (C) 2019 Serge Vakulenko
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   1. Redistributions of source code must retain the above copyright notice,
+ *      this list of conditions and the following disclaimer.
+ *   2. Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer in the
+ *      documentation and/or other materials provided with the distribution.
+ *   3. The name of the author may not be used to endorse or promote products
+ *      derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR IMPLIED
+ * WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO
+ * EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+ * OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ * OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ * ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include "gpio.h"
+
+//
+// ADC registers.
+//
+#define ADCCON1     0x1f84b000
+#define ADCCON2     0x1f84b010
+#define ADCCON3     0x1f84b020
+#define ADCCSS1     0x1f84b090      // Scan select, AN0-AN31
+#define ADCCSS2     0x1f84b0a0      // Scan select, AN32-AN63
+#define ADCDSTAT1   0x1f84b0b0      // Data ready, AN0-AN31
+#define ADCDSTAT2   0x1f84b0c0      // Data ready, AN32-AN63
+#define ADCTRG1     0x1f84b200      // Trigger source of AN0-AN3, next follow
+#define ADC0TIME    0x1f84b350      // Dedicated ADC timing, next follow with step 0x10
+#define ADCANCON    0x1f84b400
+#define ADCDATA0    0x1f84b600      // Next results follow with step 0x10
+#define ADC0CFG     0x1f84bd00      // Calibration, next follow with step 0x10
+#define DEVADC0     0x1fc45000      // Factory calibration, next follow with step 4
+
+#define CON1_ON         0x00008000
+#define CON1_SELRES12   0x00600000  // 12-bit resolution
+#define CON1_STRGSRC_SW 0x00010000  // Scan trigger: global software
+
+#define CON2_BGVRRDY    0x80000000  // Band gap reference ready
+#define CON2_REFFLT     0x40000000  // Reference fault
+#define CON2_EOSRDY     0x20000000  // End of scan
+
+#define CON3_ADCSEL_SYS 0x40000000  // Clock source: SYSCLK
+#define CON3_DIGEN      0x009f0000  // Digital enable of ADC0-ADC4 and ADC7
+#define CON3_GSWTRG     0x00000040  // Global software trigger
+
+#define ANCON_ANEN      0x0000009f  // Analog enable of ADC0-ADC4 and ADC7
+#define ANCON_WKRDY     0x00009f00  // Wake up ready of them
+#define ANCON_WKUPCLK   0x05000000  // Wake up in 32 clocks
+
+#define TRGSRC_STRIG    3           // Trigger by scan
+
+//
+// Highest clock of ADC control logic.
+//
+#define ADC_TQ_HZ   50000000
+
+//
+// Spin count to wait for a conversion or a wake up.
+//
+#define ADC_TIMEOUT 1000000
+
+//
+// Analog inputs of PIC32MZ EF, by pin.
+//
+static const struct {
+    int pin;
+    int chan;
+} adc_input[] = {
+    { GPIO_PIN('B',0),  0 },  { GPIO_PIN('B',1),  1 },  { GPIO_PIN('B',2),  2 },
+    { GPIO_PIN('B',3),  3 },  { GPIO_PIN('B',4),  4 },  { GPIO_PIN('B',10), 5 },
+    { GPIO_PIN('B',11), 6 },  { GPIO_PIN('B',12), 7 },  { GPIO_PIN('B',13), 8 },
+    { GPIO_PIN('B',14), 9 },  { GPIO_PIN('B',15), 10 }, { GPIO_PIN('G',9),  11 },
+    { GPIO_PIN('G',8),  12 }, { GPIO_PIN('G',7),  13 }, { GPIO_PIN('G',6),  14 },
+    { GPIO_PIN('E',7),  15 }, { GPIO_PIN('E',6),  16 }, { GPIO_PIN('E',5),  17 },
+    { GPIO_PIN('E',4),  18 }, { GPIO_PIN('A',9),  27 }, { GPIO_PIN('A',10), 28 },
+    { GPIO_PIN('B',5),  45 }, { GPIO_PIN('B',6),  46 }, { GPIO_PIN('B',7),  47 },
+    { GPIO_PIN('B',8),  48 }, { GPIO_PIN('B',9),  49 },
+    { 0, 0 },
+};
+
+//
+// Scan list: channels and pins in order of request.
+//
+static int adc_nchan;
+static int adc_chan[GPIO_ADC_MAXCHAN];
+static int adc_pin[GPIO_ADC_MAXCHAN];
+static unsigned adc_css[2];
+
+//
+// Continuous scan state.  Counters shared with the scanning thread
+// are 32-bit: wider atomics need libatomic on MIPS32.
+//
+static pthread_t adc_thread;
+static int adc_running;
+static volatile int adc_halt;
+static unsigned short *adc_ring;
+static unsigned adc_ring_frames;
+static unsigned adc_period_ns;
+static unsigned adc_nframes;        // Frames stored, wraps around
+static int adc_failed;              // Scanning stopped on error
+
+//
+// Get analog channel of a pin, or -1.
+//
+int gpio_adc_channel(int pin)
+{
+    int i;
+
+    for (i = 0; adc_input[i].pin != 0; i++) {
+        if (adc_input[i].pin == pin)
+            return adc_input[i].chan;
+    }
+    return -1;
+}
+
+//
+// Wait until all bits of mask are set in a register.
+// Simulated ADC has no status: results are read as stored.
+// Return 0 on success, -1 on timeout.
+//
+static int adc_wait(unsigned addr, unsigned mask)
+{
+    volatile unsigned *reg = gpio_sfr(addr);
+    int timeout;
+
+    if (gpio_model)
+        return 0;
+    for (timeout = ADC_TIMEOUT; timeout > 0; timeout--) {
+        if ((*reg & mask) == mask)
+            return 0;
+    }
+    return -1;
+}
+
+//
+// Release pins of the scan list, and the ADC itself.
+//
+static void adc_release()
+{
+    int i;
+
+    for (i = 0; i < adc_nchan; i++)
+        gpio_release(adc_pin[i]);
+    adc_nchan = 0;
+    gpio_release_module(MODULE_ADC);
+}
+
+//
+// Configure the ADC to scan analog inputs of given pins.
+// Pins are claimed, and switched to analog mode.  Results
+// of every scan are returned in order of pins.
+// Return 0 on success, -1 on error, or when the ADC is
+// used by somebody else.
+//
+int gpio_adc_open(const int *pin, int npins)
+{
+    int i;
+
+    if (npins < 1 || npins > GPIO_ADC_MAXCHAN) {
+        fprintf(stderr, "gpio: Need 1...%d analog pins\n", GPIO_ADC_MAXCHAN);
+        return -1;
+    }
+    if (gpio_claim_module(MODULE_ADC, "adc") < 0)
+        return -1;
+    if (*gpio_sfr(ADCCON1) & CON1_ON) {
+        fprintf(stderr, "gpio: ADC is busy\n");
+        gpio_release_module(MODULE_ADC);
+        return -1;
+    }
+
+    adc_nchan = 0;
+    adc_css[0] = adc_css[1] = 0;
+    for (i = 0; i < npins; i++) {
+        int chan = gpio_adc_channel(pin[i]);
+
+        if (chan < 0) {
+            fprintf(stderr, "gpio: Pin is not an analog input\n");
+            goto fail;
+        }
+        if (gpio_claim(pin[i], "adc") < 0)
+            goto fail;
+        if (gpio_set_mode(pin[i], MODE_ANALOG) < 0) {
+            gpio_release(pin[i]);
+            goto fail;
+        }
+        adc_chan[adc_nchan] = chan;
+        adc_pin[adc_nchan] = pin[i];
+        adc_nchan++;
+        adc_css[chan / 32] |= 1 << (chan % 32);
+    }
+
+    // Control clock from SYSCLK, divided to at most 50 MHz.
+    // Conversion clock is half of it, and sample time is 10 periods.
+    unsigned sysclk = gpio_sysclk();
+    unsigned div = (sysclk + 2*ADC_TQ_HZ - 1) / (2*ADC_TQ_HZ);
+    if (div > 63)
+        div = 63;
+
+    *gpio_sfr(ADCCON1) = 0;
+    *gpio_sfr(ADCCON3) = CON3_ADCSEL_SYS | div << 24;
+    *gpio_sfr(ADCCON2) = 10 << 16 | 1;
+    for (i = 0; i < 5; i++)
+        *gpio_sfr(ADC0TIME + i*0x10) = 3 << 24 | 1 << 16 | 10;
+
+    // Factory calibration of every ADC.
+    for (i = 0; i < 8; i++) {
+        if (i == 5 || i == 6)
+            continue;
+        *gpio_sfr(ADC0CFG + i*0x10) = *gpio_sfr(DEVADC0 + i*4);
+    }
+
+    // Dedicated inputs AN0-AN11 need the scan trigger selected;
+    // shared inputs are triggered by the scan itself.
+    for (i = 0; i < 3; i++) {
+        unsigned trg = 0;
+        int n;
+
+        for (n = 0; n < 4; n++) {
+            if (adc_css[0] & (1 << (i*4 + n)))
+                trg |= TRGSRC_STRIG << (n*8);
+        }
+        *gpio_sfr(ADCTRG1 + i*0x10) = trg;
+    }
+    *gpio_sfr(ADCCSS1) = adc_css[0];
+    *gpio_sfr(ADCCSS2) = adc_css[1];
+
+    // Power up, and wait for the reference and analog parts.
+    *gpio_sfr(ADCCON1) = CON1_SELRES12 | CON1_STRGSRC_SW | CON1_ON;
+    if (adc_wait(ADCCON2, CON2_BGVRRDY) < 0 ||
+        (*gpio_sfr(ADCCON2) & CON2_REFFLT)) {
+        fprintf(stderr, "gpio: ADC reference is not ready\n");
+        goto off;
+    }
+    *gpio_sfr(ADCANCON) = ANCON_WKUPCLK | ANCON_ANEN;
+    if (adc_wait(ADCANCON, ANCON_WKRDY) < 0) {
+        fprintf(stderr, "gpio: ADC does not wake up\n");
+        goto off;
+    }
+    *gpio_sfr(ADCCON3) |= CON3_DIGEN;
+    return 0;
+
+off:
+    *gpio_sfr(ADCCON1) = 0;
+fail:
+    adc_release();
+    return -1;
+}
+
+//
+// Run one scan of all channels, and store 12-bit results
+// in order of pins.  Return 0 on success, -1 on timeout.
+//
+int gpio_adc_read(unsigned short *value)
+{
+    int i;
+
+    if (adc_nchan == 0) {
+        fprintf(stderr, "gpio: ADC is not open\n");
+        return -1;
+    }
+
+    // Status of ready bits is cleared by reading the results.
+    *gpio_sfr(ADCCON3) |= CON3_GSWTRG;
+    if (adc_wait(ADCDSTAT1, adc_css[0]) < 0 ||
+        adc_wait(ADCDSTAT2, adc_css[1]) < 0) {
+        fprintf(stderr, "gpio: ADC conversion timeout\n");
+        return -1;
+    }
+    for (i = 0; i < adc_nchan; i++)
+        value[i] = *gpio_sfr(ADCDATA0 + adc_chan[i]*0x10) & 0xfff;
+    return 0;
+}
+
+//
+// Scan repeatedly, at absolute deadlines of a period.
+// On error, stop and leave the flag for the consumer.
+//
+static void *adc_loop(void *arg)
+{
+    struct timespec next;
+    unsigned slot = 0;
+
+    clock_gettime(CLOCK_MONOTONIC, &next);
+    while (!adc_halt) {
+        if (gpio_adc_read(adc_ring + slot * adc_nchan) < 0) {
+            __atomic_store_n(&adc_failed, 1, __ATOMIC_RELEASE);
+            break;
+        }
+        if (++slot == adc_ring_frames)
+            slot = 0;
+        __atomic_store_n(&adc_nframes, adc_nframes + 1, __ATOMIC_RELEASE);
+
+        if (adc_period_ns > 0) {
+            next.tv_nsec += adc_period_ns;
+            while (next.tv_nsec >= 1000000000) {
+                next.tv_nsec -= 1000000000;
+                next.tv_sec++;
+            }
+            clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next, 0);
+        }
+    }
+    return 0;
+}
+
+//
+// Start continuous scanning into a ring of nframes frames, each of
+// one result per pin.  With hz=0, scans follow back to back.
+// Frame n is stored at ring[(n % nframes) * npins].
+// Return 0 on success, -1 on error.
+//
+int gpio_adc_continuous(unsigned short *ring, unsigned nframes, unsigned hz)
+{
+    if (adc_nchan == 0 || adc_running || nframes == 0) {
+        fprintf(stderr, "gpio: ADC is not open, or already running\n");
+        return -1;
+    }
+    adc_ring = ring;
+    adc_ring_frames = nframes;
+    adc_period_ns = hz ? 1000000000 / hz : 0;
+    adc_nframes = 0;
+    adc_failed = 0;
+    adc_halt = 0;
+    if (pthread_create(&adc_thread, 0, adc_loop, 0) != 0) {
+        fprintf(stderr, "gpio: Cannot start ADC thread\n");
+        return -1;
+    }
+    adc_running = 1;
+    return 0;
+}
+
+//
+// Get count of frames stored since start of continuous mode,
+// modulo 2^32.  Frames older than the ring size are overwritten.
+// Return 0, or -1 when scanning has stopped on error:
+// frames counted so far are still valid.
+//
+int gpio_adc_frames(unsigned *count)
+{
+    int failed = __atomic_load_n(&adc_failed, __ATOMIC_ACQUIRE);
+
+    *count = __atomic_load_n(&adc_nframes, __ATOMIC_ACQUIRE);
+    return failed ? -1 : 0;
+}
+
+//
+// Stop scanning, power down the ADC, and make the pins input.
+//
+void gpio_adc_close()
+{
+    int i;
+
+    if (adc_running) {
+        adc_halt = 1;
+        pthread_join(adc_thread, 0);
+        adc_running = 0;
+    }
+    if (adc_nchan == 0)
+        return;
+
+    *gpio_sfr(ADCCON3) &= ~CON3_DIGEN;
+    *gpio_sfr(ADCANCON) = 0;
+    *gpio_sfr(ADCCON1) = 0;
+    for (i = 0; i < adc_nchan; i++)
+        gpio_set_mode(adc_pin[i], MODE_INPUT);
+    adc_release();
+}
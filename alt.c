@@ -32,6 +32,7 @@
 #include <stdint.h>
 #include <errno.h>
 #include <sys/mman.h>
+#include <pthread.h>
 #include "gpio.h"
 
 //
@@ -149,6 +150,19 @@
 static const int PPS_ADDR = 0x1f801000;
 
 static ptrdiff_t pps_base;          // PPS registers mapped here
+static pthread_once_t pps_once = PTHREAD_ONCE_INIT;
+
+static __thread gpio_plan_t *pps_plan; // When set, record writes instead
+
+//
+// Every PPS register has its own lock for read-modify-write,
+// so that different pins can be remapped in parallel.
+// Indexed by register offset: they span less than 1 kbyte.
+//
+static pthread_mutex_t pps_lock[256];
+
+#define PPS_LOCK(offset)    pthread_mutex_lock(&pps_lock[((offset) & 0x3ff) >> 2])
+#define PPS_UNLOCK(offset)  pthread_mutex_unlock(&pps_lock[((offset) & 0x3ff) >> 2])
 
 //
 // Get access to PPS control registers.
@@ -157,6 +171,11 @@ static ptrdiff_t pps_base;          // PPS registers mapped here
 static void pps_init()
 {
     extern int gpio_mem_fd;
+    int i;
+
+    gpio_open();
+    for (i = 0; i < 256; i++)
+        pthread_mutex_init(&pps_lock[i], 0);
 
     // Map a page of memory to the PPS address
     pps_base = (ptrdiff_t) mmap(0, 4096, PROT_READ|PROT_WRITE, MAP_SHARED,
@@ -173,13 +192,12 @@ static void pps_init()
 //
 static uint32_t read_sfr(int offset)
 {
-    if (!pps_base)
-        pps_init();
+    pthread_once(&pps_once, pps_init);
 
     volatile uint32_t *regp = (uint32_t*) (pps_base + (offset & 0xfff));
     uint32_t value = *regp;
-    if (gpio_debug > 1)
-        printf("--- %s: [%08x] -> %08x\n", __func__, PPS_ADDR + (offset & 0xfff), value);
+    gpio_trace_read(PPS_ADDR + (offset & 0xfff), value);
+    gpio_stats_mmio(1, 0);
     return value & 0xf;
 }
 
@@ -188,13 +206,18 @@ static uint32_t read_sfr(int offset)
 //
 static void write_sfr(int offset, uint32_t value)
 {
-    if (!pps_base)
-        pps_init();
+    if (pps_plan) {
+        gpio_plan_add(pps_plan, PLAN_STORE, PPS_ADDR + (offset & 0xfff), value);
+        return;
+    }
+    pthread_once(&pps_once, pps_init);
 
     volatile uint32_t *regp = (uint32_t*) (pps_base + (offset & 0xfff));
+    PPS_LOCK(offset);
+    gpio_trace_write(PPS_ADDR + (offset & 0xfff), *regp, value);
     *regp = value;
-    if (gpio_debug > 0)
-        printf("--- %s: %08x -> [%08x]\n", __func__, value, PPS_ADDR + (offset & 0xfff));
+    PPS_UNLOCK(offset);
+    gpio_stats_mmio(0, 1);
 }
 
 //
@@ -202,16 +225,43 @@ static void write_sfr(int offset, uint32_t value)
 //
 static void clear_sfr(int offset)
 {
-    if (!pps_base)
-        pps_init();
+    if (pps_plan) {
+        gpio_plan_add(pps_plan, PLAN_STORE, PPS_ADDR + (offset & 0xfff), 0);
+        return;
+    }
+    pthread_once(&pps_once, pps_init);
 
     volatile uint32_t *regp = (uint32_t*) (pps_base + (offset & 0xfff));
+    PPS_LOCK(offset);
     uint32_t value = *regp;
     if (value & 0xf) {
         *regp = 0;
-        if (gpio_debug > 0)
-            printf("--- %s: [%04x] -> %08x, 0 -> [%04x]\n", __func__, offset, value, offset);
+        gpio_trace_write(PPS_ADDR + (offset & 0xfff), value, 0);
     }
+    PPS_UNLOCK(offset);
+    gpio_stats_mmio(1, (value & 0xf) != 0);
+}
+
+//
+// Disconnect input function from a pin with given index in the group.
+//
+static void unmap_input(int offset, int value)
+{
+    if (pps_plan) {
+        gpio_plan_add(pps_plan, PLAN_UNMAP, PPS_ADDR + (offset & 0xfff), 1 << value);
+        return;
+    }
+    pthread_once(&pps_once, pps_init);
+
+    volatile uint32_t *regp = (uint32_t*) (pps_base + (offset & 0xfff));
+    PPS_LOCK(offset);
+    uint32_t old = *regp;
+    if ((old & 0xf) == value) {
+        *regp = 15;
+        gpio_trace_write(PPS_ADDR + (offset & 0xfff), old, 15);
+    }
+    PPS_UNLOCK(offset);
+    gpio_stats_mmio(1, (old & 0xf) == value);
 }
 
 //
@@ -327,6 +377,7 @@ static gpio_mode_t output_group4_to_mode(uint32_t value)
 //
 gpio_mode_t gpio_get_output_mapping(int pin)
 {
+    gpio_stats_enter(GPIO_STAT_GET_OUTPUT);
     switch (pin) {
     case GPIO_PIN('D',2):  return output_group1_to_mode(read_sfr(RPD2R));
     case GPIO_PIN('G',8):  return output_group1_to_mode(read_sfr(RPG8R));
@@ -472,6 +523,7 @@ static gpio_mode_t read_input_group4(int value)
 //
 gpio_mode_t gpio_get_input_mapping(int pin)
 {
+    gpio_stats_enter(GPIO_STAT_GET_INPUT);
     switch (pin) {
     case GPIO_PIN('A',14): return read_input_group1(13);
     case GPIO_PIN('A',15): return read_input_group2(13);
@@ -529,20 +581,20 @@ gpio_mode_t gpio_get_input_mapping(int pin)
 //
 static gpio_mode_t clear_input_group1(int value)
 {
-    if (read_sfr(INT3R)     == value) write_sfr(INT3R, 15);
-    if (read_sfr(T2CKR)     == value) write_sfr(T2CKR, 15);
-    if (read_sfr(T6CKR)     == value) write_sfr(T6CKR, 15);
-    if (read_sfr(IC3R)      == value) write_sfr(IC3R, 15);
-    if (read_sfr(IC7R)      == value) write_sfr(IC7R, 15);
-    if (read_sfr(U1RXR)     == value) write_sfr(U1RXR, 15);
-    if (read_sfr(U2CTSR)    == value) write_sfr(U2CTSR, 15);
-    if (read_sfr(U5RXR)     == value) write_sfr(U5RXR, 15);
-    if (read_sfr(U6CTSR)    == value) write_sfr(U6CTSR, 15);
-    if (read_sfr(SDI1R)     == value) write_sfr(SDI1R, 15);
-    if (read_sfr(SDI3R)     == value) write_sfr(SDI3R, 15);
-    if (read_sfr(SDI5R)     == value) write_sfr(SDI5R, 15);
-    if (read_sfr(SS6R)      == value) write_sfr(SS6R, 15);
-    if (read_sfr(REFCLKI1R) == value) write_sfr(REFCLKI1R, 15);
+    unmap_input(INT3R,     value);
+    unmap_input(T2CKR,     value);
+    unmap_input(T6CKR,     value);
+    unmap_input(IC3R,      value);
+    unmap_input(IC7R,      value);
+    unmap_input(U1RXR,     value);
+    unmap_input(U2CTSR,    value);
+    unmap_input(U5RXR,     value);
+    unmap_input(U6CTSR,    value);
+    unmap_input(SDI1R,     value);
+    unmap_input(SDI3R,     value);
+    unmap_input(SDI5R,     value);
+    unmap_input(SS6R,      value);
+    unmap_input(REFCLKI1R, value);
     return 0;
 }
 
@@ -551,17 +603,17 @@ static gpio_mode_t clear_input_group1(int value)
 //
 static gpio_mode_t clear_input_group2(int value)
 {
-    if (read_sfr(INT4R)     == value) write_sfr(INT4R, 15);
-    if (read_sfr(T5CKR)     == value) write_sfr(T5CKR, 15);
-    if (read_sfr(T7CKR)     == value) write_sfr(T7CKR, 15);
-    if (read_sfr(IC4R)      == value) write_sfr(IC4R, 15);
-    if (read_sfr(IC8R)      == value) write_sfr(IC8R, 15);
-    if (read_sfr(U3RXR)     == value) write_sfr(U3RXR, 15);
-    if (read_sfr(U4CTSR)    == value) write_sfr(U4CTSR, 15);
-    if (read_sfr(SDI2R)     == value) write_sfr(SDI2R, 15);
-    if (read_sfr(SDI4R)     == value) write_sfr(SDI4R, 15);
-    if (read_sfr(C1RXR)     == value) write_sfr(C1RXR, 15);
-    if (read_sfr(REFCLKI4R) == value) write_sfr(REFCLKI4R, 15);
+    unmap_input(INT4R,     value);
+    unmap_input(T5CKR,     value);
+    unmap_input(T7CKR,     value);
+    unmap_input(IC4R,      value);
+    unmap_input(IC8R,      value);
+    unmap_input(U3RXR,     value);
+    unmap_input(U4CTSR,    value);
+    unmap_input(SDI2R,     value);
+    unmap_input(SDI4R,     value);
+    unmap_input(C1RXR,     value);
+    unmap_input(REFCLKI4R, value);
     return 0;
 }
 
@@ -570,20 +622,20 @@ static gpio_mode_t clear_input_group2(int value)
 //
 static gpio_mode_t clear_input_group3(int value)
 {
-    if (read_sfr(INT2R)  == value) write_sfr(INT2R, 15);
-    if (read_sfr(T3CKR)  == value) write_sfr(T3CKR, 15);
-    if (read_sfr(T8CKR)  == value) write_sfr(T8CKR, 15);
-    if (read_sfr(IC2R)   == value) write_sfr(IC2R, 15);
-    if (read_sfr(IC5R)   == value) write_sfr(IC5R, 15);
-    if (read_sfr(IC9R)   == value) write_sfr(IC9R, 15);
-    if (read_sfr(U1CTSR) == value) write_sfr(U1CTSR, 15);
-    if (read_sfr(U2RXR)  == value) write_sfr(U2RXR, 15);
-    if (read_sfr(U5CTSR) == value) write_sfr(U5CTSR, 15);
-    if (read_sfr(SS1R)   == value) write_sfr(SS1R, 15);
-    if (read_sfr(SS3R)   == value) write_sfr(SS3R, 15);
-    if (read_sfr(SS4R)   == value) write_sfr(SS4R, 15);
-    if (read_sfr(SS5R)   == value) write_sfr(SS5R, 15);
-    if (read_sfr(C2RXR)  == value) write_sfr(C2RXR, 15);
+    unmap_input(INT2R,  value);
+    unmap_input(T3CKR,  value);
+    unmap_input(T8CKR,  value);
+    unmap_input(IC2R,   value);
+    unmap_input(IC5R,   value);
+    unmap_input(IC9R,   value);
+    unmap_input(U1CTSR, value);
+    unmap_input(U2RXR,  value);
+    unmap_input(U5CTSR, value);
+    unmap_input(SS1R,   value);
+    unmap_input(SS3R,   value);
+    unmap_input(SS4R,   value);
+    unmap_input(SS5R,   value);
+    unmap_input(C2RXR,  value);
     return 0;
 }
 
@@ -592,18 +644,18 @@ static gpio_mode_t clear_input_group3(int value)
 //
 static gpio_mode_t clear_input_group4(int value)
 {
-    if (read_sfr(INT1R)     == value) write_sfr(INT1R, 15);
-    if (read_sfr(T4CKR)     == value) write_sfr(T4CKR, 15);
-    if (read_sfr(T9CKR)     == value) write_sfr(T9CKR, 15);
-    if (read_sfr(IC1R)      == value) write_sfr(IC1R, 15);
-    if (read_sfr(IC6R)      == value) write_sfr(IC6R, 15);
-    if (read_sfr(U3CTSR)    == value) write_sfr(U3CTSR, 15);
-    if (read_sfr(U4RXR)     == value) write_sfr(U4RXR, 15);
-    if (read_sfr(U6RXR)     == value) write_sfr(U6RXR, 15);
-    if (read_sfr(SS2R)      == value) write_sfr(SS2R, 15);
-    if (read_sfr(SDI6R)     == value) write_sfr(SDI6R, 15);
-    if (read_sfr(OCFAR)     == value) write_sfr(OCFAR, 15);
-    if (read_sfr(REFCLKI3R) == value) write_sfr(REFCLKI3R, 15);
+    unmap_input(INT1R,     value);
+    unmap_input(T4CKR,     value);
+    unmap_input(T9CKR,     value);
+    unmap_input(IC1R,      value);
+    unmap_input(IC6R,      value);
+    unmap_input(U3CTSR,    value);
+    unmap_input(U4RXR,     value);
+    unmap_input(U6RXR,     value);
+    unmap_input(SS2R,      value);
+    unmap_input(SDI6R,     value);
+    unmap_input(OCFAR,     value);
+    unmap_input(REFCLKI3R, value);
     return 0;
 }
 
@@ -612,6 +664,7 @@ static gpio_mode_t clear_input_group4(int value)
 //
 void gpio_clear_mapping(int pin)
 {
+    gpio_stats_enter(GPIO_STAT_CLEAR_MAPPING);
     switch (pin) {
     case GPIO_PIN('A',14): clear_input_group1(13); clear_sfr(RPA14R); break;
     case GPIO_PIN('A',15): clear_input_group2(13); clear_sfr(RPA15R); break;
@@ -850,7 +903,7 @@ static int mode_to_output_group4(gpio_mode_t mode)
 //
 // Set given pin to a specified mode.
 //
-void gpio_set_mapping(int pin, gpio_mode_t mode)
+static void set_mapping(int pin, gpio_mode_t mode)
 {
     //
     // Input modes.
@@ -965,6 +1018,21 @@ void gpio_set_mapping(int pin, gpio_mode_t mode)
     }
 }
 
+//
+// Set given pin to a specified mode.
+// Refuse when the pin or the function is owned by another process.
+// Return 0 on success, -1 on error.
+//
+int gpio_set_mapping(int pin, gpio_mode_t mode)
+{
+    gpio_stats_enter(GPIO_STAT_SET_MAPPING);
+    if (gpio_check_owner(pin, mode) < 0)
+        return -1;
+
+    set_mapping(pin, mode);
+    return 0;
+}
+
 static int pin_in_input_group1(int pin)
 {
     switch (pin) {
@@ -1136,6 +1204,7 @@ static int mode_in_output_group4(gpio_mode_t mode)
 //
 int gpio_has_mapping(int pin, gpio_mode_t mode)
 {
+    gpio_stats_enter(GPIO_STAT_HAS_MAPPING);
     //
     // Input modes.
     //
@@ -1274,3 +1343,192 @@ int gpio_has_mapping(int pin, gpio_mode_t mode)
     }
     return 0;
 }
+
+//
+// All input and output select registers, in order of snapshot.
+//
+struct pps_reg {
+    int offset;
+    const char *name;
+};
+
+static const struct pps_reg pps_input[PPS_NINPUTS] = {
+    { INT1R,      "INT1R" },
+    { INT2R,      "INT2R" },
+    { INT3R,      "INT3R" },
+    { INT4R,      "INT4R" },
+    { T2CKR,      "T2CKR" },
+    { T3CKR,      "T3CKR" },
+    { T4CKR,      "T4CKR" },
+    { T5CKR,      "T5CKR" },
+    { T6CKR,      "T6CKR" },
+    { T7CKR,      "T7CKR" },
+    { T8CKR,      "T8CKR" },
+    { T9CKR,      "T9CKR" },
+    { IC1R,       "IC1R" },
+    { IC2R,       "IC2R" },
+    { IC3R,       "IC3R" },
+    { IC4R,       "IC4R" },
+    { IC5R,       "IC5R" },
+    { IC6R,       "IC6R" },
+    { IC7R,       "IC7R" },
+    { IC8R,       "IC8R" },
+    { IC9R,       "IC9R" },
+    { OCFAR,      "OCFAR" },
+    { U1RXR,      "U1RXR" },
+    { U1CTSR,     "U1CTSR" },
+    { U2RXR,      "U2RXR" },
+    { U2CTSR,     "U2CTSR" },
+    { U3RXR,      "U3RXR" },
+    { U3CTSR,     "U3CTSR" },
+    { U4RXR,      "U4RXR" },
+    { U4CTSR,     "U4CTSR" },
+    { U5RXR,      "U5RXR" },
+    { U5CTSR,     "U5CTSR" },
+    { U6RXR,      "U6RXR" },
+    { U6CTSR,     "U6CTSR" },
+    { SDI1R,      "SDI1R" },
+    { SS1R,       "SS1R" },
+    { SDI2R,      "SDI2R" },
+    { SS2R,       "SS2R" },
+    { SDI3R,      "SDI3R" },
+    { SS3R,       "SS3R" },
+    { SDI4R,      "SDI4R" },
+    { SS4R,       "SS4R" },
+    { SDI5R,      "SDI5R" },
+    { SS5R,       "SS5R" },
+    { SDI6R,      "SDI6R" },
+    { SS6R,       "SS6R" },
+    { C1RXR,      "C1RXR" },
+    { C2RXR,      "C2RXR" },
+    { REFCLKI1R,  "REFCLKI1R" },
+    { REFCLKI3R,  "REFCLKI3R" },
+    { REFCLKI4R,  "REFCLKI4R" },
+};
+
+static const struct pps_reg pps_output[PPS_NOUTPUTS] = {
+    { RPA14R,     "RPA14R" },
+    { RPA15R,     "RPA15R" },
+    { RPB0R,      "RPB0R" },
+    { RPB1R,      "RPB1R" },
+    { RPB2R,      "RPB2R" },
+    { RPB3R,      "RPB3R" },
+    { RPB5R,      "RPB5R" },
+    { RPB6R,      "RPB6R" },
+    { RPB7R,      "RPB7R" },
+    { RPB8R,      "RPB8R" },
+    { RPB9R,      "RPB9R" },
+    { RPB10R,     "RPB10R" },
+    { RPB14R,     "RPB14R" },
+    { RPB15R,     "RPB15R" },
+    { RPC1R,      "RPC1R" },
+    { RPC2R,      "RPC2R" },
+    { RPC3R,      "RPC3R" },
+    { RPC4R,      "RPC4R" },
+    { RPC13R,     "RPC13R" },
+    { RPC14R,     "RPC14R" },
+    { RPD0R,      "RPD0R" },
+    { RPD1R,      "RPD1R" },
+    { RPD2R,      "RPD2R" },
+    { RPD3R,      "RPD3R" },
+    { RPD4R,      "RPD4R" },
+    { RPD5R,      "RPD5R" },
+    { RPD6R,      "RPD6R" },
+    { RPD7R,      "RPD7R" },
+    { RPD9R,      "RPD9R" },
+    { RPD10R,     "RPD10R" },
+    { RPD11R,     "RPD11R" },
+    { RPD12R,     "RPD12R" },
+    { RPD14R,     "RPD14R" },
+    { RPD15R,     "RPD15R" },
+    { RPE3R,      "RPE3R" },
+    { RPE5R,      "RPE5R" },
+    { RPE8R,      "RPE8R" },
+    { RPE9R,      "RPE9R" },
+    { RPF0R,      "RPF0R" },
+    { RPF1R,      "RPF1R" },
+    { RPF2R,      "RPF2R" },
+    { RPF3R,      "RPF3R" },
+    { RPF4R,      "RPF4R" },
+    { RPF5R,      "RPF5R" },
+    { RPF8R,      "RPF8R" },
+    { RPF12R,     "RPF12R" },
+    { RPF13R,     "RPF13R" },
+    { RPG0R,      "RPG0R" },
+    { RPG1R,      "RPG1R" },
+    { RPG6R,      "RPG6R" },
+    { RPG7R,      "RPG7R" },
+    { RPG8R,      "RPG8R" },
+    { RPG9R,      "RPG9R" },
+};
+
+//
+// Save PPS registers into a snapshot.
+//
+void gpio_save_pps(gpio_snapshot_t *snap)
+{
+    int i;
+
+    for (i = 0; i < PPS_NINPUTS; i++)
+        snap->pps_input[i] = read_sfr(pps_input[i].offset);
+
+    for (i = 0; i < PPS_NOUTPUTS; i++)
+        snap->pps_output[i] = read_sfr(pps_output[i].offset);
+}
+
+//
+// Restore PPS registers from a snapshot.
+// Write only registers which differ from the live state.
+// Return a number of writes.
+//
+int gpio_restore_pps(const gpio_snapshot_t *snap)
+{
+    int i, nwrites = 0;
+
+    for (i = 0; i < PPS_NINPUTS; i++) {
+        if (read_sfr(pps_input[i].offset) != snap->pps_input[i]) {
+            write_sfr(pps_input[i].offset, snap->pps_input[i]);
+            nwrites++;
+        }
+    }
+
+    for (i = 0; i < PPS_NOUTPUTS; i++) {
+        if (read_sfr(pps_output[i].offset) != snap->pps_output[i]) {
+            write_sfr(pps_output[i].offset, snap->pps_output[i]);
+            nwrites++;
+        }
+    }
+    return nwrites;
+}
+
+//
+// Get name of PPS register by index in snapshot.
+//
+const char *gpio_pps_input_name(int index)
+{
+    return pps_input[index].name;
+}
+
+const char *gpio_pps_output_name(int index)
+{
+    return pps_output[index].name;
+}
+
+//
+// Append to the plan PPS writes, needed to set a pin to a given mode.
+// Same as gpio_clear_mapping() and gpio_set_mapping(), but
+// the hardware is not touched.
+//
+void gpio_plan_pps(gpio_plan_t *plan, int pin, gpio_mode_t mode)
+{
+    pps_plan = plan;
+
+    plan->phase = PHASE_UNMAP;
+    gpio_clear_mapping(pin);
+
+    if (mode > MODE_ANALOG) {
+        plan->phase = PHASE_MAP;
+        set_mapping(pin, mode);
+    }
+    pps_plan = 0;
+}
@@ -0,0 +1,588 @@
+/*
+ * Compact capture format for recorded pin activity.
+ *
+ * Copyright (C) 2019 Serge Vakulenko
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   1. Redistributions of source code must retain the above copyright notice,
+ *      this list of conditions and the following disclaimer.
+ *   2. Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer in the
+ *      documentation and/or other materials provided with the distribution.
+ *   3. The name of the author may not be used to endorse or promote products
+ *      derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR IMPLIED
+ * WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO
+ * EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+ * OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ * OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ * ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "gpio.h"
+
+//
+// File layout:
+//      header, padded to block size
+//      block 0
+//      ...
+//      block N-1
+//      index: array of N capture_index entries
+//      footer
+//
+// A block holds records of changes, every record starts with a tag byte:
+// bits 3:0 - port index, bits 7:4 - record type.
+//
+#define CAPTURE_MAGIC   "PIC32CAP"
+#define INDEX_MAGIC     "CAPINDEX"
+#define CAPTURE_VERSION 1
+#define BLOCK_SIZE      4096
+
+#define REC_CHANGE      0x00    // varint time delta, varint XOR mask
+#define REC_REPEAT      0x10    // varint count: repeat previous change
+
+#define MAX_RECORD      (1 + 10 + 5)
+
+struct capture_header {
+    char     magic[8];
+    uint32_t version;
+    uint32_t block_size;
+    uint64_t start_time;            // Nanoseconds
+    uint32_t mask[GPIO_NPORTS];     // Captured pins
+    uint64_t trigger_time;          // Zero when not triggered
+};
+
+struct capture_block {
+    uint64_t first_time;            // Time base for first record
+    uint64_t last_time;             // Time of last record
+    uint16_t nbytes;                // Bytes of records
+    uint16_t state[GPIO_NPORTS];    // Port values at block start
+    uint16_t unused;
+};
+
+struct capture_index {
+    uint64_t first_time;
+    uint64_t last_time;
+};
+
+struct capture_footer {
+    uint64_t index_offset;
+    uint32_t nblocks;
+    uint32_t unused;
+    char     magic[8];
+};
+
+#define BLOCK_DATA      (BLOCK_SIZE - sizeof(struct capture_block))
+
+//
+// Reading position.
+//
+struct cursor {
+    unsigned block_num;             // Current block
+    unsigned pos;                   // Offset of next record in block
+    unsigned long long time;        // Time of last event
+    unsigned long long delta;       // Interval of last change
+    unsigned repeat;                // Repeats left
+    gpio_event_t last;              // Event to repeat
+    unsigned state[GPIO_NPORTS];
+};
+
+struct gpio_capture {
+    int fd;
+    int writing;
+    struct capture_header hdr;
+
+    // Writer.
+    unsigned char block[BLOCK_SIZE];
+    struct capture_index *index;    // Grows with blocks
+    unsigned nblocks, index_size;
+    unsigned state[GPIO_NPORTS];    // Current port values
+    unsigned long long time;        // Time of last record
+    int last_port;                  // Last change, for run-length
+    unsigned long long last_delta;
+    unsigned last_mask;
+    unsigned repeat;                // Pending repeat count
+    int error;                      // Write failed: sticky
+
+    // Reader.
+    const unsigned char *map;
+    size_t map_size;
+    const struct capture_index *rindex;
+    struct cursor cur;
+};
+
+//
+// Encode unsigned number as LEB128 varint.
+//
+static unsigned put_varint(unsigned char *p, unsigned long long value)
+{
+    unsigned n = 0;
+
+    while (value >= 0x80) {
+        p[n++] = value | 0x80;
+        value >>= 7;
+    }
+    p[n++] = value;
+    return n;
+}
+
+//
+// Decode LEB128 varint.
+//
+static unsigned long long get_varint(const unsigned char **pp, const unsigned char *end)
+{
+    const unsigned char *p = *pp;
+    unsigned long long value = 0;
+    int shift = 0;
+
+    while (p < end && shift < 64) {
+        unsigned c = *p++;
+        value |= (unsigned long long) (c & 0x7f) << shift;
+        if (!(c & 0x80))
+            break;
+        shift += 7;
+    }
+    *pp = p;
+    return value;
+}
+
+static void block_start(gpio_capture_t *cap);
+
+//
+// Create a capture file, for pins given by per-port masks.
+//
+gpio_capture_t *gpio_capture_create(const char *filename,
+    const unsigned mask[GPIO_NPORTS], unsigned long long start)
+{
+    gpio_capture_t *cap = calloc(1, sizeof(*cap));
+    if (!cap)
+        return 0;
+
+    cap->fd = gpio_open_user(filename, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (cap->fd < 0) {
+        fprintf(stderr, "gpio: %s: %s\n", filename, strerror(errno));
+        free(cap);
+        return 0;
+    }
+    cap->writing = 1;
+
+    memcpy(cap->hdr.magic, CAPTURE_MAGIC, sizeof(cap->hdr.magic));
+    cap->hdr.version = CAPTURE_VERSION;
+    cap->hdr.block_size = BLOCK_SIZE;
+    cap->hdr.start_time = start;
+    memcpy(cap->hdr.mask, mask, sizeof(cap->hdr.mask));
+    cap->time = start;
+    cap->last_port = -1;
+
+    // Header occupies the first block.
+    memset(cap->block, 0, BLOCK_SIZE);
+    memcpy(cap->block, &cap->hdr, sizeof(cap->hdr));
+    if (write(cap->fd, cap->block, BLOCK_SIZE) != BLOCK_SIZE) {
+        fprintf(stderr, "gpio: %s: Write error\n", filename);
+        close(cap->fd);
+        free(cap);
+        return 0;
+    }
+    block_start(cap);
+    return cap;
+}
+
+//
+// Start new block with current port state.
+//
+static void block_start(gpio_capture_t *cap)
+{
+    struct capture_block *blk = (struct capture_block*) cap->block;
+    int port;
+
+    memset(cap->block, 0, BLOCK_SIZE);
+    blk->first_time = cap->time;
+    blk->last_time = cap->time;
+    for (port = 0; port < GPIO_NPORTS; port++)
+        blk->state[port] = cap->state[port];
+    cap->last_port = -1;
+    cap->repeat = 0;
+}
+
+//
+// Append bytes to current block.
+//
+static void block_put(gpio_capture_t *cap, const unsigned char *data, unsigned nbytes)
+{
+    struct capture_block *blk = (struct capture_block*) cap->block;
+
+    memcpy(cap->block + sizeof(*blk) + blk->nbytes, data, nbytes);
+    blk->nbytes += nbytes;
+}
+
+//
+// Write pending run-length record.
+//
+static void flush_repeat(gpio_capture_t *cap)
+{
+    unsigned char rec[MAX_RECORD];
+
+    if (cap->repeat == 0)
+        return;
+
+    rec[0] = REC_REPEAT | cap->last_port;
+    block_put(cap, rec, 1 + put_varint(rec + 1, cap->repeat));
+    cap->repeat = 0;
+}
+
+//
+// Write current block to the file, and add it to the index.
+//
+static void block_flush(gpio_capture_t *cap)
+{
+    struct capture_block *blk = (struct capture_block*) cap->block;
+
+    flush_repeat(cap);
+    if (blk->nbytes == 0)
+        return;
+
+    if (write(cap->fd, cap->block, BLOCK_SIZE) != BLOCK_SIZE) {
+        if (!cap->error)
+            fprintf(stderr, "gpio: Capture write error: %s\n", strerror(errno));
+        cap->error = 1;
+    }
+
+    if (cap->nblocks >= cap->index_size) {
+        cap->index_size = cap->index_size ? cap->index_size * 2 : 1024;
+        cap->index = realloc(cap->index, cap->index_size * sizeof(cap->index[0]));
+        if (!cap->index) {
+            fprintf(stderr, "gpio: Out of memory\n");
+            exit(-1);
+        }
+    }
+    cap->index[cap->nblocks].first_time = blk->first_time;
+    cap->index[cap->nblocks].last_time = blk->last_time;
+    cap->nblocks++;
+}
+
+//
+// Append a new value of port to the capture.
+//
+void gpio_capture_put(gpio_capture_t *cap, unsigned long long timestamp,
+    int port, unsigned value)
+{
+    struct capture_block *blk = (struct capture_block*) cap->block;
+    unsigned mask = (value ^ cap->state[port]) & cap->hdr.mask[port];
+
+    if (mask == 0)
+        return;
+
+    unsigned long long delta = timestamp - cap->time;
+    if (port == cap->last_port && delta == cap->last_delta && mask == cap->last_mask) {
+        // Same change after same interval: extend the run.
+        cap->repeat++;
+    } else {
+        unsigned char rec[MAX_RECORD];
+        unsigned n;
+
+        flush_repeat(cap);
+        if (blk->nbytes + 2*MAX_RECORD > BLOCK_DATA) {
+            // No room for this record and possible repeat after it.
+            block_flush(cap);
+            block_start(cap);
+            delta = 0;
+            blk->first_time = timestamp;
+        }
+        rec[0] = REC_CHANGE | port;
+        n = 1 + put_varint(rec + 1, delta);
+        n += put_varint(rec + n, mask);
+        block_put(cap, rec, n);
+
+        cap->last_port = port;
+        cap->last_delta = delta;
+        cap->last_mask = mask;
+    }
+    cap->time = timestamp;
+    cap->state[port] ^= mask;
+    blk->last_time = timestamp;
+}
+
+//
+// Finish writing and store the block index,
+// or close the file opened for reading.
+// Return -1 when any write of the capture failed.
+//
+int gpio_capture_close(gpio_capture_t *cap)
+{
+    int status = cap->error ? -1 : 0;
+
+    if (cap->writing) {
+        struct capture_footer footer;
+
+        block_flush(cap);
+        memset(&footer, 0, sizeof(footer));
+        footer.index_offset = (uint64_t) (cap->nblocks + 1) * BLOCK_SIZE;
+        footer.nblocks = cap->nblocks;
+        memcpy(footer.magic, INDEX_MAGIC, sizeof(footer.magic));
+
+        size_t nbytes = cap->nblocks * sizeof(cap->index[0]);
+        if ((nbytes > 0 && write(cap->fd, cap->index, nbytes) != nbytes) ||
+            write(cap->fd, &footer, sizeof(footer)) != sizeof(footer)) {
+            fprintf(stderr, "gpio: Capture write error: %s\n", strerror(errno));
+            status = -1;
+        }
+        if (close(cap->fd) < 0)
+            status = -1;
+        free(cap->index);
+    } else {
+        munmap((void*) cap->map, cap->map_size);
+        free(cap->index);
+    }
+    free(cap);
+    return status;
+}
+
+//
+// Get block by number.
+//
+static const struct capture_block *get_block(gpio_capture_t *cap, unsigned n)
+{
+    return (const struct capture_block*) (cap->map + (size_t) (n + 1) * BLOCK_SIZE);
+}
+
+//
+// Open a capture file for reading.
+//
+gpio_capture_t *gpio_capture_open(const char *filename)
+{
+    struct stat st;
+
+    int fd = gpio_open_user(filename, O_RDONLY, 0);
+    if (fd < 0) {
+        fprintf(stderr, "gpio: %s: %s\n", filename, strerror(errno));
+        return 0;
+    }
+    if (fstat(fd, &st) < 0 || st.st_size < BLOCK_SIZE) {
+        fprintf(stderr, "gpio: %s: Not a capture file\n", filename);
+        close(fd);
+        return 0;
+    }
+
+    void *map = mmap(0, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        fprintf(stderr, "gpio: %s: %s\n", filename, strerror(errno));
+        return 0;
+    }
+
+    gpio_capture_t *cap = calloc(1, sizeof(*cap));
+    if (!cap) {
+        munmap(map, st.st_size);
+        return 0;
+    }
+    cap->map = map;
+    cap->map_size = st.st_size;
+    memcpy(&cap->hdr, map, sizeof(cap->hdr));
+    if (memcmp(cap->hdr.magic, CAPTURE_MAGIC, sizeof(cap->hdr.magic)) != 0 ||
+        cap->hdr.version != CAPTURE_VERSION ||
+        cap->hdr.block_size != BLOCK_SIZE) {
+        fprintf(stderr, "gpio: %s: Not a capture file\n", filename);
+        gpio_capture_close(cap);
+        return 0;
+    }
+
+    // Use stored index, when present.  Offset and count are
+    // bounded first, so the size sum cannot wrap.
+    const struct capture_footer *footer = (const struct capture_footer*)
+        (cap->map + cap->map_size - sizeof(*footer));
+    if (memcmp(footer->magic, INDEX_MAGIC, sizeof(footer->magic)) == 0 &&
+        footer->index_offset <= cap->map_size - sizeof(*footer) &&
+        footer->nblocks <= (cap->map_size - sizeof(*footer) - footer->index_offset) /
+            sizeof(struct capture_index) &&
+        footer->index_offset + footer->nblocks * sizeof(struct capture_index) +
+            sizeof(*footer) == cap->map_size &&
+        (footer->nblocks + 1ULL) * BLOCK_SIZE <= footer->index_offset) {
+        cap->nblocks = footer->nblocks;
+        cap->rindex = (const struct capture_index*) (cap->map + footer->index_offset);
+    } else {
+        // Recording was interrupted: rebuild index from block headers.
+        unsigned n;
+
+        cap->nblocks = cap->map_size / BLOCK_SIZE - 1;
+        cap->index = calloc(cap->nblocks + 1, sizeof(cap->index[0]));
+        if (!cap->index) {
+            gpio_capture_close(cap);
+            return 0;
+        }
+        for (n = 0; n < cap->nblocks; n++) {
+            cap->index[n].first_time = get_block(cap, n)->first_time;
+            cap->index[n].last_time = get_block(cap, n)->last_time;
+        }
+        cap->rindex = cap->index;
+    }
+    gpio_capture_seek(cap, 0, 0);
+    return cap;
+}
+
+//
+// Get capture parameters.
+//
+unsigned long long gpio_capture_start(gpio_capture_t *cap)
+{
+    return cap->hdr.start_time;
+}
+
+unsigned long long gpio_capture_end(gpio_capture_t *cap)
+{
+    if (cap->nblocks == 0)
+        return cap->hdr.start_time;
+    return cap->rindex[cap->nblocks - 1].last_time;
+}
+
+unsigned gpio_capture_mask(gpio_capture_t *cap, int port)
+{
+    return cap->hdr.mask[port];
+}
+
+unsigned long long gpio_capture_trigger(gpio_capture_t *cap)
+{
+    return cap->hdr.trigger_time;
+}
+
+//
+// Mark the moment when capture was triggered.
+// The header is rewritten in place.
+//
+void gpio_capture_set_trigger(gpio_capture_t *cap, unsigned long long timestamp)
+{
+    cap->hdr.trigger_time = timestamp;
+    if (pwrite(cap->fd, &cap->hdr, sizeof(cap->hdr), 0) != sizeof(cap->hdr)) {
+        if (!cap->error)
+            fprintf(stderr, "gpio: Capture write error: %s\n", strerror(errno));
+        cap->error = 1;
+    }
+}
+
+//
+// Position at the start of a given block.
+// A block with bad size ends the capture.
+//
+static void block_enter(gpio_capture_t *cap, unsigned n)
+{
+    cap->cur.block_num = n;
+    cap->cur.pos = 0;
+    cap->cur.repeat = 0;
+    if (n < cap->nblocks) {
+        const struct capture_block *blk = get_block(cap, n);
+        int port;
+
+        if (blk->nbytes > BLOCK_DATA) {
+            fprintf(stderr, "gpio: Corrupt capture: block %u has %u bytes\n",
+                n, blk->nbytes);
+            cap->cur.block_num = cap->nblocks;
+            return;
+        }
+
+        cap->cur.time = blk->first_time;
+        for (port = 0; port < GPIO_NPORTS; port++)
+            cap->cur.state[port] = blk->state[port];
+    }
+}
+
+//
+// Get next event.  Return 0 at end of capture.
+//
+int gpio_capture_next(gpio_capture_t *cap, gpio_event_t *ev)
+{
+    for (;;) {
+        if (cap->cur.block_num >= cap->nblocks)
+            return 0;
+
+        if (cap->cur.repeat > 0) {
+            // Run of repeated changes.
+            cap->cur.repeat--;
+            cap->cur.time += cap->cur.delta;
+            ev->port = cap->cur.last.port;
+            ev->changed = cap->cur.last.changed;
+            break;
+        }
+
+        const struct capture_block *blk = get_block(cap, cap->cur.block_num);
+        const unsigned char *data = (const unsigned char*) (blk + 1);
+        if (cap->cur.pos >= blk->nbytes) {
+            block_enter(cap, cap->cur.block_num + 1);
+            continue;
+        }
+
+        const unsigned char *p = data + cap->cur.pos;
+        const unsigned char *end = data + blk->nbytes;
+        unsigned tag = *p++;
+
+        if ((tag & 0xf0) == REC_REPEAT) {
+            cap->cur.repeat = get_varint(&p, end);
+            cap->cur.pos = p - data;
+            continue;
+        }
+
+        cap->cur.delta = get_varint(&p, end);
+        cap->cur.time += cap->cur.delta;
+        ev->port = tag & 0xf;
+        ev->changed = get_varint(&p, end);
+        cap->cur.last = *ev;
+        cap->cur.pos = p - data;
+        if (ev->port >= GPIO_NPORTS)
+            return 0;
+        break;
+    }
+    cap->cur.state[ev->port] ^= ev->changed;
+    ev->value = cap->cur.state[ev->port];
+    ev->timestamp = cap->cur.time;
+    return 1;
+}
+
+//
+// Position at the first event not earlier than a given timestamp.
+// Binary search of the index finds the block, then
+// the block is scanned up to the requested time.
+//
+void gpio_capture_seek(gpio_capture_t *cap, unsigned long long timestamp,
+    unsigned state[GPIO_NPORTS])
+{
+    unsigned lo = 0, hi = cap->nblocks;
+
+    // Find the last block which starts not later than timestamp.
+    while (hi - lo > 1) {
+        unsigned mid = (lo + hi) / 2;
+
+        if (cap->rindex[mid].first_time <= timestamp)
+            lo = mid;
+        else
+            hi = mid;
+    }
+    block_enter(cap, lo);
+
+    // Skip earlier events.
+    for (;;) {
+        struct cursor saved = cap->cur;
+        gpio_event_t ev;
+
+        if (!gpio_capture_next(cap, &ev))
+            break;
+        if (ev.timestamp >= timestamp) {
+            cap->cur = saved;
+            break;
+        }
+    }
+    if (state)
+        memcpy(state, cap->cur.state, sizeof(cap->cur.state));
+}
@@ -0,0 +1,263 @@
+/*
+ * System and peripheral bus clocks of PIC32MZ.
+ *
+ * Copyright (C) 2019 Serge Vakulenko
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   1. Redistributions of source code must retain the above copyright notice,
+ *      this list of conditions and the following disclaimer.
+ *   2. Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer in the
+ *      documentation and/or other materials provided with the distribution.
+ *   3. The name of the author may not be used to endorse or promote products
+ *      derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR IMPLIED
+ * WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO
+ * EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+ * OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ * OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ * ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#include <stdio.h>
+#include "gpio.h"
+
+//
+// Oscillator control registers.
+//
+#define OSCCON      0x1f801200
+#define SPLLCON     0x1f801220
+#define PB1DIV      0x1f801300      // Next buses follow with step 0x10
+#define REFO1CON    0x1f801280      // Next generators follow with step 0x20
+#define REFOTRIM    (0x10/4)
+
+#define REFO_ON     0x8000
+#define REFO_OE     0x1000
+#define REFO_DIVSWEN 0x0200         // Apply new divider
+#define REFO_ACTIVE 0x0100          // Output is running
+
+//
+// Maximum frequency of REFCLKOx pins.
+//
+#define REFO_MAX_HZ 50000000
+
+//
+// Frequency of internal FRC oscillator.
+//
+#define FRC_HZ      8000000
+
+//
+// Frequency of primary oscillator is board specific.
+// It cannot be detected, and can be redefined at build time.
+//
+#ifndef GPIO_POSC_HZ
+#define GPIO_POSC_HZ 24000000
+#endif
+
+//
+// Get system clock frequency in Hz, by oscillator settings.
+//
+unsigned gpio_sysclk()
+{
+    unsigned osccon = *gpio_sfr(OSCCON);
+    unsigned spllcon, input, idiv, mult, odiv;
+
+    switch (osccon >> 12 & 7) {         // COSC
+    case 1:
+        // System PLL.
+        spllcon = *gpio_sfr(SPLLCON);
+        input = (spllcon & 0x80) ? FRC_HZ : GPIO_POSC_HZ;
+        idiv = (spllcon >> 8 & 7) + 1;
+        mult = (spllcon >> 16 & 0x7f) + 1;
+        odiv = spllcon >> 24 & 7;
+        if (odiv < 1)
+            odiv = 1;
+        if (odiv > 5)
+            odiv = 5;
+        return (unsigned long long) input / idiv * mult >> odiv;
+    case 2:
+        return GPIO_POSC_HZ;
+    case 5:
+        return 32000;                   // LPRC
+    case 7:
+        return FRC_HZ >> (osccon >> 24 & 7);
+    default:
+        return FRC_HZ;
+    }
+}
+
+//
+// Get frequency of peripheral bus clock PBCLKn, n = 1...7.
+// Timers, input capture and output compare run from PBCLK3,
+// SPI and I2C from PBCLK2.
+//
+unsigned gpio_pbclk(int bus)
+{
+    unsigned pbdiv = *gpio_sfr(PB1DIV + (bus - 1) * 0x10);
+
+    return gpio_sysclk() / ((pbdiv & 0x7f) + 1);
+}
+
+//
+// Get registers of reference clock generator REFOn, n = 1...4.
+//
+static volatile unsigned *refo_reg(int n)
+{
+    return gpio_sfr(REFO1CON + (n - 1) * 0x20);
+}
+
+//
+// Get the generator which drives the pin, or 0.
+//
+static int refo_module(int pin)
+{
+    switch (gpio_get_mode(pin)) {
+    case MODE_REFCLKO1: return 1;
+    case MODE_REFCLKO3: return 3;
+    case MODE_REFCLKO4: return 4;
+    default:            return 0;
+    }
+}
+
+static const gpio_mode_t refo_mode[5] = {
+    0, MODE_REFCLKO1, 0, MODE_REFCLKO3, MODE_REFCLKO4,
+};
+
+//
+// Compute divider of REFOx for a given input frequency.
+// Output is input / (2 * (RODIV + ROTRIM/512)), or input when RODIV=0.
+// Return the output frequency, or 0 when out of range.
+//
+static double refo_divide(unsigned input, unsigned hz, unsigned *rodiv, unsigned *rotrim)
+{
+    if (input == hz) {
+        *rodiv = 0;
+        *rotrim = 0;
+        return input;
+    }
+
+    // Divider in units of 1/512.
+    unsigned long long d = ((unsigned long long) input * 256 + hz / 2) / hz;
+    if (d < 512 || d > 0x7fffULL * 512 + 511)
+        return 0;
+
+    *rodiv = d >> 9;
+    *rotrim = d & 511;
+    return (double) input * 256 / d;
+}
+
+//
+// Start a reference clock on a pin, REFCLKO1, 3 or 4, with a given
+// frequency in Hz.  Among system clock, PBCLK1, primary oscillator
+// and internal FRC, the source which gives the least error is used;
+// at equal error, an integer divider is preferred as it has no jitter.
+// When the pin already has a reference clock, it is reprogrammed.
+// Return actual frequency, or 0 on error.
+//
+double gpio_refclk_start(int pin, unsigned hz)
+{
+    unsigned input[4], osccon = *gpio_sfr(OSCCON);
+    int n = refo_module(pin), i, posc;
+
+    if (hz == 0 || hz > REFO_MAX_HZ) {
+        fprintf(stderr, "gpio: Reference clock must be up to %u Hz\n", REFO_MAX_HZ);
+        return 0;
+    }
+    if (n == 0) {
+        // Find a free generator.
+        for (n = 1; n <= 4; n++) {
+            if (refo_mode[n] == 0 || !gpio_has_mapping(pin, refo_mode[n]) ||
+                (*refo_reg(n) & REFO_ON))
+                continue;
+            if (gpio_claim_function(refo_mode[n], "clock") == 0)
+                break;
+        }
+        if (n > 4) {
+            fprintf(stderr, "gpio: No free reference clock output for this pin\n");
+            return 0;
+        }
+    } else if (gpio_claim_function(refo_mode[n], "clock") < 0) {
+        // Reprogram the generator only when nobody else owns it.
+        return 0;
+    }
+
+    // Primary oscillator is considered only when it is running
+    // as the system clock or PLL input.
+    posc = ((osccon >> 12 & 7) == 2) ||
+           ((osccon >> 12 & 7) == 1 && !(*gpio_sfr(SPLLCON) & 0x80));
+    // Index is ROSEL value of the source.
+    input[0] = gpio_sysclk();
+    input[1] = gpio_pbclk(1);
+    input[2] = posc ? GPIO_POSC_HZ : 0;
+    input[3] = FRC_HZ;
+
+    int best = -1;
+    unsigned best_div = 0, best_trim = 0;
+    double best_out = 0, best_err = 0;
+
+    for (i = 0; i < 4; i++) {
+        unsigned rodiv, rotrim;
+        double out, err;
+
+        if (input[i] == 0)
+            continue;
+        out = refo_divide(input[i], hz, &rodiv, &rotrim);
+        if (out == 0)
+            continue;
+        err = (out > hz) ? out - hz : hz - out;
+        if (best < 0 || err < best_err ||
+            (err == best_err && rotrim == 0 && best_trim != 0)) {
+            best = i;
+            best_div = rodiv;
+            best_trim = rotrim;
+            best_out = out;
+            best_err = err;
+        }
+    }
+    if (best < 0) {
+        fprintf(stderr, "gpio: Cannot get %u Hz from any clock source\n", hz);
+        gpio_release_function(refo_mode[n]);
+        return 0;
+    }
+
+    volatile unsigned *refo = refo_reg(n);
+    int timeout;
+
+    // Source can be switched only when the output is inactive.
+    refo[0] = 0;
+    for (timeout = 100000; timeout > 0 && (refo[0] & REFO_ACTIVE); timeout--)
+        continue;
+
+    refo[REFOTRIM] = best_trim << 23;
+    refo[0] = best_div << 16 | REFO_OE | best;
+    refo[0] = best_div << 16 | REFO_OE | best | REFO_ON | REFO_DIVSWEN;
+
+    if (gpio_set_mode(pin, refo_mode[n]) < 0) {
+        refo[0] = 0;
+        gpio_release_function(refo_mode[n]);
+        return 0;
+    }
+    return best_out;
+}
+
+//
+// Stop a reference clock on a pin, and make it input.
+// Nothing is done when the pin or the generator is owned by another process.
+//
+void gpio_refclk_stop(int pin)
+{
+    int n = refo_module(pin);
+
+    if (n == 0 || gpio_check_owner(pin, refo_mode[n]) < 0)
+        return;
+
+    *refo_reg(n) = 0;
+    gpio_set_mode(pin, MODE_INPUT);
+    gpio_release_function(refo_mode[n]);
+}
@@ -0,0 +1,554 @@
+/*
+ * Protocol decoders for captured pin activity.
+ *
+ * Copyright (C) 2019 Serge Vakulenko
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   1. Redistributions of source code must retain the above copyright notice,
+ *      this list of conditions and the following disclaimer.
+ *   2. Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer in the
+ *      documentation and/or other materials provided with the distribution.
+ *   3. The name of the author may not be used to endorse or promote products
+ *      derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR IMPLIED
+ * WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO
+ * EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+ * OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ * OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ * ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdarg.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+#include <unistd.h>
+#include <getopt.h>
+#include "gpio.h"
+
+extern int pin_by_name(const char *name);
+
+#define MAX_SIGNALS     4
+#define MAX_DECODERS    8
+
+enum {
+    DECODE_UART,
+    DECODE_SPI,
+    DECODE_I2C,
+    DECODE_ONEWIRE,
+};
+
+//
+// Streaming decoder.  Levels of its signals are packed into
+// a word, bit N for signal N, and decoder is called on every
+// change of this word.
+//
+typedef struct decoder {
+    int kind;
+    char name[16];                  // Shown in output
+    int nsignals;
+    int port[MAX_SIGNALS];          // Port index of signal
+    unsigned mask[MAX_SIGNALS];     // Bit of signal in port word
+    unsigned level;                 // Current levels of signals
+
+    union {
+        struct {
+            double bit_time;        // Nanoseconds
+            int data_bits;          // 5...9
+            int parity;             // 0 - none, 1 - odd, 2 - even
+            int stop_bits;
+            int nbits;              // Bits in frame, including start
+            int k;                  // Next bit to sample, -1 when idle
+            unsigned long long start;
+            unsigned shift;
+        } uart;
+        struct {
+            int mode;               // 0...3
+            int nbits;
+            unsigned long long start;
+            unsigned mosi, miso;
+        } spi;
+        struct {
+            int nbits;
+            int first;              // Address byte expected
+            unsigned long long start;
+            unsigned shift;
+        } i2c;
+        struct {
+            unsigned long long fall;
+            unsigned long long reset;
+            unsigned long long start;
+            int nbits;
+            unsigned shift;
+        } ow;
+    } u;
+} decoder_t;
+
+static decoder_t decoder[MAX_DECODERS];
+static int ndecoders;
+static unsigned long long time_base;
+
+//
+// Print decoded item.
+//
+static void report(decoder_t *d, unsigned long long t, const char *fmt, ...)
+    __attribute__((format(printf, 3, 4)));
+
+static void report(decoder_t *d, unsigned long long t, const char *fmt, ...)
+{
+    va_list ap;
+
+    t -= time_base;
+    printf("%llu.%09llu %s ", t / 1000000000, t % 1000000000, d->name);
+    va_start(ap, fmt);
+    vprintf(fmt, ap);
+    va_end(ap);
+    printf("\n");
+}
+
+//
+// UART, LSB first.  Frame is sampled in the middle of every bit,
+// counting from the falling edge of the start bit.
+// Sampling points are reached by time, so the decoder is
+// advanced to the moment of every event before the level changes.
+//
+static void uart_advance(decoder_t *d, unsigned long long t)
+{
+    while (d->u.uart.k >= 0) {
+        int k = d->u.uart.k;
+        unsigned long long when = d->u.uart.start +
+            (unsigned long long) ((k + 0.5) * d->u.uart.bit_time);
+
+        if (when >= t)
+            return;
+
+        unsigned bit = d->level & 1;
+        if (k == 0) {
+            if (bit) {
+                // Glitch, not a start bit.
+                d->u.uart.k = -1;
+                return;
+            }
+        } else if (k <= d->u.uart.data_bits + (d->u.uart.parity != 0)) {
+            d->u.uart.shift |= bit << (k - 1);
+        } else if (!bit) {
+            report(d, d->u.uart.start, "framing error");
+            d->u.uart.k = -1;
+            return;
+        }
+
+        if (++d->u.uart.k < d->u.uart.nbits)
+            continue;
+
+        // Frame complete.
+        unsigned data = d->u.uart.shift & ((1 << d->u.uart.data_bits) - 1);
+        if (d->u.uart.parity) {
+            unsigned p = __builtin_parity(d->u.uart.shift) ^ (d->u.uart.parity == 2);
+            if (!p) {
+                report(d, d->u.uart.start, "0x%02x parity error", data);
+                d->u.uart.k = -1;
+                return;
+            }
+        }
+        if (data >= ' ' && data < 0x7f)
+            report(d, d->u.uart.start, "0x%02x '%c'", data, data);
+        else
+            report(d, d->u.uart.start, "0x%02x", data);
+        d->u.uart.k = -1;
+    }
+}
+
+static void uart_edge(decoder_t *d, unsigned long long t, unsigned old)
+{
+    if (d->u.uart.k < 0 && (old & 1) && !(d->level & 1)) {
+        // Start bit.
+        d->u.uart.k = 0;
+        d->u.uart.start = t;
+        d->u.uart.shift = 0;
+    }
+}
+
+//
+// SPI, MSB first.  Signals: 0 - SCK, 1 - MOSI, 2 - MISO, 3 - SS.
+// Data are sampled on leading edge of SCK for CPHA=0,
+// and on trailing edge for CPHA=1.
+//
+static void spi_edge(decoder_t *d, unsigned long long t, unsigned old)
+{
+    unsigned changed = old ^ d->level;
+    int cpol = d->u.spi.mode >> 1;
+    int cpha = d->u.spi.mode & 1;
+
+    if (d->nsignals > 3 && (changed & 8)) {
+        // Slave select: restart the byte.
+        d->u.spi.nbits = 0;
+        if (d->level & 8)
+            report(d, t, "end");
+        return;
+    }
+    if (d->nsignals > 3 && (d->level & 8))
+        return;
+    if (!(changed & 1))
+        return;
+
+    // Leading edge goes away from idle level.
+    int leading = (d->level & 1) != cpol;
+    if (leading == cpha)
+        return;
+
+    if (d->u.spi.nbits == 0) {
+        d->u.spi.start = t;
+        d->u.spi.mosi = 0;
+        d->u.spi.miso = 0;
+    }
+    d->u.spi.mosi = d->u.spi.mosi << 1 | ((d->level >> 1) & 1);
+    d->u.spi.miso = d->u.spi.miso << 1 | ((d->level >> 2) & 1);
+    if (++d->u.spi.nbits < 8)
+        return;
+
+    if (d->nsignals > 2)
+        report(d, d->u.spi.start, "mosi 0x%02x miso 0x%02x", d->u.spi.mosi, d->u.spi.miso);
+    else
+        report(d, d->u.spi.start, "0x%02x", d->u.spi.mosi);
+    d->u.spi.nbits = 0;
+}
+
+//
+// I2C.  Signals: 0 - SCL, 1 - SDA.
+// Change of SDA while SCL is high is a start or stop condition,
+// otherwise SDA is sampled on rising edge of SCL.
+//
+static void i2c_edge(decoder_t *d, unsigned long long t, unsigned old)
+{
+    unsigned changed = old ^ d->level;
+
+    if ((changed & 2) && (old & 1) && (d->level & 1)) {
+        if (d->level & 2) {
+            report(d, t, "stop");
+            d->u.i2c.nbits = -1;
+        } else {
+            report(d, t, "start");
+            d->u.i2c.nbits = 0;
+            d->u.i2c.first = 1;
+        }
+        return;
+    }
+    if (!(changed & 1) || !(d->level & 1) || d->u.i2c.nbits < 0)
+        return;
+
+    // Rising edge of SCL.
+    if (d->u.i2c.nbits == 0) {
+        d->u.i2c.start = t;
+        d->u.i2c.shift = 0;
+    }
+    d->u.i2c.shift = d->u.i2c.shift << 1 | ((d->level >> 1) & 1);
+    if (++d->u.i2c.nbits < 9)
+        return;
+
+    unsigned byte = d->u.i2c.shift >> 1;
+    const char *ack = (d->u.i2c.shift & 1) ? "nack" : "ack";
+    if (d->u.i2c.first)
+        report(d, d->u.i2c.start, "address 0x%02x %s %s", byte >> 1,
+            (byte & 1) ? "read" : "write", ack);
+    else
+        report(d, d->u.i2c.start, "0x%02x %s", byte, ack);
+    d->u.i2c.first = 0;
+    d->u.i2c.nbits = 0;
+}
+
+//
+// 1-Wire, LSB first.  Every slot is a low pulse, classified by width:
+// reset is longer than 480 usec, presence follows the reset,
+// short pulse is 1, long pulse is 0.
+//
+static void onewire_edge(decoder_t *d, unsigned long long t, unsigned old)
+{
+    if ((old & 1) && !(d->level & 1)) {
+        d->u.ow.fall = t;
+        return;
+    }
+    if ((old & 1) || !(d->level & 1) || d->u.ow.fall == 0)
+        return;
+
+    unsigned long long width = t - d->u.ow.fall;
+    if (width >= 480000) {
+        report(d, d->u.ow.fall, "reset");
+        d->u.ow.reset = t;
+        d->u.ow.nbits = 0;
+        return;
+    }
+    if (d->u.ow.reset != 0 && d->u.ow.fall - d->u.ow.reset < 80000 && width >= 60000) {
+        report(d, d->u.ow.fall, "presence");
+        d->u.ow.reset = 0;
+        return;
+    }
+    d->u.ow.reset = 0;
+
+    if (d->u.ow.nbits == 0) {
+        d->u.ow.start = d->u.ow.fall;
+        d->u.ow.shift = 0;
+    }
+    if (width < 15000)
+        d->u.ow.shift |= 1 << d->u.ow.nbits;
+    if (++d->u.ow.nbits < 8)
+        return;
+    report(d, d->u.ow.start, "0x%02x", d->u.ow.shift);
+    d->u.ow.nbits = 0;
+}
+
+//
+// Parse decoder specification:
+//      uart:<rx>:<baud>[:<format>]     format like 8N1
+//      spi:<sck>:<mosi>[:<miso>[:<ss>]][:<mode>]
+//      i2c:<scl>:<sda>
+//      1wire:<pin>
+//
+static void add_decoder(const char *spec)
+{
+    char buf[128], *field[8];
+    int nfields = 0, i;
+
+    if (ndecoders >= MAX_DECODERS) {
+        fprintf(stderr, "gpio: Too many decoders\n");
+        exit(-1);
+    }
+    decoder_t *d = &decoder[ndecoders];
+    memset(d, 0, sizeof(*d));
+
+    snprintf(buf, sizeof(buf), "%s", spec);
+    field[nfields++] = strtok(buf, ":");
+    while (nfields < 8 && (field[nfields] = strtok(0, ":")) != 0)
+        nfields++;
+    if (!field[0])
+        goto error;
+
+    if (strcasecmp(field[0], "uart") == 0) {
+        if (nfields < 3 || nfields > 4)
+            goto error;
+        d->kind = DECODE_UART;
+        d->nsignals = 1;
+        int baud = strtol(field[2], 0, 0);
+        if (baud <= 0)
+            goto error;
+        d->u.uart.bit_time = 1e9 / baud;
+        d->u.uart.data_bits = 8;
+        d->u.uart.stop_bits = 1;
+        if (nfields > 3) {
+            const char *f = field[3];
+            if (strlen(f) != 3 || f[0] < '5' || f[0] > '9' || f[2] < '1' || f[2] > '2')
+                goto error;
+            d->u.uart.data_bits = f[0] - '0';
+            switch (f[1]) {
+            case 'N': case 'n': d->u.uart.parity = 0; break;
+            case 'O': case 'o': d->u.uart.parity = 1; break;
+            case 'E': case 'e': d->u.uart.parity = 2; break;
+            default: goto error;
+            }
+            d->u.uart.stop_bits = f[2] - '0';
+        }
+        d->u.uart.nbits = 1 + d->u.uart.data_bits + (d->u.uart.parity != 0) +
+                          d->u.uart.stop_bits;
+        d->u.uart.k = -1;
+    } else if (strcasecmp(field[0], "spi") == 0) {
+        if (nfields < 3)
+            goto error;
+        d->kind = DECODE_SPI;
+        d->nsignals = nfields - 1;
+        if (field[nfields-1][0] >= '0' && field[nfields-1][0] <= '3' &&
+            field[nfields-1][1] == 0) {
+            d->u.spi.mode = field[nfields-1][0] - '0';
+            d->nsignals--;
+        }
+        if (d->nsignals < 2 || d->nsignals > 4)
+            goto error;
+    } else if (strcasecmp(field[0], "i2c") == 0) {
+        if (nfields != 3)
+            goto error;
+        d->kind = DECODE_I2C;
+        d->nsignals = 2;
+        d->u.i2c.nbits = -1;
+    } else if (strcasecmp(field[0], "1wire") == 0) {
+        if (nfields != 2)
+            goto error;
+        d->kind = DECODE_ONEWIRE;
+        d->nsignals = 1;
+    } else
+        goto error;
+
+    for (i = 0; i < d->nsignals; i++) {
+        int pin = pin_by_name(field[1 + i]);
+
+        d->port[i] = GPIO_PORTNUM(pin);
+        d->mask[i] = (uint16_t) pin;
+    }
+
+    // Name is numbered when the same protocol is decoded twice.
+    int count = 0;
+    for (i = 0; i < ndecoders; i++) {
+        if (decoder[i].kind == d->kind)
+            count++;
+    }
+    if (count > 0)
+        snprintf(d->name, sizeof(d->name), "%.5s%d", field[0], count + 1);
+    else
+        snprintf(d->name, sizeof(d->name), "%.5s", field[0]);
+    for (i = 0; d->name[i]; i++)
+        d->name[i] = toupper(d->name[i]);
+    ndecoders++;
+    return;
+error:
+    fprintf(stderr, "gpio: Bad decoder: %s\n", spec);
+    exit(-1);
+}
+
+//
+// Get levels of decoder signals from port words.
+//
+static unsigned get_levels(const decoder_t *d, const unsigned state[GPIO_NPORTS])
+{
+    unsigned level = 0;
+    int i;
+
+    for (i = 0; i < d->nsignals; i++) {
+        if (state[d->port[i]] & d->mask[i])
+            level |= 1 << i;
+    }
+    return level;
+}
+
+//
+// gpio decode [-s start] [-e end] <file> <decoder>...
+// Decode serial protocols from a capture file.
+// Start and end are in seconds from capture start.
+//
+void do_decode(int argc, char **argv)
+{
+    double from = 0, to = -1;
+
+    optind = 1;
+    for (;;) {
+        switch (getopt(argc, argv, "+s:e:")) {
+        case EOF:
+            break;
+        case 's':
+            from = strtod(optarg, 0);
+            continue;
+        case 'e':
+            to = strtod(optarg, 0);
+            continue;
+        default:
+            argc = 0;
+            continue;
+        }
+        break;
+    }
+    argc -= optind;
+    argv += optind;
+
+    if (argc < 2) {
+        fprintf(stderr, "Usage: gpio decode [-s start] [-e end] <file> <decoder>...\n");
+        fprintf(stderr, "Decoders:\n");
+        fprintf(stderr, "    uart:<rx>:<baud>[:8N1]\n");
+        fprintf(stderr, "    spi:<sck>:<mosi>[:<miso>[:<ss>]][:<mode>]\n");
+        fprintf(stderr, "    i2c:<scl>:<sda>\n");
+        fprintf(stderr, "    1wire:<pin>\n");
+        exit(-1);
+    }
+
+    gpio_capture_t *cap = gpio_capture_open(argv[0]);
+    if (!cap)
+        exit(-1);
+
+    int i, port;
+    for (i = 1; i < argc; i++)
+        add_decoder(argv[i]);
+
+    // Per port, which decoders are interested in it.
+    unsigned interest[GPIO_NPORTS], uarts = 0;
+    memset(interest, 0, sizeof(interest));
+    for (i = 0; i < ndecoders; i++) {
+        int k;
+        if (decoder[i].kind == DECODE_UART)
+            uarts |= 1 << i;
+        for (k = 0; k < decoder[i].nsignals; k++) {
+            port = decoder[i].port[k];
+            if (!(gpio_capture_mask(cap, port) & decoder[i].mask[k])) {
+                fprintf(stderr, "gpio: Signal %d of %s is not in the capture\n",
+                    k, decoder[i].name);
+                exit(-1);
+            }
+            interest[port] |= 1 << i;
+        }
+    }
+
+    time_base = gpio_capture_start(cap);
+    unsigned long long start = time_base + (unsigned long long) (from * 1e9);
+    unsigned long long end = (to < 0) ? gpio_capture_end(cap) :
+                             time_base + (unsigned long long) (to * 1e9);
+    unsigned state[GPIO_NPORTS];
+
+    gpio_capture_seek(cap, start, state);
+    for (i = 0; i < ndecoders; i++)
+        decoder[i].level = get_levels(&decoder[i], state);
+
+    gpio_event_t ev;
+    while (gpio_capture_next(cap, &ev) && ev.timestamp <= end) {
+        unsigned mask = interest[ev.port];
+
+        // UART bits are sampled by time: bring them up to this moment,
+        // at old levels, so that output stays in time order.
+        unsigned pending = uarts;
+        while (pending) {
+            i = __builtin_ctz(pending);
+            pending &= pending - 1;
+            if (decoder[i].u.uart.k >= 0)
+                uart_advance(&decoder[i], ev.timestamp);
+        }
+
+        state[ev.port] = ev.value;
+        while (mask) {
+            i = __builtin_ctz(mask);
+            mask &= mask - 1;
+
+            decoder_t *d = &decoder[i];
+            unsigned old = d->level;
+            unsigned level = get_levels(d, state);
+            if (level == old)
+                continue;
+
+            d->level = level;
+
+            switch (d->kind) {
+            case DECODE_UART:
+                uart_edge(d, ev.timestamp, old);
+                break;
+            case DECODE_SPI:
+                spi_edge(d, ev.timestamp, old);
+                break;
+            case DECODE_I2C:
+                i2c_edge(d, ev.timestamp, old);
+                break;
+            case DECODE_ONEWIRE:
+                onewire_edge(d, ev.timestamp, old);
+                break;
+            }
+        }
+    }
+
+    // Finish pending UART frames.
+    for (i = 0; i < ndecoders; i++) {
+        if (decoder[i].kind == DECODE_UART)
+            uart_advance(&decoder[i], end + 1);
+    }
+    gpio_capture_close(cap);
+}
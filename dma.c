@@ -0,0 +1,867 @@
+/*
+ * DMA engine of PIC32MZ: hardware-timed capture and output of port pins.
+ *
+ * Copyright (C) 2019 Serge Vakulenko
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   1. Redistributions of source code must retain the above copyright notice,
+ *      this list of conditions and the following disclaimer.
+ *   2. Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer in the
+ *      documentation and/or other materials provided with the distribution.
+ *   3. The name of the author may not be used to endorse or promote products
+ *      derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR IMPLIED
+ * WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO
+ * EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+ * OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ * OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ * ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#include <stdio.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <time.h>
+#include <errno.h>
+#include <dirent.h>
+#include <arpa/inet.h>
+#include <sys/mman.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include "gpio.h"
+
+extern int gpio_mem_fd;
+
+//
+// DMA controller registers.
+//
+#define DMACON      0x1f811000
+#define DCH0CON     0x1f811060      // Next channels follow with step 0xc0
+#define DMACON_ON   0x8000
+
+//
+// Channel registers, as word index from DCHxCON.
+//
+#define CH_CON      (0x00/4)
+#define CH_ECON     (0x10/4)
+#define CH_INT      (0x20/4)
+#define CH_SSA      (0x30/4)
+#define CH_DSA      (0x40/4)
+#define CH_SSIZ     (0x50/4)
+#define CH_DSIZ     (0x60/4)
+#define CH_SPTR     (0x70/4)
+#define CH_DPTR     (0x80/4)
+#define CH_CSIZ     (0x90/4)
+#define CH_CPTR     (0xa0/4)
+
+#define CON_CHEN    0x0080          // Channel enable
+#define CON_CHAEN   0x0010          // Re-enable after block transfer
+#define CON_CHPRI   0x0003          // Highest priority
+
+#define ECON_SIRQEN 0x0010          // Start transfer on CHSIRQ
+
+#define INT_CHBCIF  0x0008          // Block transfer complete
+#define INT_CHDHIF  0x0010          // Destination half full
+#define INT_CHDDIF  0x0020          // Destination done
+#define INT_CHSHIF  0x0040          // Source half empty
+#define INT_CHSDIF  0x0080          // Source done
+
+//
+// Memory for DMA buffers must be reserved from Linux.  The region is
+// given by a reserved-memory node of the device tree named gpio-dma,
+// like gpio-dma@9f00000.  Without it, the default address is used,
+// when /proc/iomem shows that Linux does not use it, for example
+// because of mem= kernel parameter.
+//
+#define DMABUF_ADDR 0x09f00000
+#define DMABUF_SIZE 0x00100000
+#define DMABUF_DT   "/proc/device-tree/reserved-memory"
+
+//
+// Timer and channel used for capture.  Every channel is used with
+// its own timer, so claiming the TxCK function of the timer
+// reserves both against other processes.
+//
+#define CAPTURE_TIMER   6
+#define CAPTURE_CHAN    7
+#define CAPTURE_OFFSET  0           // Offset in DMA region
+#define CAPTURE_SAMPLES 16384       // Both halves
+
+//
+// Timer and channel used for pattern output, reserved
+// by the TxCK function of the timer, like for capture.
+//
+#define PATTERN_TIMER   7
+#define PATTERN_CHAN    6
+#define PATTERN_OFFSET  0x10000     // Offset in DMA region
+#define PATTERN_HALF    4096        // Words in half of buffer
+
+static unsigned dmabuf_addr;        // Physical address of DMA region
+static uint8_t *dmabuf;             // DMA region mapped here
+static pthread_once_t dmabuf_once = PTHREAD_ONCE_INIT;
+
+//
+// Find reserved-memory node gpio-dma in the device tree.
+// Return its address, or 0 when not found or too small.
+//
+static unsigned dmabuf_from_dt()
+{
+    DIR *dir = opendir(DMABUF_DT);
+    struct dirent *d;
+    unsigned addr = 0;
+
+    if (!dir)
+        return 0;
+    while ((d = readdir(dir)) != 0) {
+        if (strncmp(d->d_name, "gpio-dma", 8) != 0)
+            continue;
+
+        char path[512];
+        uint32_t reg[2];
+        snprintf(path, sizeof(path), "%s/%s/reg", DMABUF_DT, d->d_name);
+        FILE *f = fopen(path, "rb");
+        if (!f)
+            continue;
+        if (fread(reg, sizeof(reg), 1, f) == 1 && fgetc(f) == EOF &&
+            ntohl(reg[1]) >= DMABUF_SIZE)
+            addr = ntohl(reg[0]);
+        fclose(f);
+        break;
+    }
+    closedir(dir);
+    return addr;
+}
+
+//
+// Check that no resource in /proc/iomem, like System RAM,
+// overlaps the region.  Return 0 when free, -1 otherwise.
+//
+static int dmabuf_check_free(unsigned addr)
+{
+    FILE *f = fopen("/proc/iomem", "r");
+    unsigned long long start, end;
+    char line[256];
+    int result = 0;
+
+    if (!f) {
+        fprintf(stderr, "gpio: /proc/iomem: %s\n", strerror(errno));
+        return -1;
+    }
+    while (fgets(line, sizeof(line), f)) {
+        // Top-level resources only.
+        if (line[0] == ' ' || sscanf(line, "%llx-%llx", &start, &end) != 2)
+            continue;
+        if (start < addr + DMABUF_SIZE && end >= addr) {
+            fprintf(stderr, "gpio: DMA region %08x is used by Linux: %s", addr, line);
+            result = -1;
+            break;
+        }
+    }
+    fclose(f);
+    return result;
+}
+
+//
+// Map the DMA region through the same /dev/mem handle as registers.
+// On error, dmabuf stays zero.
+//
+static void dmabuf_init()
+{
+    gpio_open();
+    if (gpio_model) {
+        dmabuf_addr = DMABUF_ADDR;
+    } else {
+        dmabuf_addr = dmabuf_from_dt();
+        if (dmabuf_addr == 0) {
+            dmabuf_addr = DMABUF_ADDR;
+            if (dmabuf_check_free(dmabuf_addr) < 0) {
+                fprintf(stderr, "gpio: No reserved memory for DMA\n");
+                return;
+            }
+        }
+    }
+    void *p = mmap(0, DMABUF_SIZE, PROT_READ|PROT_WRITE, MAP_SHARED,
+        gpio_mem_fd, dmabuf_addr);
+    if (p == MAP_FAILED) {
+        fprintf(stderr, "gpio: DMA buffer mmap failed: %s\n", strerror(errno));
+        return;
+    }
+    dmabuf = p;
+}
+
+//
+// Get pointer to channel registers.
+//
+static volatile unsigned *dma_channel(int chan)
+{
+    return gpio_sfr(DCH0CON + chan * 0xc0);
+}
+
+//
+// Set and clear register bits.  Hardware has SET and CLR
+// registers for that; simulated registers are plain memory
+// shared with the model thread, so atomics are used instead.
+//
+static void reg_set(volatile unsigned *reg, unsigned mask)
+{
+    if (gpio_model)
+        __atomic_fetch_or((unsigned*) reg, mask, __ATOMIC_SEQ_CST);
+    else
+        reg[2] = mask;
+}
+
+static void reg_clr(volatile unsigned *reg, unsigned mask)
+{
+    if (gpio_model)
+        __atomic_fetch_and((unsigned*) reg, ~mask, __ATOMIC_SEQ_CST);
+    else
+        reg[1] = mask;
+}
+
+//
+// Translate physical address for the model.
+//
+static volatile uint8_t *model_phys(unsigned addr)
+{
+    if (addr >= dmabuf_addr && addr < dmabuf_addr + DMABUF_SIZE)
+        return dmabuf + (addr - dmabuf_addr);
+    return (volatile uint8_t*) gpio_sfr(addr & ~3) + (addr & 3);
+}
+
+//
+// Write a byte for the model.  Registers at offsets 4, 8 and 12
+// from every peripheral register clear, set or invert its bits.
+//
+static void model_write(unsigned addr, uint8_t data)
+{
+    if (addr < 0x1f800000 || (addr & 0xc) == 0) {
+        *model_phys(addr) = data;
+        return;
+    }
+
+    volatile uint8_t *reg = model_phys((addr & ~0xf) | (addr & 3));
+    switch (addr >> 2 & 3) {
+    case 1: *reg &= ~data; break;
+    case 2: *reg |= data;  break;
+    case 3: *reg ^= data;  break;
+    }
+}
+
+//
+// Software model of a DMA channel started by a timer.
+// Every timer period, one cell is transferred, and pointers and
+// interrupt flags are updated the same way as by hardware.
+// Transfers are done in batches every millisecond,
+// as many as timer periods have elapsed.
+//
+struct model {
+    int chan;
+    int timer;
+    atomic_int stop;
+    pthread_t thread;
+};
+
+static void model_cell(volatile unsigned *ch)
+{
+    unsigned ssiz = ch[CH_SSIZ] & 0xffff, dsiz = ch[CH_DSIZ] & 0xffff;
+    unsigned csiz = ch[CH_CSIZ] & 0xffff;
+    unsigned sptr = ch[CH_SPTR], dptr = ch[CH_DPTR];
+    unsigned flags = 0, i;
+
+    if (ssiz == 0) ssiz = 0x10000;
+    if (dsiz == 0) dsiz = 0x10000;
+    if (csiz == 0) csiz = 0x10000;
+
+    for (i = 0; i < csiz; i++) {
+        model_write(ch[CH_DSA] + dptr, *model_phys(ch[CH_SSA] + sptr));
+        if (++sptr == ssiz / 2)
+            flags |= INT_CHSHIF;
+        if (++dptr == dsiz / 2)
+            flags |= INT_CHDHIF;
+        if (sptr == ssiz) {
+            sptr = 0;
+            if (ssiz >= dsiz)
+                flags |= INT_CHSDIF | INT_CHBCIF;
+        }
+        if (dptr == dsiz) {
+            dptr = 0;
+            if (dsiz >= ssiz)
+                flags |= INT_CHDDIF | INT_CHBCIF;
+        }
+    }
+    if (flags & INT_CHBCIF) {
+        sptr = dptr = 0;
+        if (!(ch[CH_CON] & CON_CHAEN))
+            reg_clr(&ch[CH_CON], CON_CHEN);
+    }
+    ch[CH_SPTR] = sptr;
+    ch[CH_DPTR] = dptr;
+    reg_set(&ch[CH_INT], flags);
+}
+
+static void *model_thread(void *arg)
+{
+    struct model *m = arg;
+    volatile unsigned *ch = dma_channel(m->chan);
+    struct timespec deadline;
+    unsigned long long ticks = 0, done = 0, nsec = 0;
+
+    clock_gettime(CLOCK_MONOTONIC, &deadline);
+    while (!atomic_load(&m->stop)) {
+        deadline.tv_nsec += 1000000;
+        if (deadline.tv_nsec >= 1000000000) {
+            deadline.tv_nsec -= 1000000000;
+            deadline.tv_sec++;
+        }
+        clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &deadline, 0);
+
+        unsigned freq = gpio_timer_freq(m->timer);
+        if (freq == 0)
+            continue;
+
+        // Timer events during this millisecond.
+        nsec += 1000000;
+        ticks = nsec * freq / 1000000000;
+        for (; done < ticks; done++) {
+            if ((ch[CH_CON] & CON_CHEN) && (ch[CH_ECON] & ECON_SIRQEN) &&
+                (ch[CH_ECON] >> 8 & 0xff) == gpio_timer_irq(m->timer))
+                model_cell(ch);
+        }
+    }
+    return 0;
+}
+
+static void model_start(struct model *m, int chan, int timer)
+{
+    m->chan = chan;
+    m->timer = timer;
+    atomic_init(&m->stop, 0);
+    if (pthread_create(&m->thread, 0, model_thread, m) != 0) {
+        fprintf(stderr, "gpio: Cannot start DMA model thread\n");
+        exit(-1);
+    }
+}
+
+static void model_stop(struct model *m)
+{
+    atomic_store(&m->stop, 1);
+    pthread_join(m->thread, 0);
+}
+
+//
+// Program a channel: transfer a cell on every event of the timer,
+// and restart after every block.
+//
+static void dma_setup(volatile unsigned *ch, int timer, unsigned src, unsigned ssiz,
+    unsigned dst, unsigned dsiz, unsigned csiz)
+{
+    volatile unsigned *dmacon = gpio_sfr(DMACON);
+
+    if (!(*dmacon & DMACON_ON))
+        reg_set(dmacon, DMACON_ON);
+
+    ch[CH_CON] = 0;
+    ch[CH_INT] = 0;
+    ch[CH_ECON] = gpio_timer_irq(timer) << 8 | ECON_SIRQEN;
+    ch[CH_SSA] = src;
+    ch[CH_DSA] = dst;
+    ch[CH_SSIZ] = ssiz & 0xffff;
+    ch[CH_DSIZ] = dsiz & 0xffff;
+    ch[CH_CSIZ] = csiz;
+    ch[CH_SPTR] = 0;
+    ch[CH_DPTR] = 0;
+    ch[CH_CON] = CON_CHAEN | CON_CHPRI | CON_CHEN;
+}
+
+//
+// Hardware-timed capture: timer triggers the DMA channel,
+// which copies PORTx into a circular buffer.  Completed halves
+// of the buffer are marked by CHDHIF and CHDDIF flags.
+//
+static struct {
+    volatile unsigned *ch;          // Channel registers
+    volatile uint16_t *buf;         // Samples
+    unsigned rate;                  // Actual sample rate
+    int half;                       // Next half to drain
+    unsigned pos;                   // Next sample to read
+    unsigned avail;                 // Samples left in current half
+    unsigned overruns;              // Halves overwritten before drained
+    unsigned long long total;       // Samples read or lost
+    struct timespec start;          // Time when timer started
+    int running;
+    struct model model;
+} cap;
+
+//
+// Start capture of a port with given sample rate, in Hz.
+// Return actual rate, or 0 on error.
+//
+unsigned gpio_dmacap_start(int port, unsigned rate)
+{
+    pthread_once(&dmabuf_once, dmabuf_init);
+    if (!dmabuf)
+        return 0;
+
+    if (gpio_claim_function(MODE_T2CK + CAPTURE_TIMER - 2, "record") < 0)
+        return 0;
+    cap.ch = dma_channel(CAPTURE_CHAN);
+    if (gpio_timer_busy(CAPTURE_TIMER) || (cap.ch[CH_CON] & CON_CHEN)) {
+        fprintf(stderr, "gpio: Timer %d or DMA channel %d is busy\n",
+            CAPTURE_TIMER, CAPTURE_CHAN);
+        gpio_release_function(MODE_T2CK + CAPTURE_TIMER - 2);
+        return 0;
+    }
+
+    cap.rate = gpio_timer_start(CAPTURE_TIMER, rate);
+    if (cap.rate == 0) {
+        gpio_release_function(MODE_T2CK + CAPTURE_TIMER - 2);
+        return 0;
+    }
+
+    cap.buf = (volatile uint16_t*) (dmabuf + CAPTURE_OFFSET);
+    cap.half = 0;
+    cap.pos = 0;
+    cap.avail = 0;
+    cap.overruns = 0;
+    cap.total = 0;
+    memset((void*) cap.buf, 0, CAPTURE_SAMPLES * 2);
+
+    // Source is low half of PORTx register, 2 bytes per cell.
+    unsigned port_reg = 0x1f860000 + port * 0x100 + GPIO_PORT * 0x10;
+    dma_setup(cap.ch, CAPTURE_TIMER, port_reg, 2,
+        dmabuf_addr + CAPTURE_OFFSET, CAPTURE_SAMPLES * 2, 2);
+
+    clock_gettime(CLOCK_MONOTONIC, &cap.start);
+    if (gpio_model)
+        model_start(&cap.model, CAPTURE_CHAN, CAPTURE_TIMER);
+    cap.running = 1;
+    return cap.rate;
+}
+
+//
+// Stop capture.
+//
+void gpio_dmacap_stop()
+{
+    if (!cap.running)
+        return;
+    reg_clr(&cap.ch[CH_CON], CON_CHEN);
+    gpio_timer_stop(CAPTURE_TIMER);
+    if (gpio_model)
+        model_stop(&cap.model);
+    gpio_release_function(MODE_T2CK + CAPTURE_TIMER - 2);
+    cap.running = 0;
+}
+
+//
+// Count halves lost when DMA is found back in the half to read.
+// It could lap the buffer more than once: the number of halves
+// is estimated by time since start, and is odd, as reading
+// resumes at the other half.
+//
+static unsigned dmacap_lost()
+{
+    const unsigned half_size = CAPTURE_SAMPLES / 2;
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    long long elapsed = (now.tv_sec - cap.start.tv_sec) * 1000000000LL +
+                        now.tv_nsec - cap.start.tv_nsec;
+    long long sample = elapsed * cap.rate / 1000000000;
+
+    // The other half was completed last; DMA is at dpos in this one.
+    unsigned dpos = (cap.ch[CH_DPTR] / 2) % half_size;
+    long long next = sample - dpos - half_size;
+    long long nhalves = (next - (long long) cap.total + half_size/2) / half_size;
+
+    if (nhalves < 1)
+        nhalves = 1;
+    return (nhalves | 1) * half_size;
+}
+
+//
+// Get samples from completed halves of the buffer, up to max.
+// A half is lost when DMA has completed the other half too
+// by the time it is drained: it is being overwritten.  Then
+// reading stops before the gap, and the next call skips it,
+// setting *lost to a number of samples missing before the ones
+// it returns.  Never blocks: return a number of samples,
+// 0 when nothing is ready.
+//
+int gpio_dmacap_read(unsigned short *buf, int max, unsigned *lost)
+{
+    const unsigned half_size = CAPTURE_SAMPLES / 2;
+    int n = 0;
+
+    *lost = 0;
+    while (n < max) {
+        if (cap.avail == 0) {
+            unsigned flag = cap.half ? INT_CHDDIF : INT_CHDHIF;
+            unsigned other = cap.half ? INT_CHDHIF : INT_CHDDIF;
+            unsigned intf = cap.ch[CH_INT];
+
+            if (!(intf & flag))
+                break;
+            if (intf & other) {
+                // DMA is back in this half: skip it.
+                if (n > 0)
+                    break;
+                reg_clr(&cap.ch[CH_INT], flag);
+                unsigned nlost = dmacap_lost();
+                cap.overruns += nlost / half_size;
+                cap.total += nlost;
+                *lost += nlost;
+                cap.half ^= 1;
+                continue;
+            }
+            reg_clr(&cap.ch[CH_INT], flag);
+            cap.pos = cap.half * half_size;
+            cap.avail = half_size;
+        }
+
+        unsigned count = cap.avail;
+        if (count > max - n)
+            count = max - n;
+        memcpy(buf + n, (const void*) (cap.buf + cap.pos), count * 2);
+        n += count;
+        cap.pos += count;
+        cap.avail -= count;
+        cap.total += count;
+
+        if (cap.avail == 0)
+            cap.half ^= 1;
+    }
+    return n;
+}
+
+//
+// Get a number of buffer halves overwritten before they were read.
+//
+unsigned gpio_dmacap_overruns()
+{
+    return cap.overruns;
+}
+
+//
+// Pattern output: timer triggers the DMA channel, which copies
+// words from a buffer into LATx or LATxINV register.
+// For streaming, the buffer is split in two halves: while one
+// is played, the other is refilled.  Halves are released by
+// CHSHIF and CHSDIF flags.  At the end of stream, auto-enable
+// is cleared, and the channel stops after the last block.
+//
+static struct {
+    volatile unsigned *ch;          // Channel registers
+    volatile uint32_t *buf;         // Words to output
+    unsigned rate;                  // Actual word rate
+    int flags;                      // Loop, invert
+    int port;
+    int fill_half;                  // Half being filled
+    unsigned fill_pos;              // Words in this half
+    int free[2];                    // Half can be filled
+    int playing;                    // Timer started
+    int ending;                     // No more data
+    int pad_half;                   // Half to pad at the end, or -1
+    int underrun;                   // Stopped: DMA reached a stale half
+    int claimed;                    // Timer, channel and pins are reserved
+    uint32_t idle;                  // Word to keep the output steady
+    struct model model;
+} pat;
+
+//
+// Start the timer: output begins.
+//
+static void pattern_play()
+{
+    pat.rate = gpio_timer_start(PATTERN_TIMER, pat.rate);
+    if (gpio_model)
+        model_start(&pat.model, PATTERN_CHAN, PATTERN_TIMER);
+    pat.playing = 1;
+}
+
+//
+// Stop the timer and the channel.
+//
+static void pattern_halt()
+{
+    reg_clr(&pat.ch[CH_CON], CON_CHEN);
+    gpio_timer_stop(PATTERN_TIMER);
+    if (pat.playing && gpio_model)
+        model_stop(&pat.model);
+    pat.playing = 0;
+}
+
+//
+// Release halves which DMA has consumed.  When DMA is found
+// in a half which was not refilled since it was played,
+// the producer fell behind: stale words are being output.
+// Stop right there, rather than replay them.
+//
+static void pattern_poll()
+{
+    unsigned intf = pat.ch[CH_INT];
+
+    if (intf & INT_CHSHIF) {
+        reg_clr(&pat.ch[CH_INT], INT_CHSHIF);
+        pat.free[0] = 1;
+    }
+    if (intf & INT_CHSDIF) {
+        reg_clr(&pat.ch[CH_INT], INT_CHSDIF);
+        pat.free[1] = 1;
+    }
+    if (pat.flags & PATTERN_LOOP)
+        return;
+
+    // Pointer is valid only while the channel is still enabled.
+    unsigned half = pat.ch[CH_SPTR] / (PATTERN_HALF * 4);
+    if ((pat.ch[CH_CON] & CON_CHEN) && half < 2 && pat.free[half]) {
+        pattern_halt();
+        pat.underrun = 1;
+        return;
+    }
+
+    if ((intf & INT_CHSDIF) && pat.pad_half == 1) {
+        // Last block has started: fill the rest with idle
+        // words, and let the channel stop after it.
+        unsigned i;
+        for (i = 0; i < PATTERN_HALF; i++)
+            pat.buf[PATTERN_HALF + i] = pat.idle;
+        pat.free[1] = 0;
+        reg_clr(&pat.ch[CH_CON], CON_CHAEN);
+        pat.pad_half = -1;
+    }
+}
+
+//
+// Release pins of the pattern port, up to a given bit.
+//
+static void pattern_release_pins(int nbits)
+{
+    int bit;
+
+    for (bit = 0; bit < nbits; bit++)
+        gpio_release((pat.port << 24) | (1 << bit));
+}
+
+//
+// The channel rewrites all of LATx on every word: claim every
+// pin of the port.  Return 0 on success, -1 when some pin is
+// owned by another process.
+//
+static int pattern_claim_pins()
+{
+    int bit;
+
+    for (bit = 0; bit < 16; bit++) {
+        if (gpio_claim((pat.port << 24) | (1 << bit), "pattern") < 0) {
+            pattern_release_pins(bit);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+//
+// Prepare pattern output to a port, with given word rate in Hz.
+// Flags: PATTERN_INVERT to write into LATxINV, PATTERN_LOOP
+// to repeat the buffer forever.  Output starts when both halves
+// of the buffer are filled, or by gpio_pattern_flush().
+// Return actual rate, or 0 on error, or when the timer, the channel
+// or a pin of the port is used by somebody else.
+//
+unsigned gpio_pattern_start(int port, unsigned rate, int flags)
+{
+    pthread_once(&dmabuf_once, dmabuf_init);
+    if (!dmabuf)
+        return 0;
+
+    // Check that the timer can do it, but do not run yet.
+    rate = gpio_timer_rate(PATTERN_TIMER, rate);
+    if (rate == 0)
+        return 0;
+
+    if (gpio_claim_function(MODE_T2CK + PATTERN_TIMER - 2, "pattern") < 0)
+        return 0;
+    pat.ch = dma_channel(PATTERN_CHAN);
+    if (gpio_timer_busy(PATTERN_TIMER) || (pat.ch[CH_CON] & CON_CHEN)) {
+        fprintf(stderr, "gpio: Timer %d or DMA channel %d is busy\n",
+            PATTERN_TIMER, PATTERN_CHAN);
+        gpio_release_function(MODE_T2CK + PATTERN_TIMER - 2);
+        return 0;
+    }
+    pat.port = port;
+    if (pattern_claim_pins() < 0) {
+        gpio_release_function(MODE_T2CK + PATTERN_TIMER - 2);
+        return 0;
+    }
+    pat.claimed = 1;
+    pat.rate = rate;
+    pat.buf = (volatile uint32_t*) (dmabuf + PATTERN_OFFSET);
+    pat.flags = flags;
+    pat.fill_half = 0;
+    pat.fill_pos = 0;
+    pat.free[0] = pat.free[1] = 1;
+    pat.playing = 0;
+    pat.ending = 0;
+    pat.pad_half = -1;
+    pat.underrun = 0;
+
+    unsigned lat = 0x1f860000 + port * 0x100 + GPIO_LAT * 0x10;
+    if (flags & PATTERN_INVERT) {
+        pat.idle = 0;
+        lat += 0xc;
+    } else
+        pat.idle = *gpio_port_reg(port, GPIO_LAT);
+
+    dma_setup(pat.ch, PATTERN_TIMER, dmabuf_addr + PATTERN_OFFSET,
+        PATTERN_HALF * 2 * 4, lat, 4, 4);
+    return pat.rate;
+}
+
+//
+// Queue words for output.  Never blocks: return a number of words
+// accepted, 0 when both halves are still playing, or -1 when
+// output was stopped by underrun.
+// In loop mode, all words must be queued before gpio_pattern_flush().
+//
+int gpio_pattern_queue(const unsigned short *words, int n)
+{
+    int count = 0;
+
+    if (pat.underrun)
+        return -1;
+    if (pat.ending)
+        return 0;
+    if (pat.playing) {
+        pattern_poll();
+        if (pat.underrun)
+            return -1;
+    }
+
+    while (count < n && pat.free[pat.fill_half]) {
+        unsigned base = pat.fill_half * PATTERN_HALF;
+
+        while (count < n && pat.fill_pos < PATTERN_HALF)
+            pat.buf[base + pat.fill_pos++] = words[count++];
+
+        if (pat.fill_pos < PATTERN_HALF)
+            break;
+        pat.free[pat.fill_half] = 0;
+        pat.fill_half ^= 1;
+        pat.fill_pos = 0;
+    }
+    if (count > 0 && !(pat.flags & PATTERN_INVERT))
+        pat.idle = words[count - 1];
+
+    if (!pat.playing && !pat.free[0] && !pat.free[1] && !(pat.flags & PATTERN_LOOP))
+        pattern_play();
+    return count;
+}
+
+//
+// No more data: play the rest of queued words.
+// In loop mode, start repeating the buffer.
+//
+void gpio_pattern_flush()
+{
+    unsigned i;
+
+    if (pat.ending || pat.underrun)
+        return;
+    pat.ending = 1;
+
+    if (pat.flags & PATTERN_LOOP) {
+        // Source size is exactly the queued words.
+        unsigned nwords = pat.fill_half * PATTERN_HALF + pat.fill_pos;
+        if (nwords == 0)
+            return;
+        pat.ch[CH_SSIZ] = (nwords * 4) & 0xffff;
+        pattern_play();
+        return;
+    }
+
+    // Pad partially filled half.
+    if (pat.fill_pos > 0) {
+        unsigned base = pat.fill_half * PATTERN_HALF;
+        for (i = pat.fill_pos; i < PATTERN_HALF; i++)
+            pat.buf[base + i] = pat.idle;
+        pat.free[pat.fill_half] = 0;
+        pat.fill_half ^= 1;
+        pat.fill_pos = 0;
+    } else if (!pat.playing && pat.free[0]) {
+        // Nothing queued.
+        return;
+    }
+
+    if (pat.fill_half == 1) {
+        // Last data are in the first half.
+        if (!pat.playing || pat.free[1]) {
+            // Second half is not used: pad it now.
+            for (i = 0; i < PATTERN_HALF; i++)
+                pat.buf[PATTERN_HALF + i] = pat.idle;
+            pat.free[1] = 0;
+            reg_clr(&pat.ch[CH_CON], CON_CHAEN);
+        } else {
+            // Wait until the previous block completes.
+            pat.pad_half = 1;
+        }
+    } else {
+        // Last data are in the second half, of the current block.
+        reg_clr(&pat.ch[CH_CON], CON_CHAEN);
+    }
+    if (!pat.playing)
+        pattern_play();
+}
+
+//
+// Check whether output is still running.
+// Return -1 when it was stopped by underrun.
+//
+int gpio_pattern_busy()
+{
+    if (pat.underrun)
+        return -1;
+    if (!pat.playing)
+        return 0;
+    pattern_poll();
+    if (pat.underrun)
+        return -1;
+    return (pat.ch[CH_CON] & CON_CHEN) != 0;
+}
+
+//
+// Sleep before polling again.  A quarter of the time to play
+// a half of the buffer leaves the producer enough margin
+// to refill it, and to pad the last block in time.
+//
+void gpio_pattern_wait()
+{
+    unsigned usec = 1000;
+
+    if (pat.rate > 0 && (unsigned long long) PATTERN_HALF * 250000 / pat.rate < usec)
+        usec = (unsigned long long) PATTERN_HALF * 250000 / pat.rate;
+    usleep(usec);
+}
+
+//
+// Stop output immediately.
+//
+void gpio_pattern_stop()
+{
+    if (!pat.claimed)
+        return;
+    pattern_halt();
+    pattern_release_pins(16);
+    gpio_release_function(MODE_T2CK + PATTERN_TIMER - 2);
+    pat.claimed = 0;
+}
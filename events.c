@@ -0,0 +1,244 @@
+/*
+ * Edge event engine: sampler thread and lock-free event ring.
+ *
+ * Copyright (C) 2019 Serge Vakulenko
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   1. Redistributions of source code must retain the above copyright notice,
+ *      this list of conditions and the following disclaimer.
+ *   2. Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer in the
+ *      documentation and/or other materials provided with the distribution.
+ *   3. The name of the author may not be used to endorse or promote products
+ *      derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR IMPLIED
+ * WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO
+ * EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+ * OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ * OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ * ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include "gpio.h"
+
+//
+// Single-producer, single-consumer ring of events.
+// Producer is the sampler thread, it only advances head.
+// Consumer only advances tail.  Both indices run freely,
+// and are reduced by mask when accessing the slots.
+//
+static struct {
+    gpio_event_t *slot;             // Allocated at start
+    unsigned mask;                  // Number of slots minus 1
+    atomic_uint head;               // Next slot to write
+    atomic_uint tail;               // Next slot to read
+    atomic_uint dropped;            // Events lost on overflow
+} ring;
+
+static unsigned watch_mask[GPIO_NPORTS];    // Pins to watch, per port
+static int sample_period;                   // Microseconds between samples
+static int sample_cn;                       // Use change notification
+static unsigned cn_enabled[GPIO_NPORTS];    // Change notification enabled by us
+static atomic_int sampler_stop;
+static pthread_t sampler_thread;
+
+//
+// Get current time in nanoseconds.
+//
+static unsigned long long now_nsec()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+//
+// Put event into the ring.  Never blocks: when the ring is full,
+// the event is dropped and counted.
+//
+static void ring_push(unsigned long long timestamp, int port, unsigned changed, unsigned value)
+{
+    unsigned head = atomic_load_explicit(&ring.head, memory_order_relaxed);
+    unsigned tail = atomic_load_explicit(&ring.tail, memory_order_acquire);
+
+    if (head - tail > ring.mask) {
+        atomic_fetch_add_explicit(&ring.dropped, 1, memory_order_relaxed);
+        return;
+    }
+
+    gpio_event_t *ev = &ring.slot[head & ring.mask];
+    ev->timestamp = timestamp;
+    ev->port = port;
+    ev->changed = changed;
+    ev->value = value;
+    atomic_store_explicit(&ring.head, head + 1, memory_order_release);
+}
+
+//
+// Sampler thread: read PORT words and report changes.
+//
+static void *sampler(void *arg)
+{
+    volatile unsigned *port_reg[GPIO_NPORTS];
+    volatile unsigned *cnstat_reg[GPIO_NPORTS];
+    unsigned prev[GPIO_NPORTS];
+    int ports[GPIO_NPORTS];
+    int nports = 0, i;
+    struct timespec delay = {
+        .tv_sec = sample_period / 1000000,
+        .tv_nsec = sample_period % 1000000 * 1000,
+    };
+
+    // Report initial state.
+    unsigned long long timestamp = now_nsec();
+    for (i = 0; i < GPIO_NPORTS; i++) {
+        if (!watch_mask[i])
+            continue;
+        port_reg[nports] = gpio_port_reg(i, GPIO_PORT);
+        cnstat_reg[nports] = gpio_port_reg(i, GPIO_CNSTAT);
+        prev[nports] = *port_reg[nports] & watch_mask[i];
+        ports[nports] = i;
+        ring_push(timestamp, i, 0, prev[nports]);
+        nports++;
+    }
+
+    while (!atomic_load_explicit(&sampler_stop, memory_order_relaxed)) {
+        for (i = 0; i < nports; i++) {
+            unsigned mask = watch_mask[ports[i]];
+            unsigned changed = 0;
+
+            if (sample_cn) {
+                // Status is set on mismatch since last read of PORT.
+                changed = *cnstat_reg[i] & mask;
+                if (!changed)
+                    continue;
+            }
+
+            unsigned value = *port_reg[i] & mask;
+            changed |= value ^ prev[i];
+            if (changed) {
+                ring_push(now_nsec(), ports[i], changed, value);
+                prev[i] = value;
+            }
+        }
+        if (sample_period > 0)
+            nanosleep(&delay, 0);
+    }
+    return 0;
+}
+
+//
+// Disable change notification on pins where gpio_events_start() enabled it.
+//
+static void events_disable_cn()
+{
+    int i;
+
+    for (i = 0; i < GPIO_NPORTS; i++) {
+        if (cn_enabled[i])
+            gpio_disable_cn(i, cn_enabled[i]);
+        cn_enabled[i] = 0;
+    }
+}
+
+//
+// Start sampler thread, watching a given set of pins.
+// Return 0 on success, -1 on error.
+//
+int gpio_events_start(const int *pins, int npins, int nslots, int period, int use_cn)
+{
+    unsigned size = 1;
+    int i;
+
+    while (size < nslots)
+        size <<= 1;
+    ring.slot = calloc(size, sizeof(gpio_event_t));
+    if (!ring.slot) {
+        fprintf(stderr, "gpio: Cannot allocate %u events\n", size);
+        return -1;
+    }
+    ring.mask = size - 1;
+    atomic_init(&ring.head, 0);
+    atomic_init(&ring.tail, 0);
+    atomic_init(&ring.dropped, 0);
+    atomic_init(&sampler_stop, 0);
+
+    memset(watch_mask, 0, sizeof(watch_mask));
+    for (i = 0; i < npins; i++)
+        watch_mask[GPIO_PORTNUM(pins[i])] |= (uint16_t) pins[i];
+    sample_period = period;
+    sample_cn = use_cn;
+
+    if (use_cn) {
+        // Enable change notification on watched pins.
+        for (i = 0; i < GPIO_NPORTS; i++) {
+            if (!watch_mask[i])
+                continue;
+            cn_enabled[i] = gpio_enable_cn(i, watch_mask[i]);
+        }
+    }
+
+    if (pthread_create(&sampler_thread, 0, sampler, 0) != 0) {
+        fprintf(stderr, "gpio: Cannot start sampler thread\n");
+        events_disable_cn();
+        free(ring.slot);
+        ring.slot = 0;
+        return -1;
+    }
+    return 0;
+}
+
+//
+// Stop sampler thread, and disable change notification it enabled.
+//
+void gpio_events_stop()
+{
+    if (!ring.slot)
+        return;
+
+    atomic_store(&sampler_stop, 1);
+    pthread_join(sampler_thread, 0);
+    events_disable_cn();
+    free(ring.slot);
+    ring.slot = 0;
+}
+
+//
+// Get events from the ring, up to max records.
+// Return a number of events, 0 when ring is empty.
+//
+int gpio_events_read(gpio_event_t *buf, int max)
+{
+    unsigned tail = atomic_load_explicit(&ring.tail, memory_order_relaxed);
+    unsigned head = atomic_load_explicit(&ring.head, memory_order_acquire);
+    int n = 0;
+
+    while (tail != head && n < max) {
+        buf[n++] = ring.slot[tail & ring.mask];
+        tail++;
+    }
+    atomic_store_explicit(&ring.tail, tail, memory_order_release);
+    return n;
+}
+
+//
+// Get a number of events lost because the ring was full.
+//
+unsigned gpio_events_dropped()
+{
+    return atomic_load_explicit(&ring.dropped, memory_order_relaxed);
+}
@@ -0,0 +1,379 @@
+/*
+ * Exporter of pin state and library counters in OpenMetrics format.
+ *
+ * Copyright (C) 2019 Serge Vakulenko
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   1. Redistributions of source code must retain the above copyright notice,
+ *      this list of conditions and the following disclaimer.
+ *   2. Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer in the
+ *      documentation and/or other materials provided with the distribution.
+ *   3. The name of the author may not be used to endorse or promote products
+ *      derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR IMPLIED
+ * WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO
+ * EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+ * OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ * OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ * ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <signal.h>
+#include <errno.h>
+#include <time.h>
+#include <poll.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include "gpio.h"
+
+extern const char *phys_name[];
+extern const char *mode_name[];
+extern int phys_to_bcm(int phys);
+extern int phys_to_pin(int phys);
+
+static volatile sig_atomic_t export_stop;
+
+static void export_interrupt(int sig)
+{
+    export_stop = 1;
+}
+
+//
+// Cached state: snapshot of registers, decoded modes, and the
+// response built from them.  Scrapes only send the response.
+//
+static gpio_snapshot_t snap, config;
+static int have_config;
+static gpio_mode_t mode[1+40];
+static char *response;
+static size_t response_len;
+static unsigned long long nscrapes, nrefreshes, ndecodes;
+
+//
+// Take a snapshot, and rebuild the response.  Modes of pins are
+// decoded only when configuration registers changed.
+//
+static void refresh()
+{
+    static const char port_name[] = "ABCDEFGHJK";
+    char *text = 0;
+    size_t len = 0;
+    FILE *out = open_memstream(&text, &len);
+    struct timespec now;
+    int phys, port;
+
+    if (!out)
+        return;
+    gpio_snapshot(&snap);
+    if (!have_config || gpio_snapshot_config_changed(&snap, &config)) {
+        for (phys = 1; phys <= 40; phys++) {
+            if (phys_to_bcm(phys) >= 0)
+                mode[phys] = gpio_get_mode(phys_to_pin(phys));
+        }
+        config = snap;
+        have_config = 1;
+        ndecodes++;
+    }
+    nrefreshes++;
+    clock_gettime(CLOCK_REALTIME, &now);
+
+    fprintf(out, "# TYPE gpio_pin_level gauge\n");
+    fprintf(out, "# HELP gpio_pin_level Input level of a pin on the extension connector.\n");
+    for (phys = 1; phys <= 40; phys++) {
+        if (phys_to_bcm(phys) < 0 || mode[phys] == MODE_ANALOG)
+            continue;
+        int pin = phys_to_pin(phys);
+        fprintf(out, "gpio_pin_level{pin=\"%s\",header=\"j%d\"} %d\n",
+            phys_name[phys], phys,
+            (snap.port[GPIO_PORTNUM(pin)][GPIO_PORT] & (uint16_t) pin) ? 1 : 0);
+    }
+
+    fprintf(out, "# TYPE gpio_pin_mode info\n");
+    fprintf(out, "# HELP gpio_pin_mode Direction or function of a pin.\n");
+    for (phys = 1; phys <= 40; phys++) {
+        if (phys_to_bcm(phys) < 0)
+            continue;
+        fprintf(out, "gpio_pin_mode_info{pin=\"%s\",header=\"j%d\",mode=\"%s\"} 1\n",
+            phys_name[phys], phys, mode_name[mode[phys]]);
+    }
+
+    fprintf(out, "# TYPE gpio_port gauge\n");
+    fprintf(out, "# HELP gpio_port Input value of a whole port.\n");
+    for (port = 0; port < GPIO_NPORTS; port++)
+        fprintf(out, "gpio_port{port=\"%c\"} %u\n", port_name[port],
+            snap.port[port][GPIO_PORT] & 0xffff);
+
+    gpio_stats_export(out);
+
+    fprintf(out, "# TYPE gpio_exporter_refreshes counter\n");
+    fprintf(out, "gpio_exporter_refreshes_total %llu\n", nrefreshes);
+    fprintf(out, "# TYPE gpio_exporter_decodes counter\n");
+    fprintf(out, "gpio_exporter_decodes_total %llu\n", ndecodes);
+    fprintf(out, "# TYPE gpio_exporter_scrapes counter\n");
+    fprintf(out, "gpio_exporter_scrapes_total %llu\n", nscrapes);
+    fprintf(out, "# TYPE gpio_exporter_refresh_timestamp_seconds gauge\n");
+    fprintf(out, "gpio_exporter_refresh_timestamp_seconds %ld.%03ld\n",
+        (long) now.tv_sec, now.tv_nsec / 1000000);
+    fprintf(out, "# EOF\n");
+    fclose(out);
+
+    free(response);
+    response = text;
+    response_len = len;
+}
+
+//
+// Write a buffer to a socket.  Return 0 on success, -1 when
+// the client is gone.
+//
+static int write_all(int fd, const char *buf, size_t len)
+{
+    while (len > 0) {
+        ssize_t n = write(fd, buf, len);
+
+        if (n <= 0)
+            return -1;
+        buf += n;
+        len -= n;
+    }
+    return 0;
+}
+
+//
+// Serve one client: read the request, and send the cached response
+// over HTTP.  Prometheus scrapes Unix sockets by HTTP as well.
+//
+static void serve(int fd)
+{
+    char request[1024], header[256];
+    struct pollfd p = { fd, POLLIN, 0 };
+    int n = 0;
+
+    // Wait for the end of request headers, shortly.
+    while (n < sizeof(request) - 1 && poll(&p, 1, 100) > 0) {
+        int nread = read(fd, request + n, sizeof(request) - 1 - n);
+
+        if (nread <= 0)
+            break;
+        n += nread;
+        request[n] = 0;
+        if (strstr(request, "\r\n\r\n") || strstr(request, "\n\n"))
+            break;
+    }
+    nscrapes++;
+
+    int len = snprintf(header, sizeof(header),
+        "HTTP/1.0 200 OK\r\n"
+        "Content-Type: application/openmetrics-text; version=1.0.0; charset=utf-8\r\n"
+        "Content-Length: %zu\r\n"
+        "Connection: close\r\n\r\n", response_len);
+
+    if (write_all(fd, header, len) == 0)
+        write_all(fd, response, response_len);
+    close(fd);
+}
+
+//
+// Run a filesystem operation on the socket path with permissions
+// of the real user: the program is installed setuid root.
+//
+static uid_t saved_euid;
+
+static int user_begin()
+{
+    saved_euid = geteuid();
+    if (getuid() != saved_euid && seteuid(getuid()) < 0)
+        return -1;
+    return 0;
+}
+
+static void user_end()
+{
+    int err = errno;
+
+    if (getuid() != saved_euid && seteuid(saved_euid) < 0) {
+        fprintf(stderr, "gpio: Cannot restore privileges: %s\n", strerror(errno));
+        exit(-1);
+    }
+    errno = err;
+}
+
+//
+// Bind a Unix socket to a path.  A stale socket of the same user
+// is replaced; any other existing file is refused.
+// Return 0 on success, -1 on error, with errno set.
+//
+static int bind_path(int fd, const char *path)
+{
+    struct sockaddr_un addr;
+    struct stat st;
+    int status;
+
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+
+    if (user_begin() < 0)
+        return -1;
+    if (lstat(path, &st) == 0) {
+        if (!S_ISSOCK(st.st_mode) || st.st_uid != getuid()) {
+            user_end();
+            errno = EEXIST;
+            return -1;
+        }
+        unlink(path);
+    }
+    status = bind(fd, (struct sockaddr*) &addr, sizeof(addr));
+    user_end();
+    return status;
+}
+
+//
+// Remove the socket at exit.
+//
+static void unlink_path(const char *path)
+{
+    if (user_begin() < 0)
+        return;
+    unlink(path);
+    user_end();
+}
+
+//
+// Open a listening socket: Unix socket at a path, or TCP port
+// on localhost only.  Return the socket, or -1 on error.
+//
+static int open_listener(const char *path, int port)
+{
+    int fd;
+
+    if (path) {
+        fd = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (fd < 0)
+            return -1;
+        if (bind_path(fd, path) < 0) {
+            int err = errno;
+            close(fd);
+            errno = err;
+            return -1;
+        }
+    } else {
+        struct sockaddr_in addr;
+        int on = 1;
+
+        fd = socket(AF_INET, SOCK_STREAM, 0);
+        if (fd < 0)
+            return -1;
+        setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+        memset(&addr, 0, sizeof(addr));
+        addr.sin_family = AF_INET;
+        addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        addr.sin_port = htons(port);
+        if (bind(fd, (struct sockaddr*) &addr, sizeof(addr)) < 0) {
+            close(fd);
+            return -1;
+        }
+    }
+    if (listen(fd, 8) < 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+//
+// gpio export [-s path | -p port] [-i msec]
+// Serve pin levels, modes and library counters in OpenMetrics
+// format, over a Unix socket or a TCP port on localhost (9464
+// by default).  State is refreshed every interval, 1 second by
+// default; scrapes get the cached response.
+//
+void do_export(int argc, char **argv)
+{
+    const char *path = 0;
+    int port = 9464, interval = 1000;
+
+    optind = 1;
+    for (;;) {
+        switch (getopt(argc, argv, "+s:p:i:")) {
+        case EOF:
+            break;
+        case 's':
+            path = optarg;
+            continue;
+        case 'p':
+            port = strtol(optarg, 0, 0);
+            continue;
+        case 'i':
+            interval = strtol(optarg, 0, 0);
+            continue;
+        default:
+            argc = 0;
+            continue;
+        }
+        break;
+    }
+    argc -= optind;
+
+    if (argc != 0 || interval <= 0 || port <= 0 || port > 65535) {
+        fprintf(stderr, "Usage: gpio export [-s path | -p port] [-i msec]\n");
+        exit(-1);
+    }
+
+    int listener = open_listener(path, port);
+    if (listener < 0) {
+        if (path)
+            fprintf(stderr, "gpio: %s: %s\n", path, strerror(errno));
+        else
+            fprintf(stderr, "gpio: Port %d: %s\n", port, strerror(errno));
+        exit(-1);
+    }
+    signal(SIGINT, export_interrupt);
+    signal(SIGTERM, export_interrupt);
+    signal(SIGPIPE, SIG_IGN);
+
+    struct timespec now;
+    unsigned long long next = 0;
+
+    while (!export_stop) {
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        unsigned long long t = now.tv_sec * 1000ULL + now.tv_nsec / 1000000;
+
+        if (t >= next) {
+            refresh();
+            next = t + interval;
+            continue;
+        }
+
+        struct pollfd p = { listener, POLLIN, 0 };
+        if (poll(&p, 1, next - t) > 0 && (p.revents & POLLIN)) {
+            int fd = accept(listener, 0, 0);
+
+            if (fd >= 0)
+                serve(fd);
+        }
+    }
+    close(listener);
+    if (path)
+        unlink_path(path);
+    free(response);
+}
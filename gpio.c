@@ -29,6 +29,8 @@
 #include <stddef.h>
 #include <fcntl.h>
 #include <sys/mman.h>
+#include <pthread.h>
+#include <stdatomic.h>
 #include <errno.h>
 #include <stdint.h>
 #include <string.h>
@@ -80,9 +82,19 @@ struct gpioreg {
     volatile unsigned unused[6*4];
 };
 
+static const int GPIO_ADDR = 0x1f860000;
+
+//
+// Size of file which simulates physical memory: covers registers
+// and RAM in the lower 512 Mbytes.
+//
+#define GPIO_MEM_SIZE   0x20000000
+
 int gpio_debug;                     // Debug output
 int gpio_mem_fd;                    // Access to /dev/mem
+int gpio_model;                     // Memory is simulated by a file
 static ptrdiff_t gpio_base;         // GPIO registers mapped here
+static pthread_once_t gpio_once = PTHREAD_ONCE_INIT;
 
 //
 // Get access to GPIO control registers.
@@ -90,13 +102,33 @@ static ptrdiff_t gpio_base;         // GPIO registers mapped here
 //
 static void gpio_init()
 {
-    const int GPIO_ADDR = 0x1f860000;
-
-    // Obtain handle to physical memory
-    gpio_mem_fd = open("/dev/mem", O_RDWR | O_SYNC);
-    if (gpio_mem_fd < 0) {
-        printf("Unable to open /dev/mem: %s\n", strerror(errno));
-        exit(-1);
+    const char *mem = getenv("GPIO_MEM");
+
+    if (mem) {
+        // Registers are simulated by a sparse file,
+        // where offset is a physical address.  Not for a setuid
+        // program: the file is opened as is, never created.
+        if (getuid() != geteuid() || getgid() != getegid()) {
+            printf("GPIO_MEM is not allowed in setuid program\n");
+            exit(-1);
+        }
+        gpio_mem_fd = open(mem, O_RDWR | O_NOFOLLOW);
+        if (gpio_mem_fd < 0) {
+            printf("Unable to open %s: %s\n", mem, strerror(errno));
+            exit(-1);
+        }
+        if (lseek(gpio_mem_fd, 0, SEEK_END) < GPIO_MEM_SIZE) {
+            printf("File %s is smaller than %u Mbytes\n", mem, GPIO_MEM_SIZE >> 20);
+            exit(-1);
+        }
+        gpio_model = 1;
+    } else {
+        // Obtain handle to physical memory
+        gpio_mem_fd = open("/dev/mem", O_RDWR | O_SYNC);
+        if (gpio_mem_fd < 0) {
+            printf("Unable to open /dev/mem: %s\n", strerror(errno));
+            exit(-1);
+        }
     }
 
     // Map a page of memory to gpio address
@@ -108,13 +140,80 @@ static void gpio_init()
     }
 }
 
+//
+// Open access to the hardware.
+// Every function does it on first use, so the call is optional.
+//
+void gpio_open()
+{
+    pthread_once(&gpio_once, gpio_init);
+}
+
+//
+// Open a file named by user.  The program is installed setuid root,
+// so the file is accessed with permissions of the real user, and
+// a symbolic link is not followed when creating.
+// Return -1 on error, with errno set.
+//
+int gpio_open_user(const char *filename, int flags, int mode)
+{
+    uid_t uid = getuid(), euid = geteuid();
+    int fd, err;
+
+    if (flags & O_CREAT)
+        flags |= O_NOFOLLOW;
+    if (uid != euid && seteuid(uid) < 0)
+        return -1;
+    fd = open(filename, flags, mode);
+    err = errno;
+    if (uid != euid && seteuid(euid) < 0) {
+        fprintf(stderr, "gpio: Cannot restore privileges: %s\n", strerror(errno));
+        exit(-1);
+    }
+    errno = err;
+    return fd;
+}
+
+//
+// Same for stdio: mode is "r" or "w", optionally with "b".
+//
+FILE *gpio_fopen_user(const char *filename, const char *mode)
+{
+    int flags = (mode[0] == 'w') ? O_WRONLY | O_CREAT | O_TRUNC : O_RDONLY;
+    int fd = gpio_open_user(filename, flags, 0644);
+    FILE *f;
+
+    if (fd < 0)
+        return 0;
+    f = fdopen(fd, mode);
+    if (!f)
+        close(fd);
+    return f;
+}
+
+//
+// Physical address of a GPIO port register, like GPIO_TRIS.
+//
+static unsigned port_addr(int pin, int index)
+{
+    return GPIO_ADDR + (pin >> 16 & 0xf00) + index*0x10;
+}
+
+//
+// Offsets of CLR, SET and INV companions of a register,
+// for the trace of stores.
+//
+#define OFF_CLR     4
+#define OFF_SET     8
+#define OFF_INV     12
+
 //
 // Get pin direction or alternative function.
 //
 gpio_mode_t gpio_get_mode(int pin)
 {
-    if (!gpio_base)
-        gpio_init();
+    gpio_stats_enter(GPIO_STAT_GET_MODE);
+    pthread_once(&gpio_once, gpio_init);
 
     // Check output mapping.
     gpio_mode_t mode = gpio_get_output_mapping(pin);
@@ -139,9 +238,11 @@ gpio_mode_t gpio_get_mode(int pin)
     struct gpioreg *reg = (struct gpioreg*) (gpio_base + (pin >> 16));
     uint16_t mask = (uint16_t) pin;
 
+    gpio_stats_mmio(1, 0);
     if (reg->ansel & mask)
         return MODE_ANALOG;
 
+    gpio_stats_mmio(1, 0);
     if (reg->tris & mask)
         return MODE_INPUT;
 
@@ -153,38 +254,49 @@ gpio_mode_t gpio_get_mode(int pin)
 //
 int gpio_set_mode(int pin, gpio_mode_t mode)
 {
-    if (!gpio_base)
-        gpio_init();
+    gpio_stats_enter(GPIO_STAT_SET_MODE);
+    pthread_once(&gpio_once, gpio_init);
 
     struct gpioreg *reg = (struct gpioreg*) (gpio_base + (pin >> 16));
     uint16_t mask = (uint16_t) pin;
 
+    if (gpio_check_owner(pin, mode) < 0)
+        return -1;
+
     gpio_clear_mapping(pin);
+    gpio_stats_mmio(0, 2);
     switch (mode) {
     case MODE_ANALOG:
         // Analog input.
+        gpio_trace_write(port_addr(pin, GPIO_TRIS) + OFF_SET, reg->tris, mask);
         reg->trisset = mask;
+        gpio_trace_write(port_addr(pin, GPIO_ANSEL) + OFF_SET, reg->ansel, mask);
         reg->anselset = mask;
         break;
 
     case MODE_INPUT:
         // Digital input.
+        gpio_trace_write(port_addr(pin, GPIO_ANSEL) + OFF_CLR, reg->ansel, mask);
         reg->anselclr = mask;
+        gpio_trace_write(port_addr(pin, GPIO_TRIS) + OFF_SET, reg->tris, mask);
         reg->trisset = mask;
         break;
 
     case MODE_OUTPUT:
         // Digital output.
+        gpio_trace_write(port_addr(pin, GPIO_ANSEL) + OFF_CLR, reg->ansel, mask);
         reg->anselclr = mask;
+        gpio_trace_write(port_addr(pin, GPIO_TRIS) + OFF_CLR, reg->tris, mask);
         reg->trisclr = mask;
         break;
 
     default:
         // Alternative function.
+        gpio_trace_write(port_addr(pin, GPIO_TRIS) + OFF_SET, reg->tris, mask);
         reg->trisset = mask;
+        gpio_trace_write(port_addr(pin, GPIO_ANSEL) + OFF_CLR, reg->ansel, mask);
         reg->anselclr = mask;
-        gpio_set_mapping(pin, mode);
-        break;
+        return gpio_set_mapping(pin, mode);
     }
     return 0;
 }
@@ -194,25 +306,32 @@ int gpio_set_mode(int pin, gpio_mode_t mode)
 //
 int gpio_set_pull(int pin, gpio_pull_t pull)
 {
-    if (!gpio_base)
-        gpio_init();
+    gpio_stats_enter(GPIO_STAT_SET_PULL);
+    pthread_once(&gpio_once, gpio_init);
 
     struct gpioreg *reg = (struct gpioreg*) (gpio_base + (pin >> 16));
     uint16_t mask = (uint16_t) pin;
 
+    gpio_stats_mmio(0, 2);
     switch (pull) {
     case PULL_OFF:
+        gpio_trace_write(port_addr(pin, GPIO_CNPU) + OFF_CLR, reg->cnpu, mask);
         reg->cnpuclr = mask;
+        gpio_trace_write(port_addr(pin, GPIO_CNPD) + OFF_CLR, reg->cnpd, mask);
         reg->cnpdclr = mask;
         break;
 
     case PULL_UP:
+        gpio_trace_write(port_addr(pin, GPIO_CNPD) + OFF_CLR, reg->cnpd, mask);
         reg->cnpdclr = mask;
+        gpio_trace_write(port_addr(pin, GPIO_CNPU) + OFF_SET, reg->cnpu, mask);
         reg->cnpuset = mask;
         break;
 
     case PULL_DOWN:
+        gpio_trace_write(port_addr(pin, GPIO_CNPU) + OFF_CLR, reg->cnpu, mask);
         reg->cnpuclr = mask;
+        gpio_trace_write(port_addr(pin, GPIO_CNPD) + OFF_SET, reg->cnpd, mask);
         reg->cnpdset = mask;
         break;
     }
@@ -225,12 +344,13 @@ int gpio_set_pull(int pin, gpio_pull_t pull)
 //
 int gpio_read(int pin)
 {
-    if (!gpio_base)
-        gpio_init();
+    gpio_stats_enter(GPIO_STAT_READ);
+    pthread_once(&gpio_once, gpio_init);
 
     struct gpioreg *reg = (struct gpioreg*) (gpio_base + (pin >> 16));
     uint16_t mask = (uint16_t) pin;
 
+    gpio_stats_mmio(1, 0);
     if (reg->port & mask)
         return 1;
 
@@ -242,16 +362,20 @@ int gpio_read(int pin)
 //
 int gpio_write(int pin, int value)
 {
-    if (!gpio_base)
-        gpio_init();
+    gpio_stats_enter(GPIO_STAT_WRITE);
+    pthread_once(&gpio_once, gpio_init);
 
     struct gpioreg *reg = (struct gpioreg*) (gpio_base + (pin >> 16));
     uint16_t mask = (uint16_t) pin;
 
-    if (value & 1)
+    gpio_stats_mmio(0, 1);
+    if (value & 1) {
+        gpio_trace_write(port_addr(pin, GPIO_LAT) + OFF_SET, reg->lat, mask);
         reg->latset = mask;
-    else
+    } else {
+        gpio_trace_write(port_addr(pin, GPIO_LAT) + OFF_CLR, reg->lat, mask);
         reg->latclr = mask;
+    }
 
     return 0;
 }
@@ -261,13 +385,215 @@ int gpio_write(int pin, int value)
 //
 int gpio_toggle(int pin)
 {
-    if (!gpio_base)
-        gpio_init();
+    gpio_stats_enter(GPIO_STAT_TOGGLE);
+    pthread_once(&gpio_once, gpio_init);
 
     struct gpioreg *reg = (struct gpioreg*) (gpio_base + (pin >> 16));
     uint16_t mask = (uint16_t) pin;
 
+    gpio_stats_mmio(0, 1);
+    gpio_trace_write(port_addr(pin, GPIO_LAT) + OFF_INV, reg->lat, mask);
     reg->latinv = mask;
 
     return 0;
 }
+
+//
+// Get a register of a GPIO port by index, like GPIO_TRIS.
+// Every register is followed by CLR, SET and INV companions,
+// so they are spaced by four words.
+//
+volatile unsigned *gpio_port_reg(int port, int index)
+{
+    pthread_once(&gpio_once, gpio_init);
+
+    return (volatile unsigned*) (gpio_base + port*0x100) + index*4;
+}
+
+//
+// Enable change notification for given pins of a port.
+// Then CNSTAT shows pins, changed since last read of PORT.
+// Return a mask of pins which were not enabled before.
+//
+unsigned gpio_enable_cn(int port, unsigned mask)
+{
+    struct gpioreg *reg = (struct gpioreg*) gpio_port_reg(port, 0);
+    unsigned enabled = mask & ~reg->cnen;
+
+    reg->cnenset = mask;
+    reg->cnconset = 0x8000;         // ON
+    (void) reg->port;               // Clear CNSTAT
+    return enabled;
+}
+
+//
+// Disable change notification for given pins of a port,
+// as returned by gpio_enable_cn().  When no pins are left,
+// change notification of the port is turned off.
+//
+void gpio_disable_cn(int port, unsigned mask)
+{
+    struct gpioreg *reg = (struct gpioreg*) gpio_port_reg(port, 0);
+
+    reg->cnenclr = mask;
+    if (reg->cnen == 0)
+        reg->cnconclr = 0x8000;     // ON
+}
+
+//
+// Save GPIO port registers into a snapshot.
+//
+void gpio_save_ports(gpio_snapshot_t *snap)
+{
+    pthread_once(&gpio_once, gpio_init);
+
+    int port, i;
+    for (port = 0; port < GPIO_NPORTS; port++) {
+        for (i = 0; i < GPIO_NREGS; i++) {
+            snap->port[port][i] = *gpio_port_reg(port, i);
+        }
+    }
+}
+
+//
+// Restore GPIO port registers from a snapshot.
+// Write only registers which differ from the live state.
+// Output latches are restored before direction, to avoid glitches.
+// PORT and CNSTAT reflect the pin state, so they are not written.
+// Return a number of writes.
+//
+int gpio_restore_ports(const gpio_snapshot_t *snap)
+{
+    static const int order[] = {
+        GPIO_LAT, GPIO_ODC, GPIO_CNPU, GPIO_CNPD,
+        GPIO_ANSEL, GPIO_TRIS, GPIO_CNCON, GPIO_CNEN,
+    };
+    int port, i, nwrites = 0;
+
+    pthread_once(&gpio_once, gpio_init);
+
+    for (port = 0; port < GPIO_NPORTS; port++) {
+        for (i = 0; i < sizeof(order) / sizeof(order[0]); i++) {
+            volatile unsigned *regp = gpio_port_reg(port, order[i]);
+            unsigned value = snap->port[port][order[i]];
+
+            if (*regp != value) {
+                *regp = value;
+                nwrites++;
+            }
+        }
+    }
+    return nwrites;
+}
+
+//
+// Get pointer to a control register by physical address.
+// Every page is mapped once, on first access.
+//
+volatile unsigned *gpio_sfr(unsigned addr)
+{
+    static struct {
+        unsigned page;
+        ptrdiff_t base;
+    } map[16];
+    static atomic_int nmapped;
+    static pthread_mutex_t map_lock = PTHREAD_MUTEX_INITIALIZER;
+    unsigned page = addr & ~0xfff;
+    int i, n;
+
+    pthread_once(&gpio_once, gpio_init);
+
+    // Entries are published by nmapped, so lookup needs no lock.
+    n = atomic_load_explicit(&nmapped, memory_order_acquire);
+    for (i = 0; i < n; i++) {
+        if (map[i].page == page)
+            return (volatile unsigned*) (map[i].base + (addr & 0xfff));
+    }
+
+    pthread_mutex_lock(&map_lock);
+
+    // Somebody could map this page meanwhile.
+    n = atomic_load_explicit(&nmapped, memory_order_relaxed);
+    for (i = 0; i < n; i++) {
+        if (map[i].page == page) {
+            pthread_mutex_unlock(&map_lock);
+            return (volatile unsigned*) (map[i].base + (addr & 0xfff));
+        }
+    }
+    if (n >= sizeof(map) / sizeof(map[0])) {
+        printf("Too many pages mapped\n");
+        exit(-1);
+    }
+
+    ptrdiff_t base = (ptrdiff_t) mmap(0, 4096, PROT_READ|PROT_WRITE, MAP_SHARED,
+        gpio_mem_fd, page);
+    if (base < 0) {
+        printf("Mmap failed: %s\n", strerror(errno));
+        exit(-1);
+    }
+    map[n].page = page;
+    map[n].base = base;
+    atomic_store_explicit(&nmapped, n + 1, memory_order_release);
+
+    pthread_mutex_unlock(&map_lock);
+    return (volatile unsigned*) (base + (addr & 0xfff));
+}
+
+
+//
+// Append to the plan writes for gpio_set_mode().
+//
+void gpio_plan_mode(gpio_plan_t *plan, int pin, gpio_mode_t mode)
+{
+    uint16_t mask = (uint16_t) pin;
+
+    gpio_plan_pps(plan, pin, mode);
+
+    switch (mode) {
+    case MODE_ANALOG:
+        plan->phase = PHASE_INPUT;
+        gpio_plan_add(plan, PLAN_SET, port_addr(pin, GPIO_TRIS), mask);
+        gpio_plan_add(plan, PLAN_SET, port_addr(pin, GPIO_ANSEL), mask);
+        break;
+
+    case MODE_OUTPUT:
+        plan->phase = PHASE_INPUT;
+        gpio_plan_add(plan, PLAN_CLR, port_addr(pin, GPIO_ANSEL), mask);
+        plan->phase = PHASE_OUTPUT;
+        gpio_plan_add(plan, PLAN_CLR, port_addr(pin, GPIO_TRIS), mask);
+        break;
+
+    default:
+        // Digital input or alternative function.
+        plan->phase = PHASE_INPUT;
+        gpio_plan_add(plan, PLAN_CLR, port_addr(pin, GPIO_ANSEL), mask);
+        gpio_plan_add(plan, PLAN_SET, port_addr(pin, GPIO_TRIS), mask);
+        break;
+    }
+}
+
+//
+// Append to the plan writes for gpio_set_pull().
+//
+void gpio_plan_pull(gpio_plan_t *plan, int pin, gpio_pull_t pull)
+{
+    uint16_t mask = (uint16_t) pin;
+
+    plan->phase = PHASE_PULL;
+    gpio_plan_add(plan, (pull == PULL_UP) ? PLAN_SET : PLAN_CLR,
+        port_addr(pin, GPIO_CNPU), mask);
+    gpio_plan_add(plan, (pull == PULL_DOWN) ? PLAN_SET : PLAN_CLR,
+        port_addr(pin, GPIO_CNPD), mask);
+}
+
+//
+// Append to the plan writes for gpio_write().
+//
+void gpio_plan_write(gpio_plan_t *plan, int pin, int value)
+{
+    uint16_t mask = (uint16_t) pin;
+
+    plan->phase = PHASE_LAT;
+    gpio_plan_add(plan, (value & 1) ? PLAN_SET : PLAN_CLR,
+        port_addr(pin, GPIO_LAT), mask);
+}
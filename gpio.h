@@ -163,6 +163,72 @@ typedef enum {
     PULL_DOWN   = 2,        // Pull down
 } gpio_pull_t;
 
+//
+// Peripheral modules which have no pin function.
+//
+typedef enum {
+    MODULE_ADC,             // ADC with all its inputs
+
+    MODULE_LAST
+} gpio_module_t;
+
+//
+// Thread safety.
+//
+// Hardware is opened once, by gpio_open() or on first use of any
+// function, and it is safe to start using the library from several
+// threads at once.
+//
+// Functions gpio_read(), gpio_write(), gpio_toggle() and gpio_set_pull()
+// use single loads or atomic SET/CLR/INV stores, so they can be called
+// concurrently from any threads, for any pins, without locking.
+//
+// Functions gpio_set_mode(), gpio_set_mapping() and gpio_clear_mapping()
+// lock every PPS register for read-modify-write, so that different
+// pins can be configured in parallel.  Configuring the same pin
+// from several threads at once gives unpredictable results.
+//
+// Functions gpio_restore() and gpio_plan_execute() rewrite whole
+// registers and need exclusive access.
+//
+// When environment variable GPIO_MEM is set, it names a file which
+// is used instead of /dev/mem, with file offset as physical address.
+// DMA and timers are then simulated in software, so the library
+// can be tested on a host without the hardware.  The file must exist
+// and cover 512 Mbytes, like made by "truncate -s 512M".  GPIO_MEM
+// is refused when the program runs setuid.
+//
+void gpio_open(void);
+
+//
+// Open a file named by user, with permissions of the real user
+// when the program runs setuid root.  A symbolic link is not followed
+// when creating.  Return -1 or 0 on error, with errno set.
+//
+int gpio_open_user(const char *filename, int flags, int mode);
+FILE *gpio_fopen_user(const char *filename, const char *mode);
+
+//
+// Ownership of pins and alternative functions, shared between processes.
+// A process claims pins and functions it uses, identified by PID and a tag.
+// Modules which have no pin function, like the ADC, are claimed whole.
+// Then gpio_set_mode() and gpio_set_mapping() in other processes
+// refuse to change them.  Claims of terminated processes are reclaimed.
+// Claim returns 0 on success, -1 when owned by another live process.
+// Functions gpio_restore() and gpio_plan_execute() rewrite whole
+// registers, so they are refused while anything is owned by another
+// process: gpio_check_no_owners() tells.
+//
+int gpio_claim(int pin, const char *tag);
+int gpio_claim_function(gpio_mode_t mode, const char *tag);
+int gpio_claim_module(gpio_module_t module, const char *tag);
+void gpio_release(int pin);
+void gpio_release_function(gpio_mode_t mode);
+void gpio_release_module(gpio_module_t module);
+int gpio_check_owner(int pin, gpio_mode_t mode);
+int gpio_check_no_owners(void);
+void gpio_print_owners(void);
+
 //
 // Set pin direction or alternative function.
 //
@@ -199,6 +265,109 @@ int gpio_toggle(int pin);
 //
 extern int gpio_debug;
 
+//
+// Set when hardware is simulated by GPIO_MEM file.
+//
+extern int gpio_model;
+
+//
+// Binary trace of register accesses, into a ring in memory.
+// Compiled in only with GPIO_TRACE defined, like: make TRACE=1.
+// At exit, the ring is saved to a file named by GPIO_TRACE
+// environment variable, or printed when debug output is enabled.
+//
+#define GPIO_TRACE_READ     0
+#define GPIO_TRACE_WRITE    1
+
+typedef struct {
+    unsigned long long time;        // CLOCK_MONOTONIC, nanoseconds
+    unsigned addr;                  // Physical address
+    unsigned old;                   // Value before access
+    unsigned value;                 // Value after access
+    unsigned short line;            // Line of call site
+    unsigned short op;              // GPIO_TRACE_READ or GPIO_TRACE_WRITE
+    char func[24];                  // Function of call site
+} gpio_trace_entry_t;
+
+#ifdef GPIO_TRACE
+#define gpio_trace_read(addr, value) \
+    gpio_trace_put(GPIO_TRACE_READ, addr, value, value, __func__, __LINE__)
+#define gpio_trace_write(addr, old, value) \
+    gpio_trace_put(GPIO_TRACE_WRITE, addr, old, value, __func__, __LINE__)
+#else
+#define gpio_trace_read(addr, value)        ((void) 0)
+#define gpio_trace_write(addr, old, value)  ((void) 0)
+#endif
+
+void gpio_trace_put(int op, unsigned addr, unsigned old, unsigned value,
+    const char *func, unsigned line);
+void gpio_trace_print(FILE *out);
+int gpio_trace_save(const char *filename);
+int gpio_trace_decode(const char *filename, FILE *out);
+FILE *gpio_trace_open(const char *filename);
+int gpio_trace_next(FILE *fd, gpio_trace_entry_t *e);
+
+//
+// Replay a trace file against registers, a given number of times.
+// Files which access anything but GPIO, PPS, I2C or SPI registers
+// are refused.
+//
+typedef struct {
+    unsigned long long accesses;    // Total replayed
+    unsigned long long reads;
+    unsigned long long writes;
+    unsigned long long divergences; // Reads with other value than recorded
+    unsigned long long elapsed;     // Time of replay, nanoseconds
+    unsigned long long recorded;    // Time span of the trace, nanoseconds
+} gpio_replay_stat_t;
+
+int gpio_trace_replay(const char *filename, int timed, long repeat, FILE *out,
+    gpio_replay_stat_t *stat);
+
+//
+// Counters of calls and MMIO accesses, and latency histograms,
+// per library function.  Compiled in only with GPIO_STATS defined,
+// like: make STATS=1.  Live numbers are shown by gpio stats;
+// with GPIO_STATS environment variable set, they are printed at exit.
+//
+enum {
+    GPIO_STAT_READ,
+    GPIO_STAT_WRITE,
+    GPIO_STAT_TOGGLE,
+    GPIO_STAT_GET_MODE,
+    GPIO_STAT_SET_MODE,
+    GPIO_STAT_SET_PULL,
+    GPIO_STAT_GET_OUTPUT,
+    GPIO_STAT_GET_INPUT,
+    GPIO_STAT_SET_MAPPING,
+    GPIO_STAT_CLEAR_MAPPING,
+    GPIO_STAT_HAS_MAPPING,
+    GPIO_STAT_LAST,
+};
+
+typedef struct {
+    int op;                         // Function being timed
+    int prev;                       // Caller being timed, or -1
+    unsigned long long start;       // Time of entry, nanoseconds
+} gpio_stats_ctx_t;
+
+#ifdef GPIO_STATS
+#define gpio_stats_enter(op) \
+    gpio_stats_ctx_t _gpio_stats __attribute__((cleanup(gpio_stats_leave))) = \
+        gpio_stats_begin(op)
+#define gpio_stats_mmio(nreads, nwrites) gpio_stats_count(nreads, nwrites)
+#else
+#define gpio_stats_enter(op)                ((void) 0)
+#define gpio_stats_mmio(nreads, nwrites)    ((void) 0)
+#endif
+
+gpio_stats_ctx_t gpio_stats_begin(int op);
+void gpio_stats_leave(gpio_stats_ctx_t *ctx);
+void gpio_stats_count(int nreads, int nwrites);
+void gpio_stats_print(FILE *out, const void *table);
+int gpio_stats_print_all(FILE *out, int pid);
+void gpio_stats_export(FILE *out);
+
 //
 // Calculate register offset by port name.
 //
@@ -213,13 +382,18 @@ extern int gpio_debug;
                            port == 'J' ? 0x800 : 0x900)
 #define GPIO_PIN(port, bitnum) ((GPIO_OFFSET(port) << 16) | (1 << bitnum))
 
+//
+// Get port index by pin descriptor: 0 for port A, up to 9 for port K.
+//
+#define GPIO_PORTNUM(pin) ((pin) >> 24)
+
 //
 // Read and modify pin mappings.
 //
 gpio_mode_t gpio_get_output_mapping(int pin);
 gpio_mode_t gpio_get_input_mapping(int pin);
 void gpio_clear_mapping(int pin);
-void gpio_set_mapping(int pin, gpio_mode_t mode);
+int gpio_set_mapping(int pin, gpio_mode_t mode);
 int gpio_has_mapping(int pin, gpio_mode_t mode);
 
 //
@@ -227,7 +401,570 @@ int gpio_has_mapping(int pin, gpio_mode_t mode);
 //
 gpio_mode_t gpio_get_spi_function(int pin);
 
+//
+// Hardware SPI master on SPIx, x = 1...6.
+// Start returns actual clock rate, or 0 on error.
+// Pins sdo, sdi and ss are optional, 0 when not used.
+// Transfer returns 0 on success, -1 on error or timeout.
+//
+unsigned gpio_spi_start(int port, unsigned hz, int mode, int bits,
+    int sdo, int sdi, int ss);
+int gpio_spi_transfer(int port, const void *tx, void *rx, unsigned nwords);
+void gpio_spi_stop(int port);
+
 //
 // Check pins dedicated to I2c.
 //
 gpio_mode_t gpio_get_i2c_function(int pin);
+
+//
+// Hardware I2C master on I2Cx, x = 1...5.
+// Start returns actual clock rate, or 0 on error.
+// Transfers return 0 on success, 1 when a slave does not
+// acknowledge, or -1 on bus error.
+//
+typedef struct {
+    int addr;                       // 7-bit slave address
+    int read;                       // Read from slave, else write
+    unsigned len;                   // Number of bytes
+    unsigned char *buf;             // Data
+} gpio_i2c_msg_t;
+
+unsigned gpio_i2c_start(int port, unsigned hz);
+int gpio_i2c_transfer(int port, gpio_i2c_msg_t *msg, int nmsgs);
+int gpio_i2c_write_read(int port, int addr, const void *wbuf, unsigned wlen,
+    void *rbuf, unsigned rlen);
+int gpio_i2c_probe(int port, int addr);
+void gpio_i2c_stop(int port);
+
+//
+// ADC scan of analog inputs.  Results are 12-bit, in order of pins.
+// Continuous mode stores frame n at ring[(n % nframes) * npins].
+// Frames returns the count of frames modulo 2^32, and -1 when
+// scanning has stopped on error.
+//
+#define GPIO_ADC_MAXCHAN 32
+
+int gpio_adc_channel(int pin);
+int gpio_adc_open(const int *pin, int npins);
+int gpio_adc_read(unsigned short *value);
+int gpio_adc_continuous(unsigned short *ring, unsigned nframes, unsigned hz);
+int gpio_adc_frames(unsigned *count);
+void gpio_adc_close(void);
+
+//
+// Snapshot of GPIO, PPS, SPI and I2C control registers.
+//
+enum {
+    GPIO_ANSEL,             // Registers of a GPIO port,
+    GPIO_TRIS,              // in order of struct gpioreg
+    GPIO_PORT,
+    GPIO_LAT,
+    GPIO_ODC,
+    GPIO_CNPU,
+    GPIO_CNPD,
+    GPIO_CNCON,
+    GPIO_CNEN,
+    GPIO_CNSTAT,
+    GPIO_NREGS
+};
+
+#define GPIO_NPORTS     10  // Ports A-H, J, K
+#define PPS_NINPUTS     51  // Input function select registers
+#define PPS_NOUTPUTS    53  // Output pin select registers
+#define SPI_NPORTS      6   // SPI1-SPI6
+#define I2C_NPORTS      5   // I2C1-I2C5
+
+typedef struct {
+    unsigned port[GPIO_NPORTS][GPIO_NREGS];
+    unsigned pps_input[PPS_NINPUTS];
+    unsigned pps_output[PPS_NOUTPUTS];
+    unsigned spicon[SPI_NPORTS];
+    unsigned i2ccon[I2C_NPORTS];
+} gpio_snapshot_t;
+
+//
+// Get a register of GPIO port by index, like GPIO_PORT.
+//
+volatile unsigned *gpio_port_reg(int port, int index);
+
+//
+// Enable change notification for given pins of a port.
+// Return a mask of pins which were not enabled before:
+// pass it to gpio_disable_cn() when done.
+//
+unsigned gpio_enable_cn(int port, unsigned mask);
+void gpio_disable_cn(int port, unsigned mask);
+
+//
+// Read all registers into a snapshot.
+//
+void gpio_snapshot(gpio_snapshot_t *snap);
+
+//
+// Apply a snapshot to the hardware.
+// Only registers which differ from the live state are written.
+// Refused while any pin or function is owned by another process.
+// Return a number of register writes, or -1 when refused.
+//
+int gpio_restore(const gpio_snapshot_t *snap);
+
+//
+// Print differences between two snapshots.
+// Return a number of differing registers.
+//
+int gpio_snapshot_diff(const gpio_snapshot_t *a, const gpio_snapshot_t *b);
+
+//
+// Check whether pin modes could change between two snapshots:
+// pin mapping, direction, analog select or peripheral enables.
+//
+int gpio_snapshot_config_changed(const gpio_snapshot_t *a, const gpio_snapshot_t *b);
+
+//
+// Save snapshot to a file, or load it back.
+// Return 0 on success, -1 on error.
+//
+int gpio_snapshot_save(const gpio_snapshot_t *snap, const char *filename);
+int gpio_snapshot_load(gpio_snapshot_t *snap, const char *filename);
+
+//
+// Parts of snapshot, handled by separate modules.
+//
+void gpio_save_ports(gpio_snapshot_t *snap);
+int gpio_restore_ports(const gpio_snapshot_t *snap);
+void gpio_save_pps(gpio_snapshot_t *snap);
+int gpio_restore_pps(const gpio_snapshot_t *snap);
+const char *gpio_pps_input_name(int index);
+const char *gpio_pps_output_name(int index);
+void gpio_save_spi(gpio_snapshot_t *snap);
+int gpio_restore_spi(const gpio_snapshot_t *snap);
+void gpio_save_i2c(gpio_snapshot_t *snap);
+int gpio_restore_i2c(const gpio_snapshot_t *snap);
+
+//
+// Get pointer to a control register by physical address.
+//
+volatile unsigned *gpio_sfr(unsigned addr);
+
+//
+// Plan of register writes, compiled from a board profile.
+//
+enum {
+    PLAN_STORE,             // Write value to register
+    PLAN_SET,               // Set bits by mask, via SET register
+    PLAN_CLR,               // Clear bits by mask, via CLR register
+    PLAN_UNMAP,             // Write 15 when register value is in the mask
+};
+
+enum {
+    PHASE_LAT,              // Output latches go first, to avoid glitches
+    PHASE_PULL,             // Pull-up and pull-down resistors
+    PHASE_UNMAP,            // Disconnect peripherals from pins
+    PHASE_INPUT,            // Switch pins to input, digital or analog
+    PHASE_OUTPUT,           // Switch pins to output
+    PHASE_MAP,              // Connect peripherals to pins
+};
+
+#define GPIO_PLAN_MAXOPS    512
+
+typedef struct {
+    unsigned char op;       // PLAN_STORE, PLAN_SET, PLAN_CLR or PLAN_UNMAP
+    unsigned char phase;    // Order of execution
+    unsigned short unused;
+    unsigned addr;          // Physical address of register
+    unsigned value;         // Value or mask
+} gpio_plan_op_t;
+
+typedef struct {
+    int phase;              // Phase for newly added ops
+    int nops;               // Number of ops
+    gpio_plan_op_t op[GPIO_PLAN_MAXOPS];
+} gpio_plan_t;
+
+//
+// Add a write to the plan.
+// Writes to the same register are merged.
+//
+void gpio_plan_add(gpio_plan_t *plan, int op, unsigned addr, unsigned value);
+
+//
+// Append writes for gpio_set_mode(), gpio_set_pull() and gpio_write()
+// to the plan, without touching the hardware.
+//
+void gpio_plan_mode(gpio_plan_t *plan, int pin, gpio_mode_t mode);
+void gpio_plan_pull(gpio_plan_t *plan, int pin, gpio_pull_t pull);
+void gpio_plan_write(gpio_plan_t *plan, int pin, int value);
+void gpio_plan_pps(gpio_plan_t *plan, int pin, gpio_mode_t mode);
+
+//
+// Sort ops in order of execution.
+//
+void gpio_plan_sort(gpio_plan_t *plan);
+
+//
+// Execute the plan.
+// Refused while any pin or function is owned by another process.
+// Return 0 on success, -1 when refused.
+//
+int gpio_plan_execute(const gpio_plan_t *plan);
+
+//
+// Save compiled plan to a file, or load it back.
+// The plan is tagged with size and modification time of the source profile,
+// and loading fails when the profile has changed since.
+// Return 0 on success, -1 on error.
+//
+int gpio_plan_save(const gpio_plan_t *plan, const char *filename, const char *profile);
+int gpio_plan_load(gpio_plan_t *plan, const char *filename, const char *profile);
+
+//
+// Compile a board profile into a plan of register writes.
+// Return 0 on success, -1 on error.
+//
+int profile_compile(const char *filename, gpio_plan_t *plan);
+
+//
+// Edge event, reported by sampler thread.
+//
+typedef struct {
+    unsigned long long timestamp;   // Nanoseconds, CLOCK_MONOTONIC
+    unsigned port;                  // Port index, 0 for A
+    unsigned changed;               // Mask of changed pins
+    unsigned value;                 // New value of watched pins
+} gpio_event_t;
+
+//
+// Start sampler thread, watching a given set of pins.
+// Nslots is a size of event ring, rounded up to a power of two.
+// Period is a delay between samples in microseconds, 0 for busy polling.
+// When use_cn is set, change notification hardware is used
+// to detect pulses shorter than a sampling period.
+// Return 0 on success, -1 on error.
+//
+int gpio_events_start(const int *pins, int npins, int nslots, int period, int use_cn);
+
+//
+// Stop sampler thread.
+//
+void gpio_events_stop(void);
+
+//
+// Get events from the ring, up to max records.
+// Never blocks: return a number of events, 0 when ring is empty.
+//
+int gpio_events_read(gpio_event_t *buf, int max);
+
+//
+// Get a number of events lost because the ring was full.
+//
+unsigned gpio_events_dropped(void);
+
+//
+// Compact capture of pin activity.
+// Changes of port words are stored as varint-encoded time deltas and
+// XOR masks, with run-length encoding of repeated patterns, in fixed-size
+// blocks.  Every block starts with full port state, and an index of
+// block times allows to seek by time.  Files are read through mmap.
+//
+typedef struct gpio_capture gpio_capture_t;
+
+//
+// Create a capture file, for pins given by per-port masks.
+// Start is a timestamp of capture start, in nanoseconds.
+// Return 0 on error.
+//
+gpio_capture_t *gpio_capture_create(const char *filename,
+    const unsigned mask[GPIO_NPORTS], unsigned long long start);
+
+//
+// Append a new value of port to the capture.
+//
+void gpio_capture_put(gpio_capture_t *cap, unsigned long long timestamp,
+    int port, unsigned value);
+
+//
+// Finish writing, store the block index.
+// Return 0 on success, -1 on error.
+//
+int gpio_capture_close(gpio_capture_t *cap);
+
+//
+// Open a capture file for reading.  Return 0 on error.
+//
+gpio_capture_t *gpio_capture_open(const char *filename);
+
+//
+// Mark the moment when capture was triggered.
+//
+void gpio_capture_set_trigger(gpio_capture_t *cap, unsigned long long timestamp);
+
+//
+// Get capture parameters.
+// Trigger time is 0 for untriggered captures.
+//
+unsigned long long gpio_capture_start(gpio_capture_t *cap);
+unsigned long long gpio_capture_end(gpio_capture_t *cap);
+unsigned gpio_capture_mask(gpio_capture_t *cap, int port);
+unsigned long long gpio_capture_trigger(gpio_capture_t *cap);
+
+//
+// Position at the first event not earlier than a given timestamp.
+// Port state at this moment is returned in state array.
+//
+void gpio_capture_seek(gpio_capture_t *cap, unsigned long long timestamp,
+    unsigned state[GPIO_NPORTS]);
+
+//
+// Get next event.  Return 0 at end of capture.
+//
+int gpio_capture_next(gpio_capture_t *cap, gpio_event_t *ev);
+
+//
+// Trigger for capture: a sequence of up to GPIO_TRIGGER_MAXSTAGES
+// conditions on port words, checked against every event.
+//
+#define GPIO_TRIGGER_MAXSTAGES  8
+
+enum {
+    TRIGGER_MATCH,              // Masked port word equals value
+    TRIGGER_EDGE,               // Pin comes to level given by value
+    TRIGGER_ANY_EDGE,           // Pin changes
+    TRIGGER_PULSE,              // Pulse of given level, width in min...max
+};
+
+typedef struct {
+    unsigned char kind;         // Condition
+    unsigned char port;         // Port index
+    unsigned short mask;        // Pins to check
+    unsigned value;             // Expected value of pins
+    unsigned long long min;     // Pulse width limits, nanoseconds
+    unsigned long long max;
+} gpio_trigger_stage_t;
+
+typedef struct {
+    int nstages;                // Number of stages
+    int current;                // Stage being checked
+    unsigned known;             // Mask of ports with known state
+    unsigned state[GPIO_NPORTS];
+    unsigned long long pulse_start;
+    gpio_trigger_stage_t stage[GPIO_TRIGGER_MAXSTAGES];
+} gpio_trigger_t;
+
+//
+// Add a stage to the trigger, given as text.
+// Return 0 on success, -1 on error.
+//
+int gpio_trigger_add(gpio_trigger_t *trig, const char *spec);
+
+//
+// Arm the trigger: start from the first stage.
+//
+void gpio_trigger_reset(gpio_trigger_t *trig);
+
+//
+// Check the trigger against next event.
+// Return 1 when the trigger fires.
+//
+int gpio_trigger_check(gpio_trigger_t *trig, const gpio_event_t *ev);
+
+//
+// Get per-port masks of pins used by the trigger.
+//
+void gpio_trigger_mask(const gpio_trigger_t *trig, unsigned mask[GPIO_NPORTS]);
+
+//
+// Parse time interval with optional suffix: ns, us, ms or s.
+// Return interval in nanoseconds, or -1 on error.
+//
+long long gpio_parse_time(const char *str);
+
+//
+// Pre-trigger history: circular buffer of recent events.
+//
+typedef struct {
+    gpio_event_t *slot;         // Allocated buffer
+    unsigned size;              // Number of slots
+    unsigned first;             // Index of oldest event
+    unsigned count;             // Number of events
+    unsigned long long span;    // Time to keep, nanoseconds
+    unsigned long long time;    // Time of base state
+    unsigned state[GPIO_NPORTS];// Port values before oldest event
+} gpio_history_t;
+
+int gpio_history_init(gpio_history_t *h, int nslots, unsigned long long span);
+void gpio_history_free(gpio_history_t *h);
+void gpio_history_put(gpio_history_t *h, const gpio_event_t *ev);
+
+//
+// Create a capture file with the contents of the history,
+// for the trigger fired at a given time.  The post-trigger window
+// is appended through the returned handle.  Return 0 on error.
+//
+gpio_capture_t *gpio_history_save(gpio_history_t *h, const char *filename,
+    const unsigned mask[GPIO_NPORTS], unsigned long long trigger_time);
+
+//
+// Get system clock frequency, and frequency of peripheral bus
+// clock PBCLKn, n = 1...7, in Hz.
+//
+unsigned gpio_sysclk(void);
+unsigned gpio_pbclk(int bus);
+
+//
+// Reference clock output on pin REFCLKO1, 3 or 4.
+// Start returns actual frequency, or 0 on error.
+//
+double gpio_refclk_start(int pin, unsigned hz);
+void gpio_refclk_stop(int pin);
+
+//
+// Timers 2...9, clocked from PBCLK3.
+// Start returns actual frequency, or 0 when it is out of range.
+// Rate computes the same frequency, without touching the timer.
+//
+unsigned gpio_timer_start(int timer, unsigned hz);
+unsigned gpio_timer_rate(int timer, unsigned hz);
+unsigned gpio_timer_freq(int timer);
+int gpio_timer_busy(int timer);
+void gpio_timer_stop(int timer);
+
+//
+// Start a pair of timers, like 2/3, as free-running 32-bit counter.
+// Return the count rate, or 0 on error.
+//
+unsigned gpio_timer_start32(int timer);
+unsigned gpio_timer_addr(int timer);
+int gpio_timer_irq(int timer);
+
+//
+// Count edges on a pin, by timer clocked from TxCK input.
+// Start returns the timer number, or 0 on error.
+//
+#define TIMER_GATE      1           // Count PBCLK3 while the pin is high
+#define TIMER_32BIT     2           // Use a pair of timers
+
+int gpio_counter_start(int pin, unsigned prescale, int flags);
+unsigned gpio_counter_read(int timer);
+void gpio_counter_stop(int timer, int pin);
+
+//
+// Hardware-timed capture of one port: timer 6 triggers DMA channel 7,
+// which copies PORTx into a circular buffer in reserved memory.
+// Only completed halves of the buffer are read.
+// Start returns actual sample rate, or 0 on error.
+//
+unsigned gpio_dmacap_start(int port, unsigned rate);
+void gpio_dmacap_stop(void);
+
+//
+// Get samples from completed halves of the buffer, up to max.
+// Halves overwritten before they were read are skipped: *lost is set
+// to a number of samples missing before the returned ones.
+// Never blocks: return a number of samples, 0 when nothing is ready.
+//
+int gpio_dmacap_read(unsigned short *buf, int max, unsigned *lost);
+
+//
+// Get a number of buffer halves overwritten before they were read.
+//
+unsigned gpio_dmacap_overruns(void);
+
+//
+// Pattern output: timer 7 triggers DMA channel 6, which writes
+// words from a double buffer into LATx, or LATxINV.
+// Flags for gpio_pattern_start().
+//
+#define PATTERN_INVERT  1           // Write into LATxINV: toggle pins
+#define PATTERN_LOOP    2           // Repeat the buffer forever
+
+//
+// Prepare pattern output to a port, with given word rate in Hz.
+// Output starts when both halves of the buffer are filled,
+// or by gpio_pattern_flush().  All pins of the port are claimed.
+// Return actual rate, or 0 on error.
+//
+unsigned gpio_pattern_start(int port, unsigned rate, int flags);
+
+//
+// Queue words for output, while the other half plays.
+// Never blocks: return a number of words accepted,
+// 0 when both halves are still busy, or -1 on underrun:
+// DMA has reached a half which was not refilled in time,
+// and output was stopped.
+//
+int gpio_pattern_queue(const unsigned short *words, int n);
+
+//
+// No more data: play the rest, or start repeating in loop mode.
+//
+void gpio_pattern_flush(void);
+
+//
+// Check whether output is still running.
+// Return -1 when it was stopped by underrun.
+//
+int gpio_pattern_busy(void);
+
+//
+// Sleep before polling again: a fraction of the time
+// to play a half of the buffer, at most 1 msec.
+//
+void gpio_pattern_wait(void);
+
+//
+// Stop output immediately.
+//
+void gpio_pattern_stop(void);
+
+//
+// Hardware PWM by output compare modules, with timer 2 or 3.
+// Start returns actual frequency, or 0 on error.
+// Calling it again for the same pin changes the duty cycle
+// at the next period, without glitches.
+//
+unsigned gpio_pwm_start(int pin, unsigned freq, double duty);
+void gpio_pwm_stop(int pin);
+
+//
+// Edge captured by input capture module.
+//
+typedef struct {
+    unsigned long long ticks;       // Time in timer ticks
+    int rising;                     // 1 for rising edge, 0 for falling
+} gpio_edge_t;
+
+//
+// State of input capture on one pin.
+//
+typedef struct {
+    volatile unsigned *regs;        // Module registers
+    int n;                          // Module number
+    int pin;
+    unsigned rate;                  // Timer ticks per second
+    unsigned last;                  // Last 32-bit value
+    unsigned long long wraps;       // Upper part of time
+    unsigned long long nedges;
+    unsigned overflows;
+} gpio_ic_t;
+
+//
+// Input capture of edges on a pin, by ICx with timers 2/3
+// as a 32-bit time base.  Start returns the rate of ticks
+// per second, or 0 on error.
+//
+unsigned gpio_ic_start(gpio_ic_t *ic, int pin);
+void gpio_ic_stop(gpio_ic_t *ic);
+
+//
+// Get captured edges from the hardware buffer, up to max.
+// Never blocks: return a number of edges, 0 when none,
+// or -1 when the buffer has overflowed: edges were lost,
+// and capture starts over from the next rising edge.
+//
+int gpio_ic_read(gpio_ic_t *ic, gpio_edge_t *buf, int max);
+
+//
+// Get a number of buffer overflows: edges were lost.
+//
+unsigned gpio_ic_overflows(const gpio_ic_t *ic);
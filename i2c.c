@@ -32,6 +32,7 @@
 #include <stdint.h>
 #include <errno.h>
 #include <sys/mman.h>
+#include <pthread.h>
 #include "gpio.h"
 
 //
@@ -45,7 +46,51 @@
 
 static const int I2C_ADDR = 0x1f820000;
 
+//
+// Registers of I2Cx, as offsets from I2CxCON, in words.
+//
+#define I2CSTAT     (0x10/4)
+#define I2CBRG      (0x40/4)
+#define I2CTRN      (0x50/4)
+#define I2CRCV      (0x60/4)
+
+//
+// Every register is followed by CLR and SET companions,
+// which clear or set given bits atomically.
+//
+#define REG_CLR     1
+#define REG_SET     2
+
+#define CON_ON      0x8000
+#define CON_DISSLW  0x0200          // Slew rate control disabled
+#define CON_ACKDT   0x0020          // Send NACK when acknowledging
+#define CON_ACKEN   0x0010          // Start acknowledge sequence
+#define CON_RCEN    0x0008          // Receive a byte
+#define CON_PEN     0x0004          // Stop condition
+#define CON_RSEN    0x0002          // Repeated start condition
+#define CON_SEN     0x0001          // Start condition
+#define CON_SEQ     0x001f          // Any of the above in progress
+
+#define STAT_ACKSTAT 0x8000         // No acknowledge from slave
+#define STAT_TRSTAT 0x4000          // Transmit in progress
+#define STAT_BCL    0x0400          // Bus collision
+#define STAT_IWCOL  0x0080          // Write collision
+#define STAT_P      0x0010          // Stop detected last
+#define STAT_S      0x0008          // Start detected last
+
+//
+// Pulse gobbler delay, in nanoseconds, for rate computation.
+//
+#define I2C_TPGD_NS 104
+
+//
+// Spin count to wait for a bus operation.  Enough for a byte
+// at 100 kHz plus clock stretching by a slow device.
+//
+#define I2C_TIMEOUT 1000000
+
 static ptrdiff_t i2c_base;          // PPS registers mapped here
+static pthread_once_t i2c_once = PTHREAD_ONCE_INIT;
 
 //
 // Get access to PPS control registers.
@@ -55,6 +100,8 @@ static void i2c_init()
 {
     extern int gpio_mem_fd;
 
+    gpio_open();
+
     // Map a page of memory to the PPS address
     i2c_base = (ptrdiff_t) mmap(0, 4096, PROT_READ|PROT_WRITE, MAP_SHARED,
         gpio_mem_fd, I2C_ADDR);
@@ -89,14 +136,13 @@ gpio_mode_t gpio_get_i2c_function(int pin)
     case GPIO_PIN('F',4):  offset = I2C5CON; mode = MODE_SDA5; break;
     }
 
-    if (!i2c_base)
-        i2c_init();
+    pthread_once(&i2c_once, i2c_init);
 
     // Read I2CxCON register.
     volatile uint32_t *regp = (uint32_t*) (i2c_base + offset);
     uint32_t spicon = *regp;
-    if (gpio_debug > 1)
-        printf("--- %s: [%08x] -> %08x\n", __func__, I2C_ADDR + offset, spicon);
+    gpio_stats_mmio(1, 0);
+    gpio_trace_read(I2C_ADDR + offset, spicon);
 
     // Check ON bit.
     if (spicon & 0x00008000) {
@@ -105,3 +151,288 @@ gpio_mode_t gpio_get_i2c_function(int pin)
     }
     return 0;
 }
+
+//
+// I2CxCON registers, in order of snapshot.
+//
+static const int i2ccon_offset[I2C_NPORTS] = {
+    I2C1CON, I2C2CON, I2C3CON, I2C4CON, I2C5CON,
+};
+
+//
+// Save I2C control registers into a snapshot.
+//
+void gpio_save_i2c(gpio_snapshot_t *snap)
+{
+    int i;
+
+    pthread_once(&i2c_once, i2c_init);
+
+    for (i = 0; i < I2C_NPORTS; i++)
+        snap->i2ccon[i] = *(volatile uint32_t*) (i2c_base + i2ccon_offset[i]);
+}
+
+//
+// Restore I2C control registers from a snapshot.
+// Write only registers which differ from the live state.
+// Return a number of writes.
+//
+int gpio_restore_i2c(const gpio_snapshot_t *snap)
+{
+    int i, nwrites = 0;
+
+    pthread_once(&i2c_once, i2c_init);
+
+    for (i = 0; i < I2C_NPORTS; i++) {
+        volatile uint32_t *regp = (uint32_t*) (i2c_base + i2ccon_offset[i]);
+
+        uint32_t old = *regp;
+
+        if (old != snap->i2ccon[i]) {
+            *regp = snap->i2ccon[i];
+            nwrites++;
+            gpio_trace_write(I2C_ADDR + i2ccon_offset[i], old, snap->i2ccon[i]);
+        }
+    }
+    return nwrites;
+}
+
+//
+// Dedicated SCLx and SDAx pins.
+//
+static const int i2c_scl[I2C_NPORTS+1] = {
+    0, GPIO_PIN('A',14), GPIO_PIN('A',2), GPIO_PIN('F',8),
+    GPIO_PIN('G',8), GPIO_PIN('F',5),
+};
+static const int i2c_sda[I2C_NPORTS+1] = {
+    0, GPIO_PIN('A',15), GPIO_PIN('A',3), GPIO_PIN('F',2),
+    GPIO_PIN('G',7), GPIO_PIN('F',4),
+};
+
+static int i2c_started[I2C_NPORTS+1];
+
+static volatile uint32_t *i2c_reg(int port)
+{
+    pthread_once(&i2c_once, i2c_init);
+    return (uint32_t*) (i2c_base + i2ccon_offset[port - 1]);
+}
+
+//
+// Start I2Cx, x = 1...5, as master with a given clock rate:
+// 100 kHz, 400 kHz or 1 MHz.  A module which is already
+// enabled is left alone.
+// Return actual rate, or 0 on error.
+//
+unsigned gpio_i2c_start(int port, unsigned hz)
+{
+    if (port < 1 || port > I2C_NPORTS) {
+        fprintf(stderr, "gpio: Bad I2C port %d\n", port);
+        return 0;
+    }
+    if (hz < 10000 || hz > 1000000) {
+        fprintf(stderr, "gpio: I2C rate must be 10 kHz...1 MHz\n");
+        return 0;
+    }
+
+    // BRG = (1/(2*rate) - TPGD) * PBCLK - 2
+    unsigned pbclk = gpio_pbclk(2);
+    double brg = (0.5 / hz - I2C_TPGD_NS * 1e-9) * pbclk - 2;
+    if (brg < 2 || brg > 0xffff) {
+        fprintf(stderr, "gpio: Cannot get I2C rate %u Hz from PBCLK2 %u Hz\n", hz, pbclk);
+        return 0;
+    }
+    unsigned div = brg + 0.999;
+    if (gpio_claim_function(MODE_SCL1 + port - 1, "i2c") < 0)
+        return 0;
+
+    volatile uint32_t *i2c = i2c_reg(port);
+    if (i2c[0] & CON_ON) {
+        fprintf(stderr, "gpio: I2C%d is busy\n", port);
+        gpio_release_function(MODE_SCL1 + port - 1);
+        return 0;
+    }
+
+    // Pins are dedicated: the module takes them over when enabled.
+    // Make them digital inputs, with no PPS output mapped.
+    if (gpio_set_mode(i2c_scl[port], MODE_INPUT) < 0 ||
+        gpio_set_mode(i2c_sda[port], MODE_INPUT) < 0) {
+        gpio_release_function(MODE_SCL1 + port - 1);
+        return 0;
+    }
+
+    // Slew rate control is meant for 400 kHz only.
+    i2c[0] = 0;
+    i2c[I2CBRG] = div;
+    i2c[I2CSTAT + REG_CLR] = STAT_BCL | STAT_IWCOL;
+    i2c[0] = CON_ON | ((hz > 100000 && hz <= 400000) ? 0 : CON_DISSLW);
+    i2c_started[port] = 1;
+
+    return pbclk / ((div + 2) * 2 + 2 * I2C_TPGD_NS * 1e-9 * pbclk);
+}
+
+//
+// Wait until the bus sequence is finished and the transmitter is idle.
+// Return 0 on success, -1 on timeout or collision.
+//
+static int i2c_wait(volatile uint32_t *i2c)
+{
+    int timeout;
+
+    for (timeout = I2C_TIMEOUT; timeout > 0; timeout--) {
+        if (!(i2c[0] & CON_SEQ) && !(i2c[I2CSTAT] & STAT_TRSTAT))
+            break;
+    }
+    if (i2c[I2CSTAT] & (STAT_BCL | STAT_IWCOL)) {
+        fprintf(stderr, "gpio: I2C bus collision\n");
+        i2c[I2CSTAT + REG_CLR] = STAT_BCL | STAT_IWCOL;
+        return -1;
+    }
+    if (timeout == 0) {
+        fprintf(stderr, "gpio: I2C bus timeout\n");
+        return -1;
+    }
+    return 0;
+}
+
+//
+// Start a bus sequence: start, restart, stop, receive or acknowledge.
+//
+static int i2c_seq(volatile uint32_t *i2c, unsigned bit)
+{
+    i2c[REG_SET] = bit;
+    return i2c_wait(i2c);
+}
+
+//
+// Send a byte.  Return 0 on acknowledge, 1 on no acknowledge,
+// -1 on error.
+//
+static int i2c_send(volatile uint32_t *i2c, unsigned byte)
+{
+    i2c[I2CTRN] = byte;
+    if (i2c_wait(i2c) < 0)
+        return -1;
+    return (i2c[I2CSTAT] & STAT_ACKSTAT) ? 1 : 0;
+}
+
+//
+// Receive a byte, and acknowledge it, or not when it is the last one.
+// Return the byte, or -1 on error.
+//
+static int i2c_recv(volatile uint32_t *i2c, int last)
+{
+    int byte;
+
+    if (i2c_seq(i2c, CON_RCEN) < 0)
+        return -1;
+    byte = i2c[I2CRCV] & 0xff;
+
+    if (last)
+        i2c[REG_SET] = CON_ACKDT;
+    else
+        i2c[REG_CLR] = CON_ACKDT;
+    if (i2c_seq(i2c, CON_ACKEN) < 0)
+        return -1;
+    return byte;
+}
+
+//
+// Run a sequence of messages as one transaction: start, then
+// every message after a restart, and stop at the end.  Bytes are
+// clocked back to back, without returning to the caller.
+// Return 0 on success, 1 when a slave does not acknowledge,
+// -1 on bus error.
+//
+int gpio_i2c_transfer(int port, gpio_i2c_msg_t *msg, int nmsgs)
+{
+    if (port < 1 || port > I2C_NPORTS || !i2c_started[port]) {
+        fprintf(stderr, "gpio: I2C%d is not started\n", port);
+        return -1;
+    }
+
+    volatile uint32_t *i2c = i2c_reg(port);
+    int status, i;
+    unsigned n;
+
+    status = i2c_seq(i2c, CON_SEN);
+    for (i = 0; i < nmsgs && status == 0; i++, msg++) {
+        if (i > 0)
+            status = i2c_seq(i2c, CON_RSEN);
+        if (status == 0)
+            status = i2c_send(i2c, msg->addr << 1 | (msg->read ? 1 : 0));
+
+        for (n = 0; n < msg->len && status == 0; n++) {
+            if (msg->read) {
+                int byte = i2c_recv(i2c, n == msg->len - 1);
+
+                if (byte < 0)
+                    status = -1;
+                else
+                    msg->buf[n] = byte;
+            } else {
+                status = i2c_send(i2c, msg->buf[n]);
+            }
+        }
+    }
+
+    // Release the bus in any case.
+    if (i2c_seq(i2c, CON_PEN) < 0)
+        status = -1;
+    return status;
+}
+
+//
+// Write bytes to a slave, then read bytes after a restart.
+// Either part can be empty.
+// Return 0 on success, 1 on no acknowledge, -1 on error.
+//
+int gpio_i2c_write_read(int port, int addr, const void *wbuf, unsigned wlen,
+    void *rbuf, unsigned rlen)
+{
+    gpio_i2c_msg_t msg[2];
+    int n = 0;
+
+    if (wlen > 0 || rlen == 0) {
+        msg[n].addr = addr;
+        msg[n].read = 0;
+        msg[n].len = wlen;
+        msg[n].buf = (unsigned char*) wbuf;
+        n++;
+    }
+    if (rlen > 0) {
+        msg[n].addr = addr;
+        msg[n].read = 1;
+        msg[n].len = rlen;
+        msg[n].buf = rbuf;
+        n++;
+    }
+    return gpio_i2c_transfer(port, msg, n);
+}
+
+//
+// Check whether a slave responds at the address.
+// Return 1 when present, 0 when absent, -1 on error.
+//
+int gpio_i2c_probe(int port, int addr)
+{
+    int status = gpio_i2c_write_read(port, addr, 0, 0, 0, 0);
+
+    if (status < 0)
+        return -1;
+    return !status;
+}
+
+//
+// Stop I2Cx, and make its pins input.
+//
+void gpio_i2c_stop(int port)
+{
+    if (port < 1 || port > I2C_NPORTS || !i2c_started[port])
+        return;
+
+    *i2c_reg(port) = 0;
+    gpio_set_mode(i2c_scl[port], MODE_INPUT);
+    gpio_set_mode(i2c_sda[port], MODE_INPUT);
+    gpio_release_function(MODE_SCL1 + port - 1);
+    i2c_started[port] = 0;
+}
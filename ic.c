@@ -0,0 +1,194 @@
+/*
+ * Input capture modules of PIC32MZ: timing of pulses.
+ *
+ * Copyright (C) 2019 Serge Vakulenko
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   1. Redistributions of source code must retain the above copyright notice,
+ *      this list of conditions and the following disclaimer.
+ *   2. Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer in the
+ *      documentation and/or other materials provided with the distribution.
+ *   3. The name of the author may not be used to endorse or promote products
+ *      derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR IMPLIED
+ * WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO
+ * EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+ * OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ * OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ * ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#include <stdio.h>
+#include "gpio.h"
+
+//
+// Input capture registers.
+//
+#define IC1CON      0x1f842000      // Next modules follow with step 0x200
+#define ICCON_ON    0x8000
+#define ICCON_FEDGE 0x0200          // First edge is rising
+#define ICCON_C32   0x0100          // 32-bit capture
+#define ICCON_ICTMR 0x0080          // Timer 2 instead of timer 3
+#define ICCON_ICOV  0x0010          // Buffer overflow
+#define ICCON_ICBNE 0x0008          // Buffer not empty
+#define ICCON_EDGES 0x0006          // Every edge, starting from FEDGE
+#define ICBUF       (0x10/4)
+
+#define TCON_T32    0x0008
+#define TCON_TCS    0x0002          // Counts edges of TxCK
+#define TCON_TGATE  0x0080          // Gated by TxCK
+#define TCON_TCKPS  0x0070          // Prescaler
+#define PR_OFFSET   0x20
+
+//
+// Edges alternate, starting from rising one,
+// so polarity is known by the count of edges.
+//
+#define ICCON_MODE  (ICCON_FEDGE | ICCON_C32 | ICCON_ICTMR | ICCON_EDGES | ICCON_ON)
+
+//
+// Get registers of module ICn, n = 1...9.
+//
+static volatile unsigned *ic_reg(int n)
+{
+    return gpio_sfr(IC1CON + (n - 1) * 0x200);
+}
+
+//
+// Check whether timers 2/3 already run as a free-running 32-bit counter
+// of PBCLK3 without prescaler, usable as a time base.  An external
+// clock counter, gated or prescaled one is not.
+//
+static int timer_shared()
+{
+    volatile unsigned *tcon = gpio_sfr(gpio_timer_addr(2));
+    volatile unsigned *next = gpio_sfr(gpio_timer_addr(3));
+
+    return (tcon[0] & TCON_T32) && gpio_timer_busy(2) &&
+           !(tcon[0] & (TCON_TCS | TCON_TGATE | TCON_TCKPS)) &&
+           tcon[PR_OFFSET/4] == 0xffffffff && next[PR_OFFSET/4] == 0xffffffff;
+}
+
+//
+// Start capture of edges on a pin.  A free ICx, which the pin can be
+// mapped to, is used with timers 2/3 as a 32-bit time base.
+// Return the rate of timestamps in ticks per second, or 0 on error.
+//
+unsigned gpio_ic_start(gpio_ic_t *ic, int pin)
+{
+    int n;
+
+    ic->regs = 0;
+    for (n = 1; n <= 9; n++) {
+        if (!gpio_has_mapping(pin, MODE_IC1 + n - 1) ||
+            (*ic_reg(n) & ICCON_ON))
+            continue;
+        if (gpio_claim_function(MODE_IC1 + n - 1, "measure") == 0)
+            break;
+    }
+    if (n > 9) {
+        fprintf(stderr, "gpio: No free input capture module for this pin\n");
+        return 0;
+    }
+
+    // Time base: 32-bit pair of timers 2 and 3.
+    if (timer_shared()) {
+        ic->rate = gpio_pbclk(3);
+    } else if (gpio_timer_busy(2) || gpio_timer_busy(3)) {
+        fprintf(stderr, "gpio: Timers 2 and 3 are busy\n");
+        gpio_release_function(MODE_IC1 + n - 1);
+        return 0;
+    } else {
+        ic->rate = gpio_timer_start32(2);
+    }
+
+    ic->n = n;
+    ic->pin = pin;
+    ic->last = 0;
+    ic->wraps = 0;
+    ic->nedges = 0;
+    ic->overflows = 0;
+
+    if (gpio_set_mode(pin, MODE_IC1 + n - 1) < 0) {
+        gpio_release_function(MODE_IC1 + n - 1);
+        return 0;
+    }
+    ic->regs = ic_reg(n);
+    ic->regs[0] = 0;
+    ic->regs[0] = ICCON_MODE;
+    return ic->rate;
+}
+
+//
+// Get captured edges from the hardware buffer, up to max.
+// Timestamps are extended to 64 bits, so the buffer
+// must be drained at least once per timer wrap: 2^32 ticks.
+// Never blocks: return a number of edges, 0 when none.
+//
+int gpio_ic_read(gpio_ic_t *ic, gpio_edge_t *buf, int max)
+{
+    int n = 0;
+
+    if (!ic->regs)
+        return 0;
+
+    if (ic->regs[0] & ICCON_ICOV) {
+        // Edges were lost: polarity is unknown, start over.
+        ic->regs[0] = 0;
+        ic->regs[0] = ICCON_MODE;
+        ic->nedges = 0;
+        ic->overflows++;
+        return -1;
+    }
+
+    while (n < max && (ic->regs[0] & ICCON_ICBNE)) {
+        unsigned value = ic->regs[ICBUF];
+
+        if (value < ic->last)
+            ic->wraps += 1ULL << 32;
+        ic->last = value;
+
+        buf[n].ticks = ic->wraps + value;
+        buf[n].rising = !(ic->nedges & 1);
+        ic->nedges++;
+        n++;
+    }
+    return n;
+}
+
+//
+// Get a number of buffer overflows: edges were lost.
+//
+unsigned gpio_ic_overflows(const gpio_ic_t *ic)
+{
+    return ic->overflows;
+}
+
+//
+// Stop capture, and make the pin input.
+// Timers are stopped when no other module needs them.
+//
+void gpio_ic_stop(gpio_ic_t *ic)
+{
+    int n;
+
+    if (!ic->regs)
+        return;
+    ic->regs[0] = 0;
+    gpio_set_mode(ic->pin, MODE_INPUT);
+    gpio_release_function(MODE_IC1 + ic->n - 1);
+    ic->regs = 0;
+
+    for (n = 1; n <= 9; n++) {
+        if (*ic_reg(n) & ICCON_ON)
+            return;
+    }
+    gpio_timer_stop(2);
+}
@@ -0,0 +1,513 @@
+/*
+ * Flight recorder: circular journal of pin and mode changes.
+ *
+ * Copyright (C) 2019 Serge Vakulenko
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   1. Redistributions of source code must retain the above copyright notice,
+ *      this list of conditions and the following disclaimer.
+ *   2. Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer in the
+ *      documentation and/or other materials provided with the distribution.
+ *   3. The name of the author may not be used to endorse or promote products
+ *      derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR IMPLIED
+ * WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO
+ * EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+ * OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ * OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ * ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "gpio.h"
+
+extern const char *phys_name[];
+extern const char *mode_name[];
+extern int phys_to_bcm(int phys);
+extern int phys_to_pin(int phys);
+
+//
+// Journal file: a header, followed by a ring of fixed-size records.
+// Write position is not stored: it follows the record with the
+// highest sequence number.  A record is committed by writing its
+// sequence number last; a record with zero sequence or bad CRC
+// was torn by a crash, and is skipped by the reader.
+// Sequence numbers wrap: they are compared by serial number
+// arithmetic, which holds since the ring is much smaller than
+// 2^31 records, and zero is skipped.
+//
+#define JOURNAL_MAGIC   "PIC32JRN"
+#define JOURNAL_VERSION 1
+
+struct journal_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t nrecords;              // Capacity of the ring
+    uint32_t record_size;
+    uint32_t reserved[11];
+};
+
+enum {
+    JREC_START = 1,                 // Recorder started
+    JREC_PORT,                      // Port value: port index, value
+    JREC_MODE,                      // Mode of header pin: phys, mode
+};
+
+struct journal_record {
+    uint32_t seq;                   // Sequence number, written last; 0 = empty
+    uint16_t type;                  // JREC_xxx
+    uint16_t index;                 // Port or physical pin
+    uint64_t time;                  // CLOCK_REALTIME, nanoseconds
+    uint32_t value;                 // Port word or mode
+    uint32_t gen;                   // Generation of configuration
+    uint32_t crc;                   // CRC-32 of all previous fields
+    uint32_t reserved;
+};
+
+#define JOURNAL_RECORDS 65536       // Default capacity: 2 Mbytes
+#define JOURNAL_MAXRECORDS (1 << 24) // Largest: 512 Mbytes
+
+static volatile sig_atomic_t journal_stop;
+
+static void journal_interrupt(int sig)
+{
+    journal_stop = 1;
+}
+
+//
+// CRC-32 of a record, up to the crc field, with sequence set.
+//
+static uint32_t record_crc(const struct journal_record *r)
+{
+    const uint8_t *p = (const uint8_t*) r;
+    uint32_t crc = 0xffffffff;
+    int i, k;
+
+    for (i = 0; i < offsetof(struct journal_record, crc); i++) {
+        crc ^= p[i];
+        for (k = 0; k < 8; k++)
+            crc = (crc >> 1) ^ (0xedb88320 & -(crc & 1));
+    }
+    return ~crc;
+}
+
+static int record_valid(const struct journal_record *r)
+{
+    return r->seq != 0 && r->crc == record_crc(r);
+}
+
+//
+// Compare sequence numbers, across the wrap.
+// Return negative, zero or positive, like strcmp.
+//
+static int seq_diff(uint32_t a, uint32_t b)
+{
+    int32_t d = a - b;
+
+    return (d > 0) - (d < 0);
+}
+
+//
+// Map a journal file.  When create is set, a new file of *nrecords
+// is made, or an existing journal of any size is reused; other
+// files are never overwritten.  The file is opened as the real user.
+// The header is checked against the file size, and the capacity
+// is returned in *nrecords: the header itself is not trusted later.
+// Return the header, or 0 on error.
+//
+static struct journal_header *journal_map(const char *filename, int create,
+    unsigned *nrecords, size_t *size)
+{
+    int fd = gpio_open_user(filename, create ? O_RDWR | O_CREAT : O_RDONLY, 0644);
+    struct journal_header hdr;
+    struct stat st;
+
+    if (fd < 0 || fstat(fd, &st) < 0) {
+        fprintf(stderr, "gpio: %s: %s\n", filename, strerror(errno));
+        if (fd >= 0)
+            close(fd);
+        return 0;
+    }
+    if (create && st.st_size == 0) {
+        // New file.
+        memset(&hdr, 0, sizeof(hdr));
+        memcpy(hdr.magic, JOURNAL_MAGIC, 8);
+        hdr.version = JOURNAL_VERSION;
+        hdr.nrecords = *nrecords;
+        hdr.record_size = sizeof(struct journal_record);
+        if (ftruncate(fd, sizeof(hdr) + (off_t) *nrecords * sizeof(struct journal_record)) < 0 ||
+            pwrite(fd, &hdr, sizeof(hdr), 0) != sizeof(hdr)) {
+            fprintf(stderr, "gpio: %s: %s\n", filename, strerror(errno));
+            close(fd);
+            return 0;
+        }
+    } else if (!S_ISREG(st.st_mode) ||
+        pread(fd, &hdr, sizeof(hdr), 0) != sizeof(hdr) ||
+        memcmp(hdr.magic, JOURNAL_MAGIC, 8) != 0 ||
+        hdr.version != JOURNAL_VERSION ||
+        hdr.record_size != sizeof(struct journal_record) ||
+        hdr.nrecords == 0 || hdr.nrecords > JOURNAL_MAXRECORDS ||
+        st.st_size < sizeof(hdr) + (off_t) hdr.nrecords * sizeof(struct journal_record)) {
+        fprintf(stderr, "gpio: %s: Not a journal file\n", filename);
+        close(fd);
+        return 0;
+    }
+
+    *nrecords = hdr.nrecords;
+    *size = sizeof(hdr) + (size_t) hdr.nrecords * sizeof(struct journal_record);
+    void *p = mmap(0, *size, create ? PROT_READ|PROT_WRITE : PROT_READ,
+        MAP_SHARED, fd, 0);
+    close(fd);
+    if (p == MAP_FAILED) {
+        fprintf(stderr, "gpio: %s: %s\n", filename, strerror(errno));
+        return 0;
+    }
+    return p;
+}
+
+static struct journal_record *journal_ring(struct journal_header *hdr)
+{
+    return (struct journal_record*) (hdr + 1);
+}
+
+//
+// Find the record with the highest sequence number.
+// Return its index, or -1 when the journal is empty.
+//
+static int journal_last(struct journal_header *hdr, unsigned nrecords)
+{
+    struct journal_record *ring = journal_ring(hdr);
+    int i, last = -1;
+
+    for (i = 0; i < nrecords; i++) {
+        if (record_valid(&ring[i]) && (last < 0 || seq_diff(ring[i].seq, ring[last].seq) > 0))
+            last = i;
+    }
+    return last;
+}
+
+//
+// State of the recorder.
+//
+static struct journal_header *jhdr;
+static unsigned jcount;             // Capacity of the ring
+static unsigned jpos;               // Next slot
+static uint32_t jseq;               // Last sequence number
+static uint32_t jgen;               // Generation of configuration
+
+//
+// Append a record.  The slot is invalidated first, then filled,
+// then committed by the sequence number.
+//
+static void journal_put(int type, int index, uint64_t time, uint32_t value)
+{
+    struct journal_record *r = &journal_ring(jhdr)[jpos];
+    struct journal_record tmp;
+
+    memset(&tmp, 0, sizeof(tmp));
+    if (++jseq == 0)
+        jseq = 1;
+    tmp.seq = jseq;
+    tmp.type = type;
+    tmp.index = index;
+    tmp.time = time;
+    tmp.value = value;
+    tmp.gen = jgen;
+    tmp.crc = record_crc(&tmp);
+
+    __atomic_store_n(&r->seq, 0, __ATOMIC_RELEASE);
+    r->type = tmp.type;
+    r->index = tmp.index;
+    r->time = tmp.time;
+    r->value = tmp.value;
+    r->gen = tmp.gen;
+    r->crc = tmp.crc;
+    __atomic_store_n(&r->seq, tmp.seq, __ATOMIC_RELEASE);
+
+    jpos = (jpos + 1) % jcount;
+}
+
+static uint64_t realtime_nsec()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+//
+// gpio journal record [-i msec] [-c msec] [-n records] <file>
+// Poll port values every interval (10 msec by default), and append
+// a record for every port which changed.  Configuration is checked
+// at a lower rate (1 second by default): on change, its generation
+// is incremented, and modes of header pins which changed are recorded.
+// While pins are idle, nothing is written.
+//
+static void journal_record(int argc, char **argv)
+{
+    int interval = 10, config_interval = 1000;
+    unsigned nrecords = JOURNAL_RECORDS;
+
+    optind = 1;
+    for (;;) {
+        switch (getopt(argc, argv, "+i:c:n:")) {
+        case EOF:
+            break;
+        case 'i':
+            interval = strtol(optarg, 0, 0);
+            continue;
+        case 'c':
+            config_interval = strtol(optarg, 0, 0);
+            continue;
+        case 'n':
+            nrecords = strtoul(optarg, 0, 0);
+            continue;
+        default:
+            argc = 0;
+            continue;
+        }
+        break;
+    }
+    argc -= optind;
+    argv += optind;
+
+    if (argc != 1 || interval <= 0 || config_interval < interval ||
+        nrecords < 16 || nrecords > JOURNAL_MAXRECORDS) {
+        fprintf(stderr, "Usage: gpio journal record [-i msec] [-c msec] [-n records] <file>\n");
+        exit(-1);
+    }
+
+    size_t size;
+    jcount = nrecords;
+    jhdr = journal_map(argv[0], 1, &jcount, &size);
+    if (!jhdr)
+        exit(-1);
+
+    // Continue after the last record, with its generation.
+    int last = journal_last(jhdr, jcount);
+    if (last >= 0) {
+        jpos = (last + 1) % jcount;
+        jseq = journal_ring(jhdr)[last].seq;
+        jgen = journal_ring(jhdr)[last].gen + 1;
+    }
+
+    signal(SIGINT, journal_interrupt);
+    signal(SIGTERM, journal_interrupt);
+
+    static gpio_snapshot_t snap, config;
+    gpio_mode_t mode[1+40];
+    unsigned value[GPIO_NPORTS];
+    volatile unsigned *port_reg[GPIO_NPORTS];
+    int port, phys, ticks = 0;
+    uint64_t now = realtime_nsec();
+
+    // Full state at start.
+    gpio_snapshot(&config);
+    journal_put(JREC_START, 0, now, 0);
+    for (port = 0; port < GPIO_NPORTS; port++) {
+        port_reg[port] = gpio_port_reg(port, GPIO_PORT);
+        value[port] = config.port[port][GPIO_PORT] & 0xffff;
+        journal_put(JREC_PORT, port, now, value[port]);
+    }
+    for (phys = 1; phys <= 40; phys++) {
+        if (phys_to_bcm(phys) < 0)
+            continue;
+        mode[phys] = gpio_get_mode(phys_to_pin(phys));
+        journal_put(JREC_MODE, phys, now, mode[phys]);
+    }
+
+    while (!journal_stop) {
+        usleep(interval * 1000);
+        now = 0;
+
+        for (port = 0; port < GPIO_NPORTS; port++) {
+            unsigned v = *port_reg[port] & 0xffff;
+
+            if (v != value[port]) {
+                if (!now)
+                    now = realtime_nsec();
+                journal_put(JREC_PORT, port, now, v);
+                value[port] = v;
+            }
+        }
+
+        // Configuration is polled at a lower rate: it needs
+        // reading of all PPS registers.
+        ticks += interval;
+        if (ticks < config_interval)
+            continue;
+        ticks = 0;
+
+        gpio_snapshot(&snap);
+        if (!gpio_snapshot_config_changed(&snap, &config))
+            continue;
+        config = snap;
+        jgen++;
+        now = realtime_nsec();
+        for (phys = 1; phys <= 40; phys++) {
+            if (phys_to_bcm(phys) < 0)
+                continue;
+            gpio_mode_t m = gpio_get_mode(phys_to_pin(phys));
+
+            if (m != mode[phys]) {
+                journal_put(JREC_MODE, phys, now, m);
+                mode[phys] = m;
+            }
+        }
+    }
+    msync(jhdr, size, MS_SYNC);
+    munmap(jhdr, size);
+}
+
+//
+// Compare records by sequence number.
+//
+static int compare_seq(const void *a, const void *b)
+{
+    const struct journal_record *ra = *(const struct journal_record**) a;
+    const struct journal_record *rb = *(const struct journal_record**) b;
+
+    return seq_diff(ra->seq, rb->seq);
+}
+
+//
+// gpio journal [-l hours] <file>
+// Print valid records of a journal in order, optionally only
+// those of the last hours before the latest record.
+//
+static void journal_dump(int argc, char **argv)
+{
+    static const char port_name[] = "ABCDEFGHJK";
+    double hours = 0;
+
+    optind = 1;
+    for (;;) {
+        switch (getopt(argc, argv, "+l:")) {
+        case EOF:
+            break;
+        case 'l':
+            hours = strtod(optarg, 0);
+            continue;
+        default:
+            argc = 0;
+            continue;
+        }
+        break;
+    }
+    argc -= optind;
+    argv += optind;
+
+    if (argc != 1 || hours < 0) {
+        fprintf(stderr, "Usage: gpio journal [-l hours] <file>\n");
+        fprintf(stderr, "       gpio journal record [-i msec] [-c msec] [-n records] <file>\n");
+        exit(-1);
+    }
+
+    size_t size;
+    unsigned nrecords;
+    struct journal_header *hdr = journal_map(argv[0], 0, &nrecords, &size);
+    if (!hdr)
+        exit(-1);
+
+    // Collect valid records, and sort them by sequence.
+    struct journal_record *ring = journal_ring(hdr);
+    struct journal_record **list = calloc(nrecords, sizeof(*list));
+    unsigned i, n = 0, ntorn = 0;
+    if (!list) {
+        fprintf(stderr, "gpio: Out of memory\n");
+        exit(-1);
+    }
+    for (i = 0; i < nrecords; i++) {
+        if (record_valid(&ring[i]))
+            list[n++] = &ring[i];
+        else if (ring[i].seq != 0 || ring[i].type != 0)
+            ntorn++;
+    }
+    qsort(list, n, sizeof(*list), compare_seq);
+
+    uint64_t since = 0;
+    if (hours > 0 && n > 0)
+        since = list[n-1]->time - (uint64_t) (hours * 3600e9);
+
+    unsigned value[GPIO_NPORTS];
+    int known[GPIO_NPORTS];
+    memset(known, 0, sizeof(known));
+
+    for (i = 0; i < n; i++) {
+        struct journal_record *r = list[i];
+        time_t sec = r->time / 1000000000;
+        struct tm tm;
+        char stamp[32];
+        int print = (r->time >= since);
+
+        localtime_r(&sec, &tm);
+        strftime(stamp, sizeof(stamp), "%Y-%m-%d %H:%M:%S", &tm);
+
+        switch (r->type) {
+        case JREC_START:
+            if (print)
+                printf("%s.%06u  gen %-4u recorder started\n", stamp,
+                    (unsigned) (r->time % 1000000000 / 1000), r->gen);
+            memset(known, 0, sizeof(known));
+            break;
+        case JREC_PORT:
+            if (r->index >= GPIO_NPORTS)
+                break;
+            if (print) {
+                printf("%s.%06u  gen %-4u port %c = %04x", stamp,
+                    (unsigned) (r->time % 1000000000 / 1000), r->gen,
+                    port_name[r->index], r->value);
+                if (known[r->index])
+                    printf(", changed %04x", r->value ^ value[r->index]);
+                printf("\n");
+            }
+            value[r->index] = r->value;
+            known[r->index] = 1;
+            break;
+        case JREC_MODE:
+            if (print && r->index <= 40 && r->value < MODE_LAST)
+                printf("%s.%06u  gen %-4u pin %s (j%u) mode %s\n", stamp,
+                    (unsigned) (r->time % 1000000000 / 1000), r->gen,
+                    phys_name[r->index], r->index, mode_name[r->value]);
+            break;
+        }
+    }
+    if (ntorn > 0)
+        printf("%u torn records skipped\n", ntorn);
+    free(list);
+    munmap(hdr, size);
+}
+
+//
+// gpio journal ...
+//
+void do_journal(int argc, char **argv)
+{
+    if (argc > 1 && strcmp(argv[1], "record") == 0) {
+        if (geteuid() != 0 && !getenv("GPIO_MEM")) {
+            fprintf(stderr, "gpio: Must be root to run.\n");
+            exit(-1);
+        }
+        journal_record(argc - 1, argv + 1);
+    } else {
+        journal_dump(argc, argv);
+    }
+}
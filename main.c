@@ -30,13 +30,26 @@
 #include <stdlib.h>
 #include <string.h>
 #include <strings.h>
+#include <ctype.h>
+#include <errno.h>
 #include <unistd.h>
 #include <getopt.h>
+#include <stdint.h>
+#include <signal.h>
+#include <time.h>
 #include "gpio.h"
 
 const char version[] = "0.1";
 const char copyright[] = "Copyright (C) 2019 Serge Vakulenko";
 
+//
+// ADC reference voltage (AVDD) in millivolts is board specific,
+// and can be redefined at build time.
+//
+#ifndef GPIO_VREF_MV
+#define GPIO_VREF_MV 3300
+#endif
+
 //
 // Get a pic32 pin name by physical pin index at GPIO extension connector.
 //
@@ -294,8 +307,9 @@ int phys_to_pin(int phys)
 
 //
 // Get a pin descriptor by a pic32 pin name.
+// Return -1 when name is unknown.
 //
-int pin_by_name(const char *name)
+int pin_lookup(const char *name)
 {
     if (name[0] == 'r' || name[0] == 'R') {
         // PIC32 pin names.
@@ -386,10 +400,22 @@ int pin_by_name(const char *name)
         else if (strcasecmp(name, "p25") == 0) return GPIO_PIN('H', 6);
         else if (strcasecmp(name, "p26") == 0) return GPIO_PIN('H', 7);
         else if (strcasecmp(name, "p27") == 0) return GPIO_PIN('B', 8);
-        else if (strcasecmp(name, "p1") == 0) {
-            fprintf(stderr, "gpio: Pin name P1 is not supported on PIC32.\n");
-            exit(-1);
-        }
+    }
+    return -1;
+}
+
+//
+// Get pin by name, or exit with a message.
+//
+int pin_by_name(const char *name)
+{
+    int pin = pin_lookup(name);
+
+    if (pin >= 0)
+        return pin;
+    if (strcasecmp(name, "p1") == 0) {
+        fprintf(stderr, "gpio: Pin name P1 is not supported on PIC32.\n");
+        exit(-1);
     }
     fprintf(stderr, "gpio: Wrong pin name: %s\n", name);
     fprintf(stderr, "gpio: Valid names are ra9-rk2, p0-p27, j3-j40\n");
@@ -408,9 +434,36 @@ void usage()
     fprintf(stderr, "    gpio read <pin>\n");
     fprintf(stderr, "    gpio write <pin> <value>\n");
     fprintf(stderr, "    gpio toggle <pin>\n");
-    fprintf(stderr, "    gpio blink <pin>\n");
+    fprintf(stderr, "    gpio blink <pin> [<freq> [<duty> [<count>]]]\n");
+    fprintf(stderr, "    gpio pulse <pin> <width> [<count> [<gap>]]\n");
     fprintf(stderr, "    gpio readall\n");
     fprintf(stderr, "    gpio modes\n");
+    fprintf(stderr, "    gpio owners\n");
+    fprintf(stderr, "    gpio save <file>\n");
+    fprintf(stderr, "    gpio restore <file>\n");
+    fprintf(stderr, "    gpio diff <file> [<file>]\n");
+    fprintf(stderr, "    gpio apply <profile>\n");
+    fprintf(stderr, "    gpio events [-b] [-c] [-n slots] [-i usec] <pin>...\n");
+    fprintf(stderr, "    gpio watch [-c] [<pin>...]\n");
+    fprintf(stderr, "    gpio monitor [fps]\n");
+    fprintf(stderr, "    gpio record [-c] [-i usec] [-r rate] [-t trigger]... [-p time] [-w time] <file> <pin>...\n");
+    fprintf(stderr, "    gpio pattern [-i] [-l] <port> <rate> [<file>]\n");
+    fprintf(stderr, "    gpio pwm-hw <pin> <freq> <duty>\n");
+    fprintf(stderr, "    gpio measure [-e] [-n count] <pin>\n");
+    fprintf(stderr, "    gpio count [-p prescale] [-g] [-l] [-i msec] <pin>\n");
+    fprintf(stderr, "    gpio clock <pin> <freq>|off\n");
+    fprintf(stderr, "    gpio spi [-f freq] [-m mode] [-b bits] [-o sdo] [-i sdi] [-s ss] [-n count] <port> [word]...\n");
+    fprintf(stderr, "    gpio i2c [-f freq] <port> scan | @addr [byte | rcount | @addr]...\n");
+    fprintf(stderr, "    gpio aread [-c] [-r rate] [-n count] <pin>...\n");
+    fprintf(stderr, "    gpio trace <file>\n");
+    fprintf(stderr, "    gpio replay [-t] [-q] [-n count] <trace>\n");
+    fprintf(stderr, "    gpio stats [pid]\n");
+    fprintf(stderr, "    gpio export [-s path | -p port] [-i msec]\n");
+    fprintf(stderr, "    gpio journal record [-i msec] [-c msec] [-n records] <file>\n");
+    fprintf(stderr, "    gpio journal [-l hours] <file>\n");
+    fprintf(stderr, "    gpio dump <file> [<from> [<to>]]\n");
+    fprintf(stderr, "    gpio vcd <file> [<from> [<to>]]\n");
+    fprintf(stderr, "    gpio decode [-s start] [-e end] <file> <decoder>...\n");
     fprintf(stderr, "Pins:\n");
     fprintf(stderr, "    ra9...rk2      PIC32 pin names\n");
     fprintf(stderr, "    p0...p27       Broadcom pin names\n");
@@ -451,15 +504,20 @@ void do_mode(int argc, char **argv)
     int pin = pin_by_name(argv[1]);
     const char *mode = argv[2];
 
-    if      (strcasecmp(mode, "in")     == 0) gpio_set_mode(pin, MODE_INPUT);
-    else if (strcasecmp(mode, "input")  == 0) gpio_set_mode(pin, MODE_INPUT);
-    else if (strcasecmp(mode, "out")    == 0) gpio_set_mode(pin, MODE_OUTPUT);
-    else if (strcasecmp(mode, "output") == 0) gpio_set_mode(pin, MODE_OUTPUT);
-    else if (strcasecmp(mode, "up")     == 0) gpio_set_pull(pin, PULL_UP);
-    else if (strcasecmp(mode, "down")   == 0) gpio_set_pull(pin, PULL_DOWN);
-    else if (strcasecmp(mode, "tri")    == 0) gpio_set_pull(pin, PULL_OFF);
-    else if (strcasecmp(mode, "off")    == 0) gpio_set_pull(pin, PULL_OFF);
-    else                                      gpio_set_mode(pin, find_mode(mode));
+    int status;
+
+    if      (strcasecmp(mode, "in")     == 0) status = gpio_set_mode(pin, MODE_INPUT);
+    else if (strcasecmp(mode, "input")  == 0) status = gpio_set_mode(pin, MODE_INPUT);
+    else if (strcasecmp(mode, "out")    == 0) status = gpio_set_mode(pin, MODE_OUTPUT);
+    else if (strcasecmp(mode, "output") == 0) status = gpio_set_mode(pin, MODE_OUTPUT);
+    else if (strcasecmp(mode, "up")     == 0) status = gpio_set_pull(pin, PULL_UP);
+    else if (strcasecmp(mode, "down")   == 0) status = gpio_set_pull(pin, PULL_DOWN);
+    else if (strcasecmp(mode, "tri")    == 0) status = gpio_set_pull(pin, PULL_OFF);
+    else if (strcasecmp(mode, "off")    == 0) status = gpio_set_pull(pin, PULL_OFF);
+    else                                      status = gpio_set_mode(pin, find_mode(mode));
+
+    if (status < 0)
+        exit(-1);
 }
 
 //
@@ -521,25 +579,6 @@ void do_toggle(int argc, char **argv)
     gpio_toggle(pin);
 }
 
-//
-// gpio blink <pin>
-//
-void do_blink(int argc, char **argv)
-{
-    if (argc != 2) {
-        fprintf(stderr, "Usage: gpio blink <pin>\n");
-        exit(-1);
-    }
-
-    int pin = pin_by_name(argv[1]);
-
-    gpio_set_mode(pin, MODE_OUTPUT);
-    for (;;) {
-        gpio_toggle(pin);
-        usleep(500000);
-    }
-}
-
 //
 // Print status of all pins on GPIO extension connector.
 //
@@ -627,113 +666,1785 @@ void do_modes()
     }
 }
 
-static void print_pin(int *flag, int bcm, int phys, gpio_mode_t mode)
+//
+// gpio save <file>
+//
+void do_save(int argc, char **argv)
 {
-    if (*flag == 0) {
-        *flag = 1;
-        printf(" p%-2d", bcm);
-        printf(" j%-2d ", phys);
-        printf(" %-4s", phys_name[phys]);
+    if (argc != 2) {
+        fprintf(stderr, "Usage: gpio save <file>\n");
+        exit(-1);
     }
-    printf(" %s", mode_name[mode]);
+
+    gpio_snapshot_t snap;
+    gpio_snapshot(&snap);
+    if (gpio_snapshot_save(&snap, argv[1]) < 0)
+        exit(-1);
 }
 
 //
-// For every pin, show possible modes.
+// gpio restore <file>
 //
-void do_pins()
+void do_restore(int argc, char **argv)
 {
-    printf(" Pin Phys Name Available Modes\n");
-    int bcm;
-    for (bcm = 0; bcm < 32; bcm++) {
-        int phys = bcm_to_phys(bcm);
-        if (phys < 0)
+    if (argc != 2) {
+        fprintf(stderr, "Usage: gpio restore <file>\n");
+        exit(-1);
+    }
+
+    gpio_snapshot_t snap;
+    if (gpio_snapshot_load(&snap, argv[1]) < 0)
+        exit(-1);
+
+    int nwrites = gpio_restore(&snap);
+    if (nwrites < 0)
+        exit(-1);
+    if (gpio_debug)
+        printf("%d registers updated\n", nwrites);
+}
+
+//
+// gpio diff <file> [<file>]
+// With one file, compare it against the live hardware.
+//
+void do_diff(int argc, char **argv)
+{
+    if (argc != 2 && argc != 3) {
+        fprintf(stderr, "Usage: gpio diff <file> [<file>]\n");
+        exit(-1);
+    }
+
+    gpio_snapshot_t a, b;
+    if (gpio_snapshot_load(&a, argv[1]) < 0)
+        exit(-1);
+    if (argc == 3) {
+        if (gpio_snapshot_load(&b, argv[2]) < 0)
+            exit(-1);
+    } else {
+        gpio_snapshot(&b);
+    }
+
+    if (gpio_snapshot_diff(&a, &b) > 0)
+        exit(1);
+}
+
+//
+// gpio apply <profile>
+// Compiled plan is cached in <profile>.plan file,
+// and reused while the profile is not modified.
+//
+void do_apply(int argc, char **argv)
+{
+    if (argc != 2) {
+        fprintf(stderr, "Usage: gpio apply <profile>\n");
+        exit(-1);
+    }
+
+    const char *profile = argv[1];
+    char cache[1024];
+    snprintf(cache, sizeof(cache), "%s.plan", profile);
+
+    static gpio_plan_t plan;
+    if (gpio_plan_load(&plan, cache, profile) < 0) {
+        if (profile_compile(profile, &plan) < 0)
+            exit(-1);
+
+        if (gpio_plan_save(&plan, cache, profile) < 0 && gpio_debug)
+            printf("Cannot save plan to %s\n", cache);
+    }
+    if (gpio_plan_execute(&plan) < 0)
+        exit(-1);
+}
+
+//
+// Stop gpio events on signal.
+//
+static volatile sig_atomic_t events_stop;
+
+static void events_signal(int sig)
+{
+    events_stop = 1;
+}
+
+//
+// gpio events [-b] [-c] [-n slots] [-i usec] <pin>...
+// Print changes of given pins, as text or as binary gpio_event_t records.
+//
+void do_events(int argc, char **argv)
+{
+    int binary = 0, use_cn = 0, nslots = 4096, period = 0;
+
+    optind = 1;
+    for (;;) {
+        switch (getopt(argc, argv, "+bcn:i:")) {
+        case EOF:
+            break;
+        case 'b':
+            binary = 1;
+            continue;
+        case 'c':
+            use_cn = 1;
+            continue;
+        case 'n':
+            nslots = strtol(optarg, 0, 0);
+            continue;
+        case 'i':
+            period = strtol(optarg, 0, 0);
             continue;
+        default:
+            fprintf(stderr, "Usage: gpio events [-b] [-c] [-n slots] [-i usec] <pin>...\n");
+            exit(-1);
+        }
+        break;
+    }
+    argc -= optind;
+    argv += optind;
 
-        // Print alternative mappings, available for this pin.
-        int pin = phys_to_pin(phys);
-        int print_this_pin = 0;
-        gpio_mode_t mode;
+    if (argc < 1 || nslots < 1 || period < 0) {
+        fprintf(stderr, "Usage: gpio events [-b] [-c] [-n slots] [-i usec] <pin>...\n");
+        exit(-1);
+    }
 
-        // First line: output modes.
-        for (mode=MODE_ANALOG+1; mode<MODE_C1RX; mode++) {
-            if (gpio_has_mapping(pin, mode)) {
-                print_pin(&print_this_pin, bcm, phys, mode);
-            }
+    int pins[64], npins = 0;
+    while (npins < argc && npins < 64) {
+        pins[npins] = pin_by_name(argv[npins]);
+        npins++;
+    }
+
+    if (gpio_events_start(pins, npins, nslots, period, use_cn) < 0)
+        exit(-1);
+
+    signal(SIGINT, events_signal);
+    signal(SIGTERM, events_signal);
+
+    unsigned dropped = 0;
+    while (!events_stop) {
+        gpio_event_t ev[256];
+        int i, n = gpio_events_read(ev, 256);
+
+        if (n == 0) {
+            fflush(stdout);
+            usleep(1000);
+            continue;
+        }
+        if (binary) {
+            fwrite(ev, sizeof(ev[0]), n, stdout);
+            continue;
+        }
+        for (i = 0; i < n; i++) {
+            printf("%llu.%09llu %c %04x %04x\n",
+                ev[i].timestamp / 1000000000, ev[i].timestamp % 1000000000,
+                "ABCDEFGHJK"[ev[i].port], ev[i].changed, ev[i].value);
         }
+        if (gpio_events_dropped() != dropped) {
+            dropped = gpio_events_dropped();
+            fprintf(stderr, "gpio: %u events dropped\n", dropped);
+        }
+    }
+    gpio_events_stop();
+}
 
-        if (print_this_pin) {
-            // Next line.
-            printf("\n              ");
+//
+// Stop gpio watch on signal.
+//
+static volatile sig_atomic_t watch_stop;
+
+static void watch_signal(int sig)
+{
+    watch_stop = 1;
+}
+
+//
+// gpio watch [-c] [<pin>...]
+// Print a line when any of given pins changes.
+// Without pins, watch all pins of the extension connector.
+// Poll interval grows while nothing changes, and drops back
+// to minimum on activity.
+//
+void do_watch(int argc, char **argv)
+{
+    const int MIN_INTERVAL = 1000;      // Microseconds
+    const int MAX_INTERVAL = 100000;
+    int use_cn = 0;
+
+    optind = 1;
+    for (;;) {
+        switch (getopt(argc, argv, "+c")) {
+        case EOF:
+            break;
+        case 'c':
+            use_cn = 1;
+            continue;
+        default:
+            fprintf(stderr, "Usage: gpio watch [-c] [<pin>...]\n");
+            exit(-1);
         }
+        break;
+    }
+    argc -= optind;
+    argv += optind;
 
-        // Input modes.
-        for (mode=MODE_C1RX; mode<MODE_SCK1; mode++) {
-            if (gpio_has_mapping(pin, mode)) {
-                print_pin(&print_this_pin, bcm, phys, mode);
-            }
+    // Collect pins and their names.
+    int pins[64], npins = 0;
+    char names[64][16];
+    if (argc > 0) {
+        while (npins < argc && npins < 64) {
+            pins[npins] = pin_by_name(argv[npins]);
+            snprintf(names[npins], sizeof(names[0]), "%s", argv[npins]);
+            npins++;
+        }
+    } else {
+        int phys;
+        for (phys = 1; phys <= 40; phys++) {
+            int bcm = phys_to_bcm(phys);
+            if (bcm < 0)
+                continue;
+            pins[npins] = phys_to_pin(phys);
+            snprintf(names[npins], sizeof(names[0]), "p%d", bcm);
+            npins++;
         }
+    }
 
+    // Find ports involved.
+    unsigned mask[GPIO_NPORTS], prev[GPIO_NPORTS], cn_enabled[GPIO_NPORTS];
+    int i, port;
+    memset(mask, 0, sizeof(mask));
+    memset(cn_enabled, 0, sizeof(cn_enabled));
+    for (i = 0; i < npins; i++)
+        mask[GPIO_PORTNUM(pins[i])] |= (uint16_t) pins[i];
 
-        // Dedicated SPI pins.
-        for (mode=MODE_SCK1; mode<MODE_SCL1; mode++) {
-            if (gpio_has_mapping(pin, mode)) {
-                if (print_this_pin) {
-                    // Next line.
-                    printf("\n              ");
-                }
-                print_pin(&print_this_pin, bcm, phys, mode);
-            }
+    signal(SIGINT, watch_signal);
+    signal(SIGTERM, watch_signal);
+
+    for (port = 0; port < GPIO_NPORTS; port++) {
+        if (!mask[port])
+            continue;
+        if (use_cn)
+            cn_enabled[port] = gpio_enable_cn(port, mask[port]);
+        prev[port] = *gpio_port_reg(port, GPIO_PORT) & mask[port];
+    }
+
+    struct timespec t0, t;
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+
+    int interval = MIN_INTERVAL;
+    while (!watch_stop) {
+        unsigned changed[GPIO_NPORTS];
+        int active = 0;
+
+        usleep(interval);
+
+        // Take one snapshot of every port.
+        for (port = 0; port < GPIO_NPORTS; port++) {
+            changed[port] = 0;
+            if (!mask[port])
+                continue;
+
+            // With change notification, one read tells whether the port is idle.
+            if (use_cn && !(*gpio_port_reg(port, GPIO_CNSTAT) & mask[port]))
+                continue;
+
+            unsigned value = *gpio_port_reg(port, GPIO_PORT) & mask[port];
+            changed[port] = value ^ prev[port];
+            prev[port] = value;
+            if (changed[port])
+                active = 1;
         }
 
-        // Dedicated I2C pins.
-        for (mode=MODE_SCL1; mode<MODE_LAST; mode++) {
-            if (gpio_has_mapping(pin, mode)) {
-                if (print_this_pin) {
-                    // Next line.
-                    printf("\n              ");
-                }
-                print_pin(&print_this_pin, bcm, phys, mode);
-            }
+        if (!active) {
+            interval *= 2;
+            if (interval > MAX_INTERVAL)
+                interval = MAX_INTERVAL;
+            continue;
         }
+        interval = MIN_INTERVAL;
 
-        if (print_this_pin) {
-            printf("\n");
+        clock_gettime(CLOCK_MONOTONIC, &t);
+        long msec = (t.tv_sec - t0.tv_sec) * 1000 + (t.tv_nsec - t0.tv_nsec) / 1000000;
+        printf("%ld.%03ld", msec / 1000, msec % 1000);
+        for (i = 0; i < npins; i++) {
+            port = GPIO_PORTNUM(pins[i]);
+            if (changed[port] & (uint16_t) pins[i])
+                printf(" %s=%d", names[i], (prev[port] & (uint16_t) pins[i]) != 0);
         }
+        printf("\n");
+        fflush(stdout);
+    }
+
+    for (port = 0; port < GPIO_NPORTS; port++) {
+        if (cn_enabled[port])
+            gpio_disable_cn(port, cn_enabled[port]);
     }
 }
 
-int main(int argc, char **argv)
+//
+// Stop recording on signal.
+//
+static volatile sig_atomic_t record_stop;
+
+static void record_signal(int sig)
 {
-    const char *env_debug = getenv("GPIO_DEBUG");
+    record_stop = 1;
+}
+
+//
+// Get current time in nanoseconds, same clock as event timestamps.
+//
+static unsigned long long now_nsec()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+//
+// Hardware-timed sampling for gpio record: samples of a port
+// are converted into events, with time computed from sample number.
+//
+static struct {
+    int port;
+    unsigned mask;
+    unsigned rate;
+    unsigned long long start;       // Time of first sample
+    unsigned long long count;       // Samples received or lost
+    unsigned prev;
+    int have_prev;                  // Value of previous sample is known
+} dma;
+
+static int dma_events(gpio_event_t *ev, int max)
+{
+    unsigned short sample[1024];
+    int nev = 0;
+
+    while (nev < max) {
+        unsigned lost;
+        int i, n = gpio_dmacap_read(sample, (max - nev < 1024) ? max - nev : 1024, &lost);
+
+        if (lost > 0) {
+            // Samples were overwritten: keep time of the following ones.
+            fprintf(stderr, "gpio: Overrun, %u samples lost at %.6f sec\n",
+                lost, (double) dma.count / dma.rate);
+            dma.count += lost;
+        }
+        if (n == 0)
+            break;
+
+        for (i = 0; i < n; i++) {
+            unsigned value = sample[i] & dma.mask;
+
+            if (!dma.have_prev || value != dma.prev) {
+                ev[nev].timestamp = dma.start + dma.count / dma.rate * 1000000000ULL +
+                                    dma.count % dma.rate * 1000000000ULL / dma.rate;
+                ev[nev].port = dma.port;
+                ev[nev].changed = dma.have_prev ? value ^ dma.prev : 0;
+                ev[nev].value = value;
+                dma.prev = value;
+                dma.have_prev = 1;
+                nev++;
+            }
+            dma.count++;
+        }
+    }
+    return nev;
+}
 
+//
+// gpio record [-c] [-i usec] [-r rate] [-t trigger]... [-p time] [-w time] <file> <pin>...
+// Record changes of given pins into a capture file, until interrupted.
+// With -r, pins are sampled by timer and DMA at a given rate in Hz;
+// all pins must be on the same port.
+// With triggers, recent events are kept in memory, and only
+// the window around the trigger is written: pre-trigger time
+// before it and post-trigger time after it.
+//
+void do_record(int argc, char **argv)
+{
+    int use_cn = 0, period = 0, rate = 0;
+    long long pre = 1000000000, post = 1000000000;
+    gpio_trigger_t trig;
+
+    memset(&trig, 0, sizeof(trig));
+    optind = 1;
     for (;;) {
-        switch (getopt(argc, argv, "vhd")) {
+        switch (getopt(argc, argv, "+ci:r:t:p:w:")) {
         case EOF:
             break;
-        case 'v':
-            printf("gpio version: %s\n", version);
-            return 0;
-        case 'h':
-            usage();
-            return 0;
-        case 'd':
-            ++gpio_debug;
+        case 'c':
+            use_cn = 1;
+            continue;
+        case 'i':
+            period = strtol(optarg, 0, 0);
+            continue;
+        case 'r':
+            rate = strtol(optarg, 0, 0);
+            continue;
+        case 't':
+            if (gpio_trigger_add(&trig, optarg) < 0)
+                exit(-1);
+            continue;
+        case 'p':
+            pre = gpio_parse_time(optarg);
+            continue;
+        case 'w':
+            post = gpio_parse_time(optarg);
             continue;
         default:
-            usage();
+            period = -1;
+            continue;
         }
         break;
     }
     argc -= optind;
     argv += optind;
 
-    if (argc < 1) {
-        usage();
-        return -1;
+    if (argc < 2 || period < 0 || rate < 0 || pre < 0 || post < 0) {
+        fprintf(stderr, "Usage: gpio record [-c] [-i usec] [-r rate] [-t trigger]... [-p time] [-w time] <file> <pin>...\n");
+        exit(-1);
     }
+    const char *filename = argv[0];
+    argc--;
+    argv++;
 
-    if (!gpio_debug && env_debug)
+    unsigned mask[GPIO_NPORTS], watch[GPIO_NPORTS];
+    int i, port, bit;
+    memset(mask, 0, sizeof(mask));
+    for (i = 0; i < argc; i++) {
+        int pin = pin_by_name(argv[i]);
+        mask[GPIO_PORTNUM(pin)] |= (uint16_t) pin;
+    }
+
+    // Trigger pins are watched, but not recorded.
+    memcpy(watch, mask, sizeof(watch));
+    gpio_trigger_mask(&trig, watch);
+
+    int pins[GPIO_NPORTS * 16], npins = 0;
+    for (port = 0; port < GPIO_NPORTS; port++) {
+        for (bit = 0; bit < 16; bit++) {
+            if (watch[port] & (1 << bit))
+                pins[npins++] = (port << 24) | (1 << bit);
+        }
+    }
+
+    gpio_history_t history;
+    int triggered = 0;
+    unsigned long long trigger_time = 0;
+    if (trig.nstages > 0) {
+        gpio_trigger_reset(&trig);
+        if (gpio_history_init(&history, 65536, pre) < 0)
+            exit(-1);
+    }
+
+    signal(SIGINT, record_signal);
+    signal(SIGTERM, record_signal);
+    if (rate > 0) {
+        // Timer and DMA copy one port.
+        dma.port = -1;
+        for (port = 0; port < GPIO_NPORTS; port++) {
+            if (!watch[port])
+                continue;
+            if (dma.port >= 0) {
+                fprintf(stderr, "gpio: Pins must be on the same port for sampling by DMA\n");
+                exit(-1);
+            }
+            dma.port = port;
+            dma.mask = watch[port];
+        }
+        dma.start = now_nsec();
+        dma.rate = gpio_dmacap_start(dma.port, rate);
+        if (dma.rate == 0)
+            exit(-1);
+        if (dma.rate != rate)
+            fprintf(stderr, "Sample rate %u Hz\n", dma.rate);
+    } else if (gpio_events_start(pins, npins, 65536, period, use_cn) < 0)
+        exit(-1);
+
+    gpio_capture_t *cap = 0;
+    unsigned long long count = 0;
+    while (!record_stop) {
+        gpio_event_t ev[256];
+        int n = (rate > 0) ? dma_events(ev, 256) : gpio_events_read(ev, 256);
+
+        if (n == 0) {
+            if (triggered && now_nsec() > trigger_time + post)
+                break;
+            usleep(1000);
+            continue;
+        }
+        for (i = 0; i < n && !record_stop; i++) {
+            if (trig.nstages > 0 && !triggered) {
+                // Wait for trigger, keeping recent events.
+                gpio_history_put(&history, &ev[i]);
+                if (!gpio_trigger_check(&trig, &ev[i]))
+                    continue;
+
+                triggered = 1;
+                trigger_time = ev[i].timestamp;
+                count += history.count;
+                cap = gpio_history_save(&history, filename, mask, trigger_time);
+                if (!cap)
+                    exit(-1);
+                gpio_history_free(&history);
+                fprintf(stderr, "Triggered\n");
+                continue;
+            }
+            if (triggered && ev[i].timestamp > trigger_time + post) {
+                record_stop = 1;
+                break;
+            }
+            if (!cap) {
+                // Capture starts at the initial state of pins.
+                cap = gpio_capture_create(filename, mask, ev[i].timestamp);
+                if (!cap)
+                    exit(-1);
+            }
+            gpio_capture_put(cap, ev[i].timestamp, ev[i].port, ev[i].value);
+            count++;
+        }
+    }
+    if (rate > 0)
+        gpio_dmacap_stop();
+    else
+        gpio_events_stop();
+
+    if (!cap) {
+        if (trig.nstages > 0)
+            fprintf(stderr, "gpio: Not triggered\n");
+        return;
+    }
+    if (gpio_capture_close(cap) < 0)
+        exit(-1);
+    if (rate > 0 && gpio_dmacap_overruns() > 0)
+        fprintf(stderr, "gpio: %u buffer overruns\n", gpio_dmacap_overruns());
+    if (rate == 0 && gpio_events_dropped() > 0)
+        fprintf(stderr, "gpio: %u events dropped\n", gpio_events_dropped());
+    fprintf(stderr, "%llu events recorded\n", count);
+}
+
+//
+// Stop pattern output on signal.
+//
+static volatile sig_atomic_t pattern_stop;
+
+static void pattern_signal(int sig)
+{
+    pattern_stop = 1;
+}
+
+//
+// gpio pattern [-i] [-l] <port> <rate> [<file>]
+// Output words from a file, or from stdin, into LAT register
+// of a given port, at a given rate in Hz.  Words are hex numbers
+// separated by spaces or newlines.  With -i, words are written
+// into LATINV, so that every bit set toggles a pin.
+// With -l, the words are repeated until interrupted.
+//
+void do_pattern(int argc, char **argv)
+{
+    int flags = 0;
+
+    optind = 1;
+    for (;;) {
+        switch (getopt(argc, argv, "+il")) {
+        case EOF:
+            break;
+        case 'i':
+            flags |= PATTERN_INVERT;
+            continue;
+        case 'l':
+            flags |= PATTERN_LOOP;
+            continue;
+        default:
+            argc = 0;
+            continue;
+        }
+        break;
+    }
+    argc -= optind;
+    argv += optind;
+
+    const char *ports = "ABCDEFGHJK";
+    const char *p = (argc > 0 && argv[0][0] && !argv[0][1]) ?
+                    strchr(ports, toupper(argv[0][0])) : 0;
+    if (argc < 2 || argc > 3 || !p) {
+        fprintf(stderr, "Usage: gpio pattern [-i] [-l] <port> <rate> [<file>]\n");
+        exit(-1);
+    }
+    int port = p - ports;
+    unsigned rate = strtoul(argv[1], 0, 0);
+
+    FILE *input = stdin;
+    if (argc > 2 && strcmp(argv[2], "-") != 0) {
+        input = gpio_fopen_user(argv[2], "r");
+        if (!input) {
+            fprintf(stderr, "gpio: %s: %s\n", argv[2], strerror(errno));
+            exit(-1);
+        }
+    }
+
+    if (gpio_pattern_start(port, rate, flags) == 0)
+        exit(-1);
+    signal(SIGINT, pattern_signal);
+    signal(SIGTERM, pattern_signal);
+
+    unsigned short word;
+    unsigned value;
+    int status = 0;
+    while (!pattern_stop && fscanf(input, "%x", &value) == 1) {
+        word = value;
+        status = gpio_pattern_queue(&word, 1);
+        if (status > 0)
+            continue;
+        if (status == 0 && (flags & PATTERN_LOOP)) {
+            fprintf(stderr, "gpio: Pattern is too long for loop\n");
+            gpio_pattern_stop();
+            exit(-1);
+        }
+
+        // Wait until a half of buffer is played.
+        while (!pattern_stop && status == 0) {
+            gpio_pattern_wait();
+            status = gpio_pattern_queue(&word, 1);
+        }
+        if (status < 0)
+            break;
+    }
+    if (status >= 0) {
+        gpio_pattern_flush();
+
+        // Wait for output to complete, or for interrupt in loop mode.
+        while (!pattern_stop && (status = gpio_pattern_busy()) > 0)
+            gpio_pattern_wait();
+    }
+    gpio_pattern_stop();
+    if (status < 0) {
+        fprintf(stderr, "gpio: Pattern underrun, output stopped\n");
+        exit(-1);
+    }
+}
+
+//
+// gpio pwm-hw <pin> <freq> <duty>
+// gpio pwm-hw <pin> off
+// Generate PWM by output compare module.  Duty is in percent.
+// Repeated command for the same pin changes the duty cycle
+// without glitches.
+//
+void do_pwm_hw(int argc, char **argv)
+{
+    if (argc == 3 && strcasecmp(argv[2], "off") == 0) {
+        gpio_pwm_stop(pin_by_name(argv[1]));
+        return;
+    }
+    if (argc != 4) {
+        fprintf(stderr, "Usage: gpio pwm-hw <pin> <freq> <duty>\n");
+        fprintf(stderr, "       gpio pwm-hw <pin> off\n");
+        exit(-1);
+    }
+
+    int pin = pin_by_name(argv[1]);
+    unsigned freq = strtoul(argv[2], 0, 0);
+    char *ep;
+    double duty = strtod(argv[3], &ep);
+
+    if (freq == 0 || duty < 0 || duty > 100 || (*ep != 0 && strcmp(ep, "%") != 0)) {
+        fprintf(stderr, "gpio: Bad frequency or duty cycle\n");
+        exit(-1);
+    }
+
+    unsigned actual = gpio_pwm_start(pin, freq, duty);
+    if (actual == 0)
+        exit(-1);
+    if (actual != freq)
+        printf("Frequency %u Hz\n", actual);
+}
+
+//
+// Parse frequency in Hz, with optional suffix k or M, like 12.5M.
+// Exit on error.
+//
+static unsigned parse_freq(const char *str)
+{
+    char *ep;
+    double freq = strtod(str, &ep);
+
+    if (*ep == 'k' || *ep == 'K') {
+        freq *= 1e3;
+        ep++;
+    } else if (*ep == 'M') {
+        freq *= 1e6;
+        ep++;
+    }
+    if (strcasecmp(ep, "hz") == 0)
+        ep += 2;
+    if (*ep != 0 || freq < 1 || freq > 4e9) {
+        fprintf(stderr, "gpio: Bad frequency %s\n", str);
+        exit(-1);
+    }
+    return freq + 0.5;
+}
+
+//
+// gpio clock <pin> <freq>
+// gpio clock <pin> off
+// Output a reference clock on a pin.
+//
+void do_clock(int argc, char **argv)
+{
+    if (argc == 3 && strcasecmp(argv[2], "off") == 0) {
+        gpio_refclk_stop(pin_by_name(argv[1]));
+        return;
+    }
+    if (argc != 3) {
+        fprintf(stderr, "Usage: gpio clock <pin> <freq>\n");
+        fprintf(stderr, "       gpio clock <pin> off\n");
+        exit(-1);
+    }
+
+    int pin = pin_by_name(argv[1]);
+    unsigned hz = parse_freq(argv[2]);
+    double actual = gpio_refclk_start(pin, hz);
+    if (actual == 0)
+        exit(-1);
+    if (actual != hz)
+        printf("Frequency %.3f Hz, error %.1f ppm\n", actual, (actual - hz) * 1e6 / hz);
+}
+
+//
+// gpio spi [-f freq] [-m mode] [-b bits] [-o sdo] [-i sdi] [-s ss] [-n count] <port> [word]...
+// Transfer words on hardware SPI port 1...6 as master,
+// and print received words in hex.  Without words given,
+// send a count of all-ones words, to read from the device.
+//
+void do_spi(int argc, char **argv)
+{
+    unsigned freq = 1000000, count = 0;
+    int mode = 0, bits = 8, sdo = 0, sdi = 0, ss = 0;
+
+    optind = 1;
+    for (;;) {
+        switch (getopt(argc, argv, "+f:m:b:o:i:s:n:")) {
+        case EOF:
+            break;
+        case 'f':
+            freq = parse_freq(optarg);
+            continue;
+        case 'm':
+            mode = strtol(optarg, 0, 0);
+            continue;
+        case 'b':
+            bits = strtol(optarg, 0, 0);
+            continue;
+        case 'o':
+            sdo = pin_by_name(optarg);
+            continue;
+        case 'i':
+            sdi = pin_by_name(optarg);
+            continue;
+        case 's':
+            ss = pin_by_name(optarg);
+            continue;
+        case 'n':
+            count = strtoul(optarg, 0, 0);
+            continue;
+        default:
+            argc = 0;
+            continue;
+        }
+        break;
+    }
+    argc -= optind;
+    argv += optind;
+
+    if (argc < 1 || (argc == 1 && count == 0)) {
+        fprintf(stderr, "Usage: gpio spi [-f freq] [-m mode] [-b bits] [-o sdo] [-i sdi] [-s ss] [-n count] <port> [word]...\n");
+        exit(-1);
+    }
+
+    int port = strtol(argv[0], 0, 0);
+    unsigned actual = gpio_spi_start(port, freq, mode, bits, sdo, sdi, ss);
+    if (actual == 0)
+        exit(-1);
+    if (actual != freq)
+        printf("Clock %u Hz\n", actual);
+
+    // Words are kept as 32-bit, and transferred as such
+    // when the port is 32-bit wide; otherwise packed.
+    unsigned nwords = (argc > 1) ? argc - 1 : count;
+    uint32_t *buf = calloc(nwords, sizeof(uint32_t));
+    unsigned i;
+    if (!buf) {
+        fprintf(stderr, "gpio: Out of memory\n");
+        exit(-1);
+    }
+    for (i = 0; i < nwords; i++) {
+        uint32_t word = (argc > 1) ? strtoul(argv[i+1], 0, 16) : 0xffffffff;
+
+        switch (bits) {
+        case 8:  ((uint8_t*) buf)[i] = word; break;
+        case 16: ((uint16_t*) buf)[i] = word; break;
+        default: buf[i] = word; break;
+        }
+    }
+
+    unsigned long long t0 = now_nsec();
+    int status = gpio_spi_transfer(port, buf, buf, nwords);
+    unsigned long long t1 = now_nsec();
+    gpio_spi_stop(port);
+    if (status < 0)
+        exit(-1);
+
+    for (i = 0; i < nwords; i++) {
+        switch (bits) {
+        case 8:  printf("%02x", ((uint8_t*) buf)[i]); break;
+        case 16: printf("%04x", ((uint16_t*) buf)[i]); break;
+        default: printf("%08x", buf[i]); break;
+        }
+        putchar((i % 16 == 15 || i == nwords-1) ? '\n' : ' ');
+    }
+    if (gpio_debug > 0)
+        printf("%u words in %.3f msec\n", nwords, (t1 - t0) / 1e6);
+    free(buf);
+}
+
+//
+// gpio i2c [-f freq] <port> scan
+// gpio i2c [-f freq] <port> @addr [byte | rcount | @addr]...
+// Run a transaction on hardware I2C port 1...5 as master.
+// Hex bytes are written to the slave at @addr, rN reads N bytes;
+// every change of direction or address starts a new message after
+// a restart.  Received bytes are printed in hex.
+// With scan, print addresses of all responding slaves.
+//
+void do_i2c(int argc, char **argv)
+{
+    unsigned freq = 100000;
+
+    optind = 1;
+    for (;;) {
+        switch (getopt(argc, argv, "+f:")) {
+        case EOF:
+            break;
+        case 'f':
+            freq = parse_freq(optarg);
+            continue;
+        default:
+            argc = 0;
+            continue;
+        }
+        break;
+    }
+    argc -= optind;
+    argv += optind;
+
+    if (argc < 2 || (strcmp(argv[1], "scan") != 0 && argv[1][0] != '@')) {
+        fprintf(stderr, "Usage: gpio i2c [-f freq] <port> scan\n");
+        fprintf(stderr, "       gpio i2c [-f freq] <port> @addr [byte | rcount | @addr]...\n");
+        exit(-1);
+    }
+
+    int port = strtol(argv[0], 0, 0);
+    unsigned actual = gpio_i2c_start(port, freq);
+    if (actual == 0)
+        exit(-1);
+    if (gpio_debug > 0)
+        printf("Clock %u Hz\n", actual);
+
+    if (strcmp(argv[1], "scan") == 0) {
+        int addr, found = 0;
+
+        // Reserved addresses are skipped.
+        for (addr = 0x08; addr < 0x78; addr++) {
+            int status = gpio_i2c_probe(port, addr);
+
+            if (status < 0) {
+                gpio_i2c_stop(port);
+                exit(-1);
+            }
+            if (status > 0) {
+                printf("%02x\n", addr);
+                found++;
+            }
+        }
+        gpio_i2c_stop(port);
+        if (found == 0)
+            printf("No devices\n");
+        return;
+    }
+
+    // Build the list of messages.  Data of all messages
+    // share one buffer.
+    gpio_i2c_msg_t msg[argc];
+    unsigned char data[argc * 256];
+    int nmsgs = 0, addr = -1, i;
+    unsigned nbytes = 0;
+
+    for (i = 1; i < argc; i++) {
+        char *ep, *arg = argv[i];
+        unsigned long value;
+        int read = (*arg == 'r' || *arg == 'R');
+
+        if (*arg == '@') {
+            addr = strtoul(arg + 1, &ep, 16);
+            if (*ep != 0 || addr > 0x7f) {
+                fprintf(stderr, "gpio: Bad I2C address %s\n", arg);
+                exit(-1);
+            }
+            continue;
+        }
+        value = strtoul(read ? arg + 1 : arg, &ep, read ? 0 : 16);
+        if (*ep != 0 || value > 255 || (read && value == 0)) {
+            fprintf(stderr, "gpio: Bad I2C byte or count %s\n", arg);
+            exit(-1);
+        }
+
+        // New message on change of address or direction.
+        if (nmsgs == 0 || msg[nmsgs-1].addr != addr || msg[nmsgs-1].read != read ||
+            read) {
+            msg[nmsgs].addr = addr;
+            msg[nmsgs].read = read;
+            msg[nmsgs].len = 0;
+            msg[nmsgs].buf = &data[nbytes];
+            nmsgs++;
+        }
+        if (read) {
+            msg[nmsgs-1].len = value;
+            nbytes += value;
+        } else {
+            data[nbytes++] = value;
+            msg[nmsgs-1].len++;
+        }
+    }
+    if (nmsgs == 0) {
+        // Address only: check presence.
+        msg[0].addr = addr;
+        msg[0].read = 0;
+        msg[0].len = 0;
+        msg[0].buf = data;
+        nmsgs = 1;
+    }
+
+    int status = gpio_i2c_transfer(port, msg, nmsgs);
+    gpio_i2c_stop(port);
+    if (status > 0) {
+        fprintf(stderr, "gpio: No acknowledge from I2C slave\n");
+        exit(-1);
+    }
+    if (status < 0)
+        exit(-1);
+
+    for (i = 0; i < nmsgs; i++) {
+        unsigned n;
+
+        if (!msg[i].read)
+            continue;
+        for (n = 0; n < msg[i].len; n++)
+            printf("%02x%c", msg[i].buf[n], (n == msg[i].len-1) ? '\n' : ' ');
+    }
+}
+
+//
+// Edge generation for gpio blink and gpio pulse.
+// Edges are scheduled at absolute deadlines, so errors do not
+// accumulate.  The process sleeps until shortly before a deadline,
+// and spins for the rest: the margin is calibrated by the worst
+// wakeup latency of clock_nanosleep().
+//
+static volatile sig_atomic_t strobe_stop;
+static unsigned long long strobe_margin;    // Busy-wait before edge, nsec
+static unsigned long long strobe_edges;     // Number of edges generated
+static long long strobe_min, strobe_max;    // Lateness of edges, nsec
+static double strobe_sum;
+
+static void strobe_signal(int sig)
+{
+    strobe_stop = 1;
+}
+
+//
+// Measure wakeup latency of clock_nanosleep() and set the margin
+// of busy-wait to twice the worst one.
+//
+static void strobe_calibrate()
+{
+    unsigned long long worst = 0;
+    int i;
+
+    for (i = 0; i < 20; i++) {
+        unsigned long long deadline = now_nsec() + 200000;
+        struct timespec ts = { deadline / 1000000000, deadline % 1000000000 };
+
+        clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, 0);
+
+        unsigned long long late = now_nsec() - deadline;
+        if (late > worst)
+            worst = late;
+    }
+    strobe_margin = 2 * worst;
+    if (strobe_margin < 10000)
+        strobe_margin = 10000;
+    if (strobe_margin > 2000000)
+        strobe_margin = 2000000;
+}
+
+//
+// Wait until deadline, then set the pin to the given level.
+// Lateness is measured after the store, so it includes the store itself.
+// Return 0 when interrupted by signal.
+//
+static int strobe_edge(int pin, int level, unsigned long long deadline)
+{
+    unsigned long long t = now_nsec();
+
+    if (deadline > t + strobe_margin) {
+        unsigned long long wake = deadline - strobe_margin;
+        struct timespec ts = { wake / 1000000000, wake % 1000000000 };
+
+        while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, 0) == EINTR) {
+            if (strobe_stop)
+                return 0;
+        }
+    }
+    if (strobe_stop)
+        return 0;
+    while (now_nsec() < deadline)
+        continue;
+    gpio_write(pin, level);
+    t = now_nsec();
+
+    long long late = t - deadline;
+    if (strobe_edges == 0 || late < strobe_min)
+        strobe_min = late;
+    if (strobe_edges == 0 || late > strobe_max)
+        strobe_max = late;
+    strobe_sum += late;
+    strobe_edges++;
+    return 1;
+}
+
+static void strobe_start(int pin)
+{
+    if (gpio_set_mode(pin, MODE_OUTPUT) < 0)
+        exit(-1);
+    signal(SIGINT, strobe_signal);
+    signal(SIGTERM, strobe_signal);
+    strobe_calibrate();
+}
+
+//
+// Print achieved timing of edges.
+//
+static void strobe_report()
+{
+    if (strobe_edges == 0)
+        return;
+    printf("%llu edges, late min %.3f avg %.3f max %.3f usec, jitter %.3f usec, busy-wait %.0f usec\n",
+        strobe_edges, strobe_min / 1e3, strobe_sum / strobe_edges / 1e3,
+        strobe_max / 1e3, (strobe_max - strobe_min) / 1e3, strobe_margin / 1e3);
+}
+
+//
+// gpio blink <pin> [<freq> [<duty> [<count>]]]
+// Output a square wave: 1 Hz, 50% duty by default, until interrupted.
+// Duty cycle is given in percent.
+//
+void do_blink(int argc, char **argv)
+{
+    if (argc < 2 || argc > 5) {
+        fprintf(stderr, "Usage: gpio blink <pin> [<freq> [<duty> [<count>]]]\n");
+        exit(-1);
+    }
+
+    int pin = pin_by_name(argv[1]);
+    unsigned freq = (argc > 2) ? parse_freq(argv[2]) : 1;
+    double duty = (argc > 3) ? strtod(argv[3], 0) : 50;
+    unsigned long long count = (argc > 4) ? strtoull(argv[4], 0, 0) : 0;
+
+    if (duty <= 0 || duty >= 100) {
+        fprintf(stderr, "gpio: Bad duty cycle %s\n", argv[3]);
+        exit(-1);
+    }
+
+    unsigned long long period = 1e9 / freq + 0.5;
+    unsigned long long high = period * duty / 100 + 0.5;
+    if (high == 0 || high == period) {
+        fprintf(stderr, "gpio: Frequency %u Hz too high for duty cycle %g%%\n", freq, duty);
+        exit(-1);
+    }
+
+    strobe_start(pin);
+    gpio_write(pin, 0);
+
+    unsigned long long t0 = now_nsec() + 1000000, n;
+    for (n = 0; count == 0 || n < count; n++) {
+        if (!strobe_edge(pin, 1, t0 + n*period) ||
+            !strobe_edge(pin, 0, t0 + n*period + high))
+            break;
+    }
+    gpio_write(pin, 0);
+    strobe_report();
+}
+
+//
+// gpio pulse <pin> <width> [<count> [<gap>]]
+// Output pulses of the level opposite to the current one.
+// Width and gap are times like 10us, 2ms; gap equals width by default.
+//
+void do_pulse(int argc, char **argv)
+{
+    if (argc < 3 || argc > 5) {
+        fprintf(stderr, "Usage: gpio pulse <pin> <width> [<count> [<gap>]]\n");
+        exit(-1);
+    }
+
+    int pin = pin_by_name(argv[1]);
+    long long width = gpio_parse_time(argv[2]);
+    unsigned long long count = (argc > 3) ? strtoull(argv[3], 0, 0) : 1;
+    long long gap = (argc > 4) ? gpio_parse_time(argv[4]) : width;
+
+    if (width <= 0) {
+        fprintf(stderr, "gpio: Bad pulse width %s\n", argv[2]);
+        exit(-1);
+    }
+    if (gap <= 0) {
+        fprintf(stderr, "gpio: Bad gap %s\n", argv[4]);
+        exit(-1);
+    }
+
+    strobe_start(pin);
+
+    int idle = gpio_read(pin);
+    unsigned long long t0 = now_nsec() + 1000000, n;
+    for (n = 0; count == 0 || n < count; n++) {
+        if (!strobe_edge(pin, !idle, t0 + n*(width + gap)) ||
+            !strobe_edge(pin, idle, t0 + n*(width + gap) + width))
+            break;
+    }
+    gpio_write(pin, idle);
+    strobe_report();
+}
+
+//
+// Stop measurement on signal.
+//
+static volatile sig_atomic_t measure_stop;
+
+static void measure_signal(int sig)
+{
+    measure_stop = 1;
+}
+
+//
+// gpio measure [-e] [-n count] <pin>
+// Measure pulses on a pin by input capture hardware.
+// Every second, print frequency, period and width of high pulse,
+// averaged over the second.  With -e, print every edge instead.
+// When the hardware buffer overflows, edges are lost: the pulse
+// across the gap is not counted, and the overflow is reported.
+// Stop after a given count of edges, or when interrupted.
+//
+void do_measure(int argc, char **argv)
+{
+    int print_edges = 0;
+    long count = 0;
+
+    optind = 1;
+    for (;;) {
+        switch (getopt(argc, argv, "+en:")) {
+        case EOF:
+            break;
+        case 'e':
+            print_edges = 1;
+            continue;
+        case 'n':
+            count = strtol(optarg, 0, 0);
+            continue;
+        default:
+            argc = 0;
+            continue;
+        }
+        break;
+    }
+    argc -= optind;
+    argv += optind;
+
+    if (argc != 1 || count < 0) {
+        fprintf(stderr, "Usage: gpio measure [-e] [-n count] <pin>\n");
+        exit(-1);
+    }
+
+    int pin = pin_by_name(argv[0]);
+    gpio_ic_t ic;
+    unsigned rate = gpio_ic_start(&ic, pin);
+    if (rate == 0)
+        exit(-1);
+    signal(SIGINT, measure_signal);
+    signal(SIGTERM, measure_signal);
+
+    double tick = 1e9 / rate;               // Nanoseconds
+    unsigned long long start = 0, last_rise = 0, last_edge = 0, report = 0;
+    unsigned long long sum_period = 0, sum_high = 0;
+    unsigned nperiods = 0, nhigh = 0, noverflows = 0;
+    int have_rise = 0;
+    long nedges = 0;
+
+    while (!measure_stop && (count == 0 || nedges < count)) {
+        gpio_edge_t edge[64];
+        int i, n = gpio_ic_read(&ic, edge, 64);
+
+        if (n < 0) {
+            // Edges lost: next edge starts a new pulse.
+            have_rise = 0;
+            noverflows++;
+            if (print_edges)
+                printf("overflow, edges lost\n");
+            continue;
+        }
+        if (n == 0) {
+            usleep(1000);
+            continue;
+        }
+        for (i = 0; i < n && (count == 0 || nedges < count); i++, nedges++) {
+            unsigned long long t = edge[i].ticks;
+
+            if (nedges == 0)
+                start = report = t;
+            if (print_edges) {
+                printf("%.9f %s", (t - start) * tick / 1e9, edge[i].rising ? "rise" : "fall");
+                if (nedges > 0)
+                    printf(" +%.3f usec", (t - last_edge) * tick / 1e3);
+                printf("\n");
+            }
+            if (edge[i].rising) {
+                if (have_rise) {
+                    sum_period += t - last_rise;
+                    nperiods++;
+                }
+                last_rise = t;
+                have_rise = 1;
+            } else if (have_rise) {
+                sum_high += t - last_rise;
+                nhigh++;
+            }
+            last_edge = t;
+        }
+
+        // Summary every second.
+        if (!print_edges && (last_edge - report) * tick >= 1e9 && nperiods > 0) {
+            double period = (double) sum_period / nperiods * tick;
+            double high = nhigh ? (double) sum_high / nhigh * tick : 0;
+
+            printf("%.6f Hz, period %.3f usec, high %.3f usec, duty %.2f%%",
+                1e9 / period, period / 1e3, high / 1e3, high * 100 / period);
+            if (noverflows > 0)
+                printf(", %u overflows", noverflows);
+            printf("\n");
+            fflush(stdout);
+            report = last_edge;
+            sum_period = sum_high = 0;
+            nperiods = nhigh = noverflows = 0;
+        }
+        fflush(stdout);
+    }
+    gpio_ic_stop(&ic);
+
+    if (gpio_ic_overflows(&ic) > 0)
+        fprintf(stderr, "gpio: %u buffer overflows, edges lost\n", gpio_ic_overflows(&ic));
+}
+
+//
+// gpio count [-p prescale] [-g] [-l] [-i msec] <pin>
+// Count rising edges on a pin by a timer with external clock,
+// and print the total count and rate every interval.
+// With -g, count time while the pin is high instead.
+// With -l, use a pair of timers as 32-bit counter.  It is used
+// anyway when a 16-bit counter would wrap too fast to be tracked.
+//
+void do_count(int argc, char **argv)
+{
+    int flags = 0, interval = 1000;
+    unsigned prescale = 1;
+
+    optind = 1;
+    for (;;) {
+        switch (getopt(argc, argv, "+p:gli:")) {
+        case EOF:
+            break;
+        case 'p':
+            prescale = strtoul(optarg, 0, 0);
+            continue;
+        case 'g':
+            flags |= TIMER_GATE;
+            continue;
+        case 'l':
+            flags |= TIMER_32BIT;
+            continue;
+        case 'i':
+            interval = strtol(optarg, 0, 0);
+            continue;
+        default:
+            argc = 0;
+            continue;
+        }
+        break;
+    }
+    argc -= optind;
+    argv += optind;
+
+    if (argc != 1 || interval <= 0) {
+        fprintf(stderr, "Usage: gpio count [-p prescale] [-g] [-l] [-i msec] <pin>\n");
+        exit(-1);
+    }
+
+    // A 16-bit counter must be polled at least twice per wrap.
+    // In gated mode it counts PBCLK3; edges on TxCK are synchronized
+    // to PBCLK3, so they come at most at a half of its rate.
+    // When the wrap is faster than a millisecond poll can track,
+    // use a 32-bit pair of timers, which wraps in many seconds.
+    double pbclk = gpio_pbclk(3);
+    double max_rate = (flags & TIMER_GATE) ? pbclk : pbclk / 2;
+    unsigned poll_usec = 10000;
+    if (!(flags & TIMER_32BIT)) {
+        double half_wrap = 32768.0 * prescale / max_rate * 1e6;
+        if (half_wrap < 1000)
+            flags |= TIMER_32BIT;
+        else if (half_wrap < poll_usec)
+            poll_usec = half_wrap;
+    }
+
+    int pin = pin_by_name(argv[0]);
+    int timer = gpio_counter_start(pin, prescale, flags);
+    if (timer == 0)
+        exit(-1);
+    signal(SIGINT, measure_signal);
+    signal(SIGTERM, measure_signal);
+
+    unsigned mask = (flags & TIMER_32BIT) ? 0xffffffff : 0xffff;
+    unsigned last = 0;
+    unsigned long long total = 0, reported = 0;
+    unsigned long long t0 = now_nsec(), t_report = t0;
+
+    while (!measure_stop) {
+        usleep(poll_usec);
+
+        unsigned value = gpio_counter_read(timer) & mask;
+        total += (unsigned long long) ((value - last) & mask) * prescale;
+        last = value;
+
+        unsigned long long t = now_nsec();
+        if (t - t_report < interval * 1000000ULL)
+            continue;
+
+        double seconds = (t - t_report) / 1e9;
+        if (flags & TIMER_GATE) {
+            double high = (total - reported) / pbclk;
+            printf("%.3f sec: high %.6f sec, %.2f%%\n", (t - t0) / 1e9,
+                high, high * 100 / seconds);
+        } else {
+            printf("%.3f sec: count %llu, rate %.1f Hz\n", (t - t0) / 1e9,
+                total, (total - reported) / seconds);
+        }
+        fflush(stdout);
+        reported = total;
+        t_report = t;
+    }
+    gpio_counter_stop(timer, pin);
+}
+
+//
+// gpio aread [-c] [-r rate] [-n count] <pin>...
+// Read analog inputs by one scan of the ADC, and print values
+// in volts.  With -c, scan continuously at a given rate (10 Hz
+// by default), and print a line per scan.  Stop after a given
+// count of scans, or when interrupted.
+//
+void do_aread(int argc, char **argv)
+{
+    int continuous = 0;
+    unsigned rate = 10;
+    long count = 0;
+
+    optind = 1;
+    for (;;) {
+        switch (getopt(argc, argv, "+cr:n:")) {
+        case EOF:
+            break;
+        case 'c':
+            continuous = 1;
+            continue;
+        case 'r':
+            rate = parse_freq(optarg);
+            continue;
+        case 'n':
+            count = strtol(optarg, 0, 0);
+            continue;
+        default:
+            argc = 0;
+            continue;
+        }
+        break;
+    }
+    argc -= optind;
+    argv += optind;
+
+    if (argc < 1 || argc > GPIO_ADC_MAXCHAN) {
+        fprintf(stderr, "Usage: gpio aread [-c] [-r rate] [-n count] <pin>...\n");
+        exit(-1);
+    }
+
+    int pin[argc], i;
+    unsigned short value[argc];
+
+    for (i = 0; i < argc; i++)
+        pin[i] = pin_by_name(argv[i]);
+    if (gpio_adc_open(pin, argc) < 0)
+        exit(-1);
+
+    if (!continuous) {
+        if (gpio_adc_read(value) < 0) {
+            gpio_adc_close();
+            exit(-1);
+        }
+        for (i = 0; i < argc; i++)
+            printf("%s %.3f\n", argv[i], value[i] * GPIO_VREF_MV / 4095e3);
+        gpio_adc_close();
+        return;
+    }
+
+    // Ring of one second, at least 64 frames.
+    unsigned nframes = (rate < 64) ? 64 : rate;
+    unsigned short *ring = calloc(nframes * argc, sizeof(unsigned short));
+    if (!ring) {
+        fprintf(stderr, "gpio: Out of memory\n");
+        exit(-1);
+    }
+    signal(SIGINT, measure_signal);
+    signal(SIGTERM, measure_signal);
+    if (gpio_adc_continuous(ring, nframes, rate) < 0)
+        exit(-1);
+
+    // Frame counter wraps at 32 bits: only the difference is used.
+    unsigned long long next = 0;
+    int status = 0;
+    while (!measure_stop && (count == 0 || next < count)) {
+        unsigned nf;
+        status = gpio_adc_frames(&nf);
+
+        unsigned ahead = nf - (unsigned) next;
+        if (ahead == 0) {
+            if (status < 0)
+                break;
+            usleep(1000);
+            continue;
+        }
+        if (ahead > nframes) {
+            fprintf(stderr, "gpio: Lost %u scans\n", ahead - nframes);
+            next += ahead - nframes;
+            ahead = nframes;
+        }
+        for (; ahead > 0 && (count == 0 || next < count); ahead--, next++) {
+            unsigned short *frame = ring + (next % nframes) * argc;
+
+            printf("%.3f", (double) next / rate);
+            for (i = 0; i < argc; i++)
+                printf(" %.3f", frame[i] * GPIO_VREF_MV / 4095e3);
+            printf("\n");
+        }
+        fflush(stdout);
+    }
+    gpio_adc_close();
+    free(ring);
+    if (status < 0)
+        exit(-1);
+}
+
+//
+// gpio replay [-t] [-q] [-n count] <trace>
+// Re-execute register accesses of a trace, and report reads which
+// return other values than recorded.  With -t, keep the original
+// timing, else run as fast as possible.  With -n, repeat the trace
+// a given number of times.  With -q, print only the summary.
+//
+void do_replay(int argc, char **argv)
+{
+    int timed = 0, quiet = 0;
+    long count = 1;
+
+    optind = 1;
+    for (;;) {
+        switch (getopt(argc, argv, "+tqn:")) {
+        case EOF:
+            break;
+        case 't':
+            timed = 1;
+            continue;
+        case 'q':
+            quiet = 1;
+            continue;
+        case 'n':
+            count = strtol(optarg, 0, 0);
+            continue;
+        default:
+            argc = 0;
+            continue;
+        }
+        break;
+    }
+    argc -= optind;
+    argv += optind;
+
+    if (argc != 1 || count < 1) {
+        fprintf(stderr, "Usage: gpio replay [-t] [-q] [-n count] <trace>\n");
+        exit(-1);
+    }
+
+    gpio_replay_stat_t total;
+    if (gpio_trace_replay(argv[0], timed, count, quiet ? 0 : stdout, &total) < 0)
+        exit(-1);
+
+    printf("%llu accesses: %llu reads, %llu writes, %llu divergences\n",
+        total.accesses, total.reads, total.writes, total.divergences);
+    printf("Replayed in %.3f msec, recorded %.3f msec", total.elapsed / 1e6,
+        total.recorded / 1e6);
+    if (total.accesses > 0)
+        printf(", %.1f nsec per access", (double) total.elapsed / total.accesses);
+    printf("\n");
+    if (total.divergences > 0)
+        exit(1);
+}
+
+//
+// Open a capture and find the time range, given
+// as optional seconds from capture start.
+//
+static gpio_capture_t *open_capture(int argc, char **argv,
+    unsigned long long *from, unsigned long long *to)
+{
+    gpio_capture_t *cap = gpio_capture_open(argv[1]);
+    if (!cap)
+        exit(-1);
+
+    unsigned long long start = gpio_capture_start(cap);
+    *from = start;
+    *to = gpio_capture_end(cap);
+    if (argc > 2)
+        *from = start + (unsigned long long) (strtod(argv[2], 0) * 1e9);
+    if (argc > 3)
+        *to = start + (unsigned long long) (strtod(argv[3], 0) * 1e9);
+    return cap;
+}
+
+//
+// gpio dump <file> [<from> [<to>]]
+// Print recorded changes, with time in seconds from capture start.
+//
+void do_dump(int argc, char **argv)
+{
+    if (argc < 2 || argc > 4) {
+        fprintf(stderr, "Usage: gpio dump <file> [<from> [<to>]]\n");
+        exit(-1);
+    }
+
+    unsigned long long from, to, t;
+    gpio_capture_t *cap = open_capture(argc, argv, &from, &to);
+    unsigned long long start = gpio_capture_start(cap);
+    unsigned state[GPIO_NPORTS];
+    gpio_event_t ev;
+    int port;
+
+    if (gpio_capture_trigger(cap)) {
+        t = gpio_capture_trigger(cap) - start;
+        printf("# trigger %llu.%09llu\n", t / 1000000000, t % 1000000000);
+    }
+    gpio_capture_seek(cap, from, state);
+    for (port = 0; port < GPIO_NPORTS; port++) {
+        if (gpio_capture_mask(cap, port))
+            printf("# %c mask %04x value %04x\n", "ABCDEFGHJK"[port],
+                gpio_capture_mask(cap, port), state[port]);
+    }
+    while (gpio_capture_next(cap, &ev) && ev.timestamp <= to) {
+        t = ev.timestamp - start;
+        printf("%llu.%09llu %c %04x %04x\n", t / 1000000000, t % 1000000000,
+            "ABCDEFGHJK"[ev.port], ev.changed, ev.value);
+    }
+    gpio_capture_close(cap);
+}
+
+//
+// gpio vcd <file> [<from> [<to>]]
+// Convert recorded changes to Value Change Dump format.
+//
+void do_vcd(int argc, char **argv)
+{
+    if (argc < 2 || argc > 4) {
+        fprintf(stderr, "Usage: gpio vcd <file> [<from> [<to>]]\n");
+        exit(-1);
+    }
+
+    unsigned long long from, to;
+    gpio_capture_t *cap = open_capture(argc, argv, &from, &to);
+    unsigned state[GPIO_NPORTS];
+    int port, bit;
+
+    // Every signal gets a short identifier of printable characters.
+    char ident[GPIO_NPORTS][16][3];
+    int nsignals = 0;
+    printf("$timescale 1ns $end\n");
+    printf("$scope module pic32 $end\n");
+    for (port = 0; port < GPIO_NPORTS; port++) {
+        for (bit = 0; bit < 16; bit++) {
+            if (!(gpio_capture_mask(cap, port) & (1 << bit)))
+                continue;
+            char *id = ident[port][bit];
+            if (nsignals < 94) {
+                id[0] = '!' + nsignals;
+                id[1] = 0;
+            } else {
+                id[0] = '!' + nsignals / 94 - 1;
+                id[1] = '!' + nsignals % 94;
+                id[2] = 0;
+            }
+            nsignals++;
+            printf("$var wire 1 %s R%c%d $end\n", id,
+                "ABCDEFGHJK"[port], bit);
+        }
+    }
+    printf("$upscope $end\n");
+    printf("$enddefinitions $end\n");
+
+    gpio_capture_seek(cap, from, state);
+    printf("#0\n$dumpvars\n");
+    for (port = 0; port < GPIO_NPORTS; port++) {
+        for (bit = 0; bit < 16; bit++) {
+            if (gpio_capture_mask(cap, port) & (1 << bit))
+                printf("%d%s\n", (state[port] >> bit) & 1, ident[port][bit]);
+        }
+    }
+    printf("$end\n");
+
+    gpio_event_t ev;
+    while (gpio_capture_next(cap, &ev) && ev.timestamp <= to) {
+        printf("#%llu\n", ev.timestamp - from);
+        for (bit = 0; bit < 16; bit++) {
+            if (ev.changed & (1 << bit))
+                printf("%d%s\n", (ev.value >> bit) & 1, ident[ev.port][bit]);
+        }
+    }
+    gpio_capture_close(cap);
+}
+
+static void print_pin(int *flag, int bcm, int phys, gpio_mode_t mode)
+{
+    if (*flag == 0) {
+        *flag = 1;
+        printf(" p%-2d", bcm);
+        printf(" j%-2d ", phys);
+        printf(" %-4s", phys_name[phys]);
+    }
+    printf(" %s", mode_name[mode]);
+}
+
+//
+// For every pin, show possible modes.
+//
+void do_pins()
+{
+    printf(" Pin Phys Name Available Modes\n");
+    int bcm;
+    for (bcm = 0; bcm < 32; bcm++) {
+        int phys = bcm_to_phys(bcm);
+        if (phys < 0)
+            continue;
+
+        // Print alternative mappings, available for this pin.
+        int pin = phys_to_pin(phys);
+        int print_this_pin = 0;
+        gpio_mode_t mode;
+
+        // First line: output modes.
+        for (mode=MODE_ANALOG+1; mode<MODE_C1RX; mode++) {
+            if (gpio_has_mapping(pin, mode)) {
+                print_pin(&print_this_pin, bcm, phys, mode);
+            }
+        }
+
+        if (print_this_pin) {
+            // Next line.
+            printf("\n              ");
+        }
+
+        // Input modes.
+        for (mode=MODE_C1RX; mode<MODE_SCK1; mode++) {
+            if (gpio_has_mapping(pin, mode)) {
+                print_pin(&print_this_pin, bcm, phys, mode);
+            }
+        }
+
+
+        // Dedicated SPI pins.
+        for (mode=MODE_SCK1; mode<MODE_SCL1; mode++) {
+            if (gpio_has_mapping(pin, mode)) {
+                if (print_this_pin) {
+                    // Next line.
+                    printf("\n              ");
+                }
+                print_pin(&print_this_pin, bcm, phys, mode);
+            }
+        }
+
+        // Dedicated I2C pins.
+        for (mode=MODE_SCL1; mode<MODE_LAST; mode++) {
+            if (gpio_has_mapping(pin, mode)) {
+                if (print_this_pin) {
+                    // Next line.
+                    printf("\n              ");
+                }
+                print_pin(&print_this_pin, bcm, phys, mode);
+            }
+        }
+
+        if (print_this_pin) {
+            printf("\n");
+        }
+    }
+}
+
+extern void do_monitor(int argc, char **argv);
+extern void do_decode(int argc, char **argv);
+extern void do_export(int argc, char **argv);
+extern void do_journal(int argc, char **argv);
+
+int main(int argc, char **argv)
+{
+    const char *env_debug = getenv("GPIO_DEBUG");
+
+    for (;;) {
+        switch (getopt(argc, argv, "+vhd")) {
+        case EOF:
+            break;
+        case 'v':
+            printf("gpio version: %s\n", version);
+            return 0;
+        case 'h':
+            usage();
+            return 0;
+        case 'd':
+            ++gpio_debug;
+            continue;
+        default:
+            usage();
+        }
+        break;
+    }
+    argc -= optind;
+    argv += optind;
+
+    if (argc < 1) {
+        usage();
+        return -1;
+    }
+
+    if (!gpio_debug && env_debug)
         gpio_debug = atoi(env_debug);
 
     if (strcasecmp(argv[0], "pins") == 0) {
@@ -744,8 +2455,42 @@ int main(int argc, char **argv)
         do_modes();
         return 0;
     }
+    if (strcasecmp(argv[0], "owners") == 0) {
+        gpio_print_owners();
+        return 0;
+    }
+    if (strcasecmp(argv[0], "dump") == 0) {
+        do_dump(argc, argv);
+        return 0;
+    }
+    if (strcasecmp(argv[0], "vcd") == 0) {
+        do_vcd(argc, argv);
+        return 0;
+    }
+    if (strcasecmp(argv[0], "decode") == 0) {
+        do_decode(argc, argv);
+        return 0;
+    }
+    if (strcasecmp(argv[0], "journal") == 0) {
+        do_journal(argc, argv);
+        return 0;
+    }
+    if (strcasecmp(argv[0], "stats") == 0) {
+        int pid = (argc > 1) ? atoi(argv[1]) : 0;
+
+        if (gpio_stats_print_all(stdout, pid) == 0)
+            printf("No processes with statistics\n");
+        return 0;
+    }
+    if (strcasecmp(argv[0], "trace") == 0) {
+        if (argc != 2) {
+            fprintf(stderr, "Usage: gpio trace <file>\n");
+            return -1;
+        }
+        return gpio_trace_decode(argv[1], stdout);
+    }
 
-    if (geteuid() != 0) {
+    if (geteuid() != 0 && !getenv("GPIO_MEM")) {
         fprintf(stderr, "gpio: Must be root to run.\n");
         return -1;
     }
@@ -755,7 +2500,26 @@ int main(int argc, char **argv)
     else if (strcasecmp(argv[0], "write")   == 0) do_write(argc, argv);
     else if (strcasecmp(argv[0], "toggle")  == 0) do_toggle(argc, argv);
     else if (strcasecmp(argv[0], "blink")   == 0) do_blink(argc, argv);
+    else if (strcasecmp(argv[0], "pulse")   == 0) do_pulse(argc, argv);
     else if (strcasecmp(argv[0], "readall") == 0) do_readall();
+    else if (strcasecmp(argv[0], "save")    == 0) do_save(argc, argv);
+    else if (strcasecmp(argv[0], "restore") == 0) do_restore(argc, argv);
+    else if (strcasecmp(argv[0], "diff")    == 0) do_diff(argc, argv);
+    else if (strcasecmp(argv[0], "apply")   == 0) do_apply(argc, argv);
+    else if (strcasecmp(argv[0], "events")  == 0) do_events(argc, argv);
+    else if (strcasecmp(argv[0], "watch")   == 0) do_watch(argc, argv);
+    else if (strcasecmp(argv[0], "monitor") == 0) do_monitor(argc, argv);
+    else if (strcasecmp(argv[0], "record")  == 0) do_record(argc, argv);
+    else if (strcasecmp(argv[0], "pattern") == 0) do_pattern(argc, argv);
+    else if (strcasecmp(argv[0], "pwm-hw")  == 0) do_pwm_hw(argc, argv);
+    else if (strcasecmp(argv[0], "measure") == 0) do_measure(argc, argv);
+    else if (strcasecmp(argv[0], "count")   == 0) do_count(argc, argv);
+    else if (strcasecmp(argv[0], "clock")   == 0) do_clock(argc, argv);
+    else if (strcasecmp(argv[0], "spi")     == 0) do_spi(argc, argv);
+    else if (strcasecmp(argv[0], "i2c")     == 0) do_i2c(argc, argv);
+    else if (strcasecmp(argv[0], "aread")   == 0) do_aread(argc, argv);
+    else if (strcasecmp(argv[0], "replay")  == 0) do_replay(argc, argv);
+    else if (strcasecmp(argv[0], "export")  == 0) do_export(argc, argv);
     else {
         fprintf(stderr, "gpio: Unknown command: %s.\n", argv[0]);
         return -1;
@@ -0,0 +1,170 @@
+/*
+ * Live monitor of pins on the extension connector.
+ *
+ * Copyright (C) 2019 Serge Vakulenko
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   1. Redistributions of source code must retain the above copyright notice,
+ *      this list of conditions and the following disclaimer.
+ *   2. Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer in the
+ *      documentation and/or other materials provided with the distribution.
+ *   3. The name of the author may not be used to endorse or promote products
+ *      derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR IMPLIED
+ * WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO
+ * EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+ * OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ * OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ * ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <signal.h>
+#include "gpio.h"
+
+extern const char *phys_name[];
+extern const char *mode_name[];
+extern int phys_to_bcm(int phys);
+extern int phys_to_pin(int phys);
+
+//
+// Screen columns of variable cells, same layout as 'gpio readall'.
+//
+#define COL_LEFT_MODE   17
+#define COL_LEFT_VALUE  26
+#define COL_RIGHT_VALUE 43
+#define COL_RIGHT_MODE  47
+#define ROW_FIRST       4
+
+static volatile sig_atomic_t monitor_stop;
+
+static void monitor_interrupt(int sig)
+{
+    monitor_stop = 1;
+}
+
+//
+// Draw static part of the table, with empty cells.
+//
+static void draw_frame()
+{
+    int phys;
+
+    printf("\33[H\33[2J");
+    printf(" +-----+------+--------+---+------------+---+--------+------+-----+\n");
+    printf(" | BCM | Name | Mode   | V |  Physical  | V | Mode   | Name | BCM |\n");
+    printf(" +-----+------+--------+---+-----++-----+---+--------+------+-----+\n");
+
+    for (phys = 1; phys <= 40; phys += 2) {
+        int bcm = phys_to_bcm(phys);
+        if (bcm < 0)
+            printf(" |     | %-4s |        |  ", phys_name[phys]);
+        else
+            printf(" | p%-2d | %-4s |        |  ", bcm, phys_name[phys]);
+
+        printf(" | j%-2d || j%-2d", phys, phys+1);
+
+        bcm = phys_to_bcm(phys+1);
+        if (bcm < 0)
+            printf(" |   |        | %-4s |    ", phys_name[phys+1]);
+        else
+            printf(" |   |        | %-4s | p%-2d", phys_name[phys+1], bcm);
+        printf(" |\n");
+    }
+    printf(" +-----+------+--------+---+-----++-----+---+--------+------+-----+\n");
+    printf(" | BCM | Name | Mode   | V |  Physical  | V | Mode   | Name | BCM |\n");
+    printf(" +-----+------+--------+---+------------+---+--------+------+-----+\n");
+}
+
+//
+// Update a cell on screen, when its contents changed.
+//
+static void update_cell(char *shown, int row, int col, const char *text)
+{
+    if (strcmp(shown, text) == 0)
+        return;
+
+    printf("\33[%d;%dH%s", row, col, text);
+    strcpy(shown, text);
+}
+
+//
+// gpio monitor [fps]
+// Show status of all pins, like 'gpio readall', refreshed in place.
+// Only changed cells are redrawn.
+//
+void do_monitor(int argc, char **argv)
+{
+    if (argc > 2) {
+        fprintf(stderr, "Usage: gpio monitor [fps]\n");
+        exit(-1);
+    }
+    int fps = (argc > 1) ? strtol(argv[1], 0, 0) : 20;
+    if (fps < 1)
+        fps = 1;
+
+    static gpio_snapshot_t snap, config;
+    gpio_mode_t mode[1+40];
+    char shown_mode[1+40][8], shown_value[1+40][2];
+    int phys, have_config = 0;
+
+    memset(shown_mode, 0, sizeof(shown_mode));
+    memset(shown_value, 0, sizeof(shown_value));
+
+    signal(SIGINT, monitor_interrupt);
+    signal(SIGTERM, monitor_interrupt);
+
+    draw_frame();
+    printf("\33[?25l");             // Hide cursor
+
+    while (!monitor_stop) {
+        // All register reads of this frame.
+        gpio_snapshot(&snap);
+
+        // Decode modes only when configuration changed.
+        if (!have_config || gpio_snapshot_config_changed(&snap, &config)) {
+            for (phys = 1; phys <= 40; phys++) {
+                if (phys_to_bcm(phys) >= 0)
+                    mode[phys] = gpio_get_mode(phys_to_pin(phys));
+            }
+            config = snap;
+            have_config = 1;
+        }
+
+        for (phys = 1; phys <= 40; phys++) {
+            if (phys_to_bcm(phys) < 0)
+                continue;
+
+            int pin = phys_to_pin(phys);
+            int row = ROW_FIRST + (phys - 1) / 2;
+            int left = phys & 1;
+            char text[8];
+
+            snprintf(text, sizeof(text), "%-6s", mode_name[mode[phys]]);
+            update_cell(shown_mode[phys], row, left ? COL_LEFT_MODE : COL_RIGHT_MODE, text);
+
+            if (mode[phys] == MODE_ANALOG)
+                strcpy(text, "-");
+            else
+                strcpy(text, (snap.port[GPIO_PORTNUM(pin)][GPIO_PORT] & (uint16_t) pin) ? "1" : "0");
+            update_cell(shown_value[phys], row, left ? COL_LEFT_VALUE : COL_RIGHT_VALUE, text);
+        }
+        fflush(stdout);
+        usleep(1000000 / fps);
+    }
+
+    // Restore cursor below the table.
+    printf("\33[%d;1H\33[?25h", ROW_FIRST + 20 + 3);
+    fflush(stdout);
+}
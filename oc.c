@@ -0,0 +1,220 @@
+/*
+ * Output compare modules of PIC32MZ: hardware PWM.
+ *
+ * Copyright (C) 2019 Serge Vakulenko
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   1. Redistributions of source code must retain the above copyright notice,
+ *      this list of conditions and the following disclaimer.
+ *   2. Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer in the
+ *      documentation and/or other materials provided with the distribution.
+ *   3. The name of the author may not be used to endorse or promote products
+ *      derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR IMPLIED
+ * WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO
+ * EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+ * OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ * OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ * ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#include <stdio.h>
+#include "gpio.h"
+
+//
+// Output compare registers.
+//
+#define OC1CON      0x1f844000      // Next modules follow with step 0x200
+#define OCCON_ON    0x8000
+#define OCCON_OCTSEL 0x0008         // Timer 3 instead of timer 2
+#define OCCON_PWM   0x0006          // PWM mode, fault pin disabled
+#define OCR         (0x10/4)        // Primary compare: active now
+#define OCRS        (0x20/4)        // Secondary compare: next period
+
+#define PR_OFFSET   0x20
+
+//
+// Get registers of module OCn, n = 1...9.
+//
+static volatile unsigned *oc_reg(int n)
+{
+    return gpio_sfr(OC1CON + (n - 1) * 0x200);
+}
+
+//
+// Count enabled modules which run from the timer,
+// except a given one.
+//
+static int timer_users(int timer, int except)
+{
+    int n, count = 0;
+
+    for (n = 1; n <= 9; n++) {
+        unsigned con = *oc_reg(n);
+
+        if (n != except && (con & OCCON_ON) &&
+            ((con & OCCON_OCTSEL) ? 3 : 2) == timer)
+            count++;
+    }
+    return count;
+}
+
+//
+// Choose a timer for PWM with a given frequency: share a timer
+// which other OC modules run from at the same rate, or take
+// a stopped one.  A running timer without OC users belongs to
+// somebody else, like a counter, and is never touched.
+// Without alternate clock selection, OC modules can use
+// timers 2 and 3 only.
+// Return the timer number, or 0 when both are busy.
+//
+static int choose_timer(int n, unsigned freq, unsigned *actual)
+{
+    int timer;
+
+    for (timer = 2; timer <= 3; timer++) {
+        unsigned f = gpio_timer_freq(timer);
+
+        if (f != 0 && timer_users(timer, n) > 0 &&
+            (f > freq ? f - freq : freq - f) <= freq / 1000) {
+            *actual = f;
+            return timer;
+        }
+    }
+    for (timer = 2; timer <= 3; timer++) {
+        if (!gpio_timer_busy(timer)) {
+            *actual = gpio_timer_start(timer, freq);
+            return *actual ? timer : 0;
+        }
+    }
+    return 0;
+}
+
+//
+// Get the OC module which drives the pin, or 0.
+//
+static int pin_module(int pin)
+{
+    gpio_mode_t mode = gpio_get_mode(pin);
+
+    if (mode < MODE_OC1 || mode > MODE_OC9)
+        return 0;
+    return mode - MODE_OC1 + 1;
+}
+
+//
+// Start PWM on a pin with given frequency in Hz and duty cycle
+// in percent.  When the pin already has PWM, only the duty is
+// changed; this takes effect at the next period, without glitches.
+// Otherwise a free OCx, which the pin can be mapped to, is used.
+// Return actual frequency, or 0 on error.
+//
+unsigned gpio_pwm_start(int pin, unsigned freq, double duty)
+{
+    unsigned actual = 0;
+    int n = pin_module(pin);
+    int claimed = 0;
+
+    if (n == 0) {
+        // Find a free module.
+        for (n = 1; n <= 9; n++) {
+            if (!gpio_has_mapping(pin, MODE_OC1 + n - 1) ||
+                (*oc_reg(n) & OCCON_ON))
+                continue;
+            if (gpio_claim_function(MODE_OC1 + n - 1, "pwm") == 0)
+                break;
+        }
+        if (n > 9) {
+            fprintf(stderr, "gpio: No free output compare module for this pin\n");
+            return 0;
+        }
+        claimed = 1;
+    } else if (gpio_check_owner(pin, MODE_OC1 + n - 1) < 0) {
+        // Module of another process: do not touch its registers.
+        return 0;
+    }
+
+    volatile unsigned *oc = oc_reg(n);
+    int timer = (*oc & OCCON_ON) ? ((*oc & OCCON_OCTSEL) ? 3 : 2) : 0;
+
+    if (timer != 0) {
+        actual = gpio_timer_freq(timer);
+        if ((actual > freq ? actual - freq : freq - actual) > freq / 1000) {
+            // New frequency: restart the timer, when not shared.
+            if (timer_users(timer, n) > 0) {
+                fprintf(stderr, "gpio: Timer %d is shared, cannot change frequency\n", timer);
+                return 0;
+            }
+            actual = gpio_timer_start(timer, freq);
+        }
+    } else {
+        timer = choose_timer(n, freq, &actual);
+        if (timer == 0) {
+            fprintf(stderr, "gpio: Timers 2 and 3 are busy with other frequencies\n");
+            goto fail;
+        }
+    }
+    if (actual == 0)
+        goto fail;
+
+    // Compare value, in timer ticks.
+    unsigned period = *gpio_sfr(gpio_timer_addr(timer) + PR_OFFSET) + 1;
+    unsigned width = duty * period / 100 + 0.5;
+    if (width > period)
+        width = period;
+
+    if (*oc & OCCON_ON) {
+        // Latched at the end of current period.
+        oc[OCRS] = width;
+        return actual;
+    }
+
+    oc[0] = 0;
+    oc[OCR] = width;
+    oc[OCRS] = width;
+    oc[0] = OCCON_PWM | ((timer == 3) ? OCCON_OCTSEL : 0) | OCCON_ON;
+
+    if (gpio_set_mode(pin, MODE_OC1 + n - 1) < 0) {
+        oc[0] = 0;
+        goto fail;
+    }
+    return actual;
+
+fail:
+    // Undo what was done for a new module.
+    if (claimed) {
+        gpio_release_function(MODE_OC1 + n - 1);
+        if (timer != 0 && actual != 0 && timer_users(timer, n) == 0)
+            gpio_timer_stop(timer);
+    }
+    return 0;
+}
+
+//
+// Stop PWM on a pin, and make it input.
+// The timer is stopped when no other module needs it.
+// Nothing is done when the pin or the module is owned by another process.
+//
+void gpio_pwm_stop(int pin)
+{
+    int n = pin_module(pin);
+
+    if (n == 0 || gpio_check_owner(pin, MODE_OC1 + n - 1) < 0)
+        return;
+
+    volatile unsigned *oc = oc_reg(n);
+    int timer = (*oc & OCCON_OCTSEL) ? 3 : 2;
+
+    oc[0] = 0;
+    gpio_set_mode(pin, MODE_INPUT);
+    gpio_release_function(MODE_OC1 + n - 1);
+    if (timer_users(timer, n) == 0)
+        gpio_timer_stop(timer);
+}
@@ -0,0 +1,332 @@
+/*
+ * Registry of pin ownership, shared between processes.
+ *
+ * Copyright (C) 2019 Serge Vakulenko
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   1. Redistributions of source code must retain the above copyright notice,
+ *      this list of conditions and the following disclaimer.
+ *   2. Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer in the
+ *      documentation and/or other materials provided with the distribution.
+ *   3. The name of the author may not be used to endorse or promote products
+ *      derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR IMPLIED
+ * WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO
+ * EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+ * OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ * OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ * ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <signal.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/mman.h>
+#include "gpio.h"
+
+//
+// Owner table lives in a shared memory segment.
+// Every port bit, every alternative function and every module
+// without a pin function has a slot, claimed by atomic
+// compare-and-swap of the process ID.
+// Zero PID means the slot is free.
+//
+#define OWNER_SHM       "/gpio-pic32-owners.2"
+#define OWNER_NPINS     (GPIO_NPORTS * 16)
+
+struct owner_slot {
+    atomic_int pid;                 // Owner process, or 0
+    char tag[12];                   // Name given by owner
+};
+
+struct owner_table {
+    struct owner_slot pin[OWNER_NPINS];
+    struct owner_slot function[MODE_LAST];
+    struct owner_slot module[MODULE_LAST];
+};
+
+static const char *module_name[MODULE_LAST] = {
+    "ADC",
+};
+
+static struct owner_table *owner;   // Mapped here, or 0 when unavailable
+static pthread_once_t owner_once = PTHREAD_ONCE_INIT;
+
+extern const char *mode_name[];
+
+//
+// Map the owner table, creating it when needed.
+// When shared memory is unavailable, ownership is not checked.
+//
+static void owner_init()
+{
+    int fd = shm_open(OWNER_SHM, O_RDWR | O_CREAT, 0600);
+    if (fd < 0) {
+        if (gpio_debug)
+            printf("--- %s: %s: %s\n", __func__, OWNER_SHM, strerror(errno));
+        return;
+    }
+
+    // Extending the segment fills it with zeros.
+    // Other processes could do it concurrently, that's harmless.
+    if (ftruncate(fd, sizeof(struct owner_table)) < 0) {
+        close(fd);
+        return;
+    }
+
+    void *p = mmap(0, sizeof(struct owner_table), PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (p != MAP_FAILED)
+        owner = p;
+}
+
+//
+// Get slot index for a pin descriptor.
+//
+static int pin_index(int pin)
+{
+    return GPIO_PORTNUM(pin) * 16 + __builtin_ctz((uint16_t) pin | 0x10000);
+}
+
+//
+// Try to take a slot for this process.
+// Slots of processes which are gone are reclaimed.
+// Return 0 on success, or PID of the live owner.
+//
+static int slot_claim(struct owner_slot *slot, const char *tag)
+{
+    int self = getpid();
+
+    for (;;) {
+        int pid = atomic_load(&slot->pid);
+
+        if (pid == self)
+            break;
+
+        if (pid != 0 && (kill(pid, 0) == 0 || errno != ESRCH)) {
+            // Owner is alive.
+            return pid;
+        }
+        if (atomic_compare_exchange_weak(&slot->pid, &pid, self))
+            break;
+    }
+    if (tag)
+        strncpy(slot->tag, tag, sizeof(slot->tag));
+    return 0;
+}
+
+//
+// Check the slot is free or belongs to this process.
+// Return 0 when it is, or PID of the live owner.
+//
+static int slot_check(struct owner_slot *slot)
+{
+    int pid = atomic_load(&slot->pid);
+
+    if (pid == 0 || pid == getpid())
+        return 0;
+    if (kill(pid, 0) < 0 && errno == ESRCH)
+        return 0;
+    return pid;
+}
+
+//
+// Release the slot, when it belongs to this process.
+//
+static void slot_release(struct owner_slot *slot)
+{
+    int self = getpid();
+
+    atomic_compare_exchange_strong(&slot->pid, &self, 0);
+}
+
+//
+// Claim a pin for this process.
+// Return 0 on success, -1 when owned by another live process.
+//
+int gpio_claim(int pin, const char *tag)
+{
+    pthread_once(&owner_once, owner_init);
+    if (!owner)
+        return 0;
+
+    int pid = slot_claim(&owner->pin[pin_index(pin)], tag);
+    if (pid) {
+        fprintf(stderr, "gpio: Pin is owned by process %d (%.12s)\n",
+            pid, owner->pin[pin_index(pin)].tag);
+        return -1;
+    }
+    return 0;
+}
+
+//
+// Claim an alternative function for this process.
+// Return 0 on success, -1 when owned by another live process.
+//
+int gpio_claim_function(gpio_mode_t mode, const char *tag)
+{
+    pthread_once(&owner_once, owner_init);
+    if (!owner || mode >= MODE_LAST)
+        return 0;
+
+    int pid = slot_claim(&owner->function[mode], tag);
+    if (pid) {
+        fprintf(stderr, "gpio: Function %s is owned by process %d (%.12s)\n",
+            mode_name[mode], pid, owner->function[mode].tag);
+        return -1;
+    }
+    return 0;
+}
+
+//
+// Claim a whole peripheral module for this process.
+// Return 0 on success, -1 when owned by another live process.
+//
+int gpio_claim_module(gpio_module_t module, const char *tag)
+{
+    pthread_once(&owner_once, owner_init);
+    if (!owner || module >= MODULE_LAST)
+        return 0;
+
+    int pid = slot_claim(&owner->module[module], tag);
+    if (pid) {
+        fprintf(stderr, "gpio: Module %s is owned by process %d (%.12s)\n",
+            module_name[module], pid, owner->module[module].tag);
+        return -1;
+    }
+    return 0;
+}
+
+//
+// Release a pin, a function or a module, owned by this process.
+//
+void gpio_release(int pin)
+{
+    pthread_once(&owner_once, owner_init);
+    if (owner)
+        slot_release(&owner->pin[pin_index(pin)]);
+}
+
+void gpio_release_function(gpio_mode_t mode)
+{
+    pthread_once(&owner_once, owner_init);
+    if (owner && mode < MODE_LAST)
+        slot_release(&owner->function[mode]);
+}
+
+void gpio_release_module(gpio_module_t module)
+{
+    pthread_once(&owner_once, owner_init);
+    if (owner && module < MODULE_LAST)
+        slot_release(&owner->module[module]);
+}
+
+//
+// Check whether this process may change a given pin,
+// and (unless zero) a given function.
+// Return 0 when allowed, -1 when owned by somebody else.
+//
+int gpio_check_owner(int pin, gpio_mode_t mode)
+{
+    int pid;
+
+    pthread_once(&owner_once, owner_init);
+    if (!owner)
+        return 0;
+
+    pid = slot_check(&owner->pin[pin_index(pin)]);
+    if (pid) {
+        fprintf(stderr, "gpio: Pin is owned by process %d (%.12s)\n",
+            pid, owner->pin[pin_index(pin)].tag);
+        return -1;
+    }
+
+    if (mode > MODE_ANALOG && mode < MODE_LAST) {
+        pid = slot_check(&owner->function[mode]);
+        if (pid) {
+            fprintf(stderr, "gpio: Function %s is owned by process %d (%.12s)\n",
+                mode_name[mode], pid, owner->function[mode].tag);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+//
+// Check that no pin and no function is owned by another process.
+// Needed before gpio_restore() and gpio_plan_execute(): they rewrite
+// whole registers, so cannot check the pins one by one.
+// Return 0 when allowed, -1 when anything is owned by somebody else.
+//
+int gpio_check_no_owners()
+{
+    int i, pid;
+
+    pthread_once(&owner_once, owner_init);
+    if (!owner)
+        return 0;
+
+    for (i = 0; i < OWNER_NPINS; i++) {
+        pid = slot_check(&owner->pin[i]);
+        if (pid) {
+            fprintf(stderr, "gpio: Pin R%c%d is owned by process %d (%.12s)\n",
+                "ABCDEFGHJK"[i / 16], i % 16, pid, owner->pin[i].tag);
+            return -1;
+        }
+    }
+    for (i = 0; i < MODE_LAST; i++) {
+        pid = slot_check(&owner->function[i]);
+        if (pid) {
+            fprintf(stderr, "gpio: Function %s is owned by process %d (%.12s)\n",
+                mode_name[i], pid, owner->function[i].tag);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+//
+// Print all claimed pins, functions and modules.
+//
+void gpio_print_owners()
+{
+    static const char port_name[] = "ABCDEFGHJK";
+    int i;
+
+    pthread_once(&owner_once, owner_init);
+    if (!owner)
+        return;
+
+    for (i = 0; i < OWNER_NPINS; i++) {
+        int pid = atomic_load(&owner->pin[i].pid);
+
+        if (pid && (kill(pid, 0) == 0 || errno != ESRCH))
+            printf(" R%c%-2d     %6d  %.12s\n", port_name[i / 16], i % 16,
+                pid, owner->pin[i].tag);
+    }
+    for (i = 0; i < MODE_LAST; i++) {
+        int pid = atomic_load(&owner->function[i].pid);
+
+        if (pid && (kill(pid, 0) == 0 || errno != ESRCH))
+            printf(" %-8s  %6d  %.12s\n", mode_name[i], pid, owner->function[i].tag);
+    }
+    for (i = 0; i < MODULE_LAST; i++) {
+        int pid = atomic_load(&owner->module[i].pid);
+
+        if (pid && (kill(pid, 0) == 0 || errno != ESRCH))
+            printf(" %-8s  %6d  %.12s\n", module_name[i], pid, owner->module[i].tag);
+    }
+}
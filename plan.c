@@ -0,0 +1,323 @@
+/*
+ * Plans of register writes.
+ *
+ * Copyright (C) 2019 Serge Vakulenko
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   1. Redistributions of source code must retain the above copyright notice,
+ *      this list of conditions and the following disclaimer.
+ *   2. Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer in the
+ *      documentation and/or other materials provided with the distribution.
+ *   3. The name of the author may not be used to endorse or promote products
+ *      derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR IMPLIED
+ * WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO
+ * EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+ * OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ * OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ * ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/stat.h>
+#include "gpio.h"
+
+//
+// Binary image of compiled plan:
+// a header, followed by array of gpio_plan_op_t.
+//
+#define PLAN_MAGIC      "PIC32PLN"
+#define PLAN_VERSION    2
+
+struct plan_header {
+    char     magic[8];
+    uint32_t version;
+    uint32_t nops;                  // Number of ops
+    uint64_t profile_mtime;         // Modification time of the source profile, nsec
+    uint64_t profile_size;          // Size of the source profile
+};
+
+//
+// Modification time of a file, in nanoseconds: edits within
+// the same second must invalidate the plan.
+//
+static uint64_t plan_mtime(const struct stat *st)
+{
+    return st->st_mtim.tv_sec * 1000000000ULL + st->st_mtim.tv_nsec;
+}
+
+//
+// Register blocks a plan can write: GPIO ports A-K, and PPS.
+//
+#define PLAN_GPIO_ADDR  0x1f860000
+#define PLAN_GPIO_SIZE  0xa00
+#define PLAN_PPS_ADDR   0x1f801400
+#define PLAN_PPS_SIZE   0x400
+
+//
+// Check that an op is one the compiler produces: set or clear
+// of a GPIO port register, store or unmap of a PPS register.
+//
+static int plan_op_valid(const gpio_plan_op_t *p)
+{
+    if (p->addr & 3)
+        return 0;
+    switch (p->op) {
+    case PLAN_SET:
+    case PLAN_CLR:
+        return p->addr - PLAN_GPIO_ADDR < PLAN_GPIO_SIZE &&
+               (p->addr & 0xf) == 0;
+    case PLAN_STORE:
+    case PLAN_UNMAP:
+        return p->addr - PLAN_PPS_ADDR < PLAN_PPS_SIZE;
+    }
+    return 0;
+}
+
+//
+// Find op by kind and register address.
+//
+static gpio_plan_op_t *plan_find(gpio_plan_t *plan, int op, unsigned addr)
+{
+    int i;
+
+    for (i = 0; i < plan->nops; i++) {
+        if (plan->op[i].op == op && plan->op[i].addr == addr)
+            return &plan->op[i];
+    }
+    return 0;
+}
+
+//
+// Remove op from the plan.
+//
+static void plan_remove(gpio_plan_t *plan, gpio_plan_op_t *p)
+{
+    int i = p - plan->op;
+
+    plan->nops--;
+    memmove(p, p+1, (plan->nops - i) * sizeof(*p));
+}
+
+//
+// Add a write to the plan.
+// Writes to the same register are merged, the later one wins.
+//
+void gpio_plan_add(gpio_plan_t *plan, int op, unsigned addr, unsigned value)
+{
+    gpio_plan_op_t *p;
+
+    switch (op) {
+    case PLAN_STORE:
+        // Store overrides any conditional clear of this register.
+        p = plan_find(plan, PLAN_UNMAP, addr);
+        if (p)
+            plan_remove(plan, p);
+        p = plan_find(plan, PLAN_STORE, addr);
+        if (p) {
+            p->value = value;
+            p->phase = plan->phase;
+            return;
+        }
+        break;
+
+    case PLAN_UNMAP:
+        // Register is already given a value: clear it when needed.
+        p = plan_find(plan, PLAN_STORE, addr);
+        if (p) {
+            if (value & (1 << (p->value & 0xf)))
+                p->value = 15;
+            return;
+        }
+        p = plan_find(plan, PLAN_UNMAP, addr);
+        if (p) {
+            p->value |= value;
+            return;
+        }
+        break;
+
+    case PLAN_SET:
+    case PLAN_CLR:
+        // Cancel the opposite operation on these bits.
+        p = plan_find(plan, (op == PLAN_SET) ? PLAN_CLR : PLAN_SET, addr);
+        if (p) {
+            p->value &= ~value;
+            if (p->value == 0)
+                plan_remove(plan, p);
+        }
+        p = plan_find(plan, op, addr);
+        if (p) {
+            p->value |= value;
+            return;
+        }
+        break;
+    }
+
+    if (plan->nops >= GPIO_PLAN_MAXOPS) {
+        fprintf(stderr, "gpio: Too many register writes in plan\n");
+        exit(-1);
+    }
+    p = &plan->op[plan->nops++];
+    p->op = op;
+    p->phase = plan->phase;
+    p->unused = 0;
+    p->addr = addr;
+    p->value = value;
+}
+
+//
+// Compare ops by phase, then by address.
+//
+static int plan_compare(const void *arg1, const void *arg2)
+{
+    const gpio_plan_op_t *a = arg1, *b = arg2;
+
+    if (a->phase != b->phase)
+        return a->phase - b->phase;
+    if (a->addr != b->addr)
+        return (a->addr < b->addr) ? -1 : 1;
+    return a->op - b->op;
+}
+
+//
+// Sort ops in order of execution.
+//
+void gpio_plan_sort(gpio_plan_t *plan)
+{
+    qsort(plan->op, plan->nops, sizeof(plan->op[0]), plan_compare);
+}
+
+//
+// Execute the plan.
+// Writes bypass checks of owner per pin, so refuse when
+// anything is owned by another process.
+// Return 0 on success, -1 when refused.
+//
+int gpio_plan_execute(const gpio_plan_t *plan)
+{
+    int i;
+
+    if (gpio_check_no_owners() < 0)
+        return -1;
+
+    for (i = 0; i < plan->nops; i++) {
+        const gpio_plan_op_t *p = &plan->op[i];
+        volatile unsigned *regp = gpio_sfr(p->addr);
+
+        // Accesses are traced as done: CLR and SET by their own
+        // registers, so that a replay repeats the same stores.
+        switch (p->op) {
+        case PLAN_STORE:
+            gpio_trace_write(p->addr, *regp, p->value);
+            *regp = p->value;
+            break;
+        case PLAN_CLR:
+            gpio_trace_write(p->addr + 4, *regp, p->value);
+            regp[1] = p->value;
+            break;
+        case PLAN_SET:
+            gpio_trace_write(p->addr + 8, *regp, p->value);
+            regp[2] = p->value;
+            break;
+        case PLAN_UNMAP: {
+            unsigned old = *regp;
+            gpio_trace_read(p->addr, old);
+            if (p->value & (1 << (old & 0xf))) {
+                *regp = 15;
+                gpio_trace_write(p->addr, old, 15);
+            }
+            break;
+        }
+        }
+    }
+    return 0;
+}
+
+//
+// Save compiled plan to a file.
+// Return 0 on success, -1 on error.
+//
+int gpio_plan_save(const gpio_plan_t *plan, const char *filename, const char *profile)
+{
+    struct plan_header hdr;
+    struct stat st;
+
+    if (stat(profile, &st) < 0)
+        return -1;
+
+    memset(&hdr, 0, sizeof(hdr));
+    memcpy(hdr.magic, PLAN_MAGIC, sizeof(hdr.magic));
+    hdr.version = PLAN_VERSION;
+    hdr.nops = plan->nops;
+    hdr.profile_mtime = plan_mtime(&st);
+    hdr.profile_size = st.st_size;
+
+    FILE *fd = gpio_fopen_user(filename, "wb");
+    if (!fd)
+        return -1;
+    if (fwrite(&hdr, sizeof(hdr), 1, fd) != 1 ||
+        fwrite(plan->op, sizeof(plan->op[0]), plan->nops, fd) != plan->nops) {
+        fclose(fd);
+        remove(filename);
+        return -1;
+    }
+    if (fclose(fd) != 0) {
+        remove(filename);
+        return -1;
+    }
+    return 0;
+}
+
+//
+// Load compiled plan from a file.
+// Fail when the plan is stale, so that the profile must be compiled again.
+// The file can be written by anyone who owns the profile, so every op
+// is checked to write only GPIO and PPS registers.
+// Return 0 on success, -1 on error.
+//
+int gpio_plan_load(gpio_plan_t *plan, const char *filename, const char *profile)
+{
+    struct plan_header hdr;
+    struct stat st;
+
+    if (stat(profile, &st) < 0)
+        return -1;
+
+    FILE *fd = gpio_fopen_user(filename, "rb");
+    if (!fd)
+        return -1;
+    if (fread(&hdr, sizeof(hdr), 1, fd) != 1 ||
+        memcmp(hdr.magic, PLAN_MAGIC, sizeof(hdr.magic)) != 0 ||
+        hdr.version != PLAN_VERSION ||
+        hdr.nops > GPIO_PLAN_MAXOPS ||
+        hdr.profile_mtime != plan_mtime(&st) ||
+        hdr.profile_size != (uint64_t) st.st_size ||
+        fread(plan->op, sizeof(plan->op[0]), hdr.nops, fd) != hdr.nops) {
+        fclose(fd);
+        return -1;
+    }
+    fclose(fd);
+
+    int i;
+    for (i = 0; i < hdr.nops; i++) {
+        if (!plan_op_valid(&plan->op[i])) {
+            fprintf(stderr, "gpio: %s: Invalid op %u at %08x\n", filename,
+                plan->op[i].op, plan->op[i].addr);
+            return -1;
+        }
+    }
+    plan->phase = 0;
+    plan->nops = hdr.nops;
+    return 0;
+}
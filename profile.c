@@ -0,0 +1,167 @@
+/*
+ * Board profiles: pin configuration in a text file.
+ *
+ * Copyright (C) 2019 Serge Vakulenko
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   1. Redistributions of source code must retain the above copyright notice,
+ *      this list of conditions and the following disclaimer.
+ *   2. Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer in the
+ *      documentation and/or other materials provided with the distribution.
+ *   3. The name of the author may not be used to endorse or promote products
+ *      derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR IMPLIED
+ * WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO
+ * EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+ * OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ * OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ * ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include "gpio.h"
+
+extern const char *mode_name[];
+extern int pin_lookup(const char *name);
+
+//
+// Find mode by name, as in 'gpio mode' command.
+// Return -1 when not found.
+//
+static int profile_mode(const char *name)
+{
+    gpio_mode_t mode;
+
+    if (strcasecmp(name, "in")     == 0) return MODE_INPUT;
+    if (strcasecmp(name, "input")  == 0) return MODE_INPUT;
+    if (strcasecmp(name, "out")    == 0) return MODE_OUTPUT;
+    if (strcasecmp(name, "output") == 0) return MODE_OUTPUT;
+
+    for (mode=0; mode<MODE_LAST; mode++) {
+        if (strcasecmp(name, mode_name[mode]) == 0)
+            return mode;
+    }
+    return -1;
+}
+
+//
+// Compile a board profile into a plan of register writes.
+// Every line of the profile has a form:
+//
+//      <pin> <mode> [up|down|tri|off] [0|1]
+//
+// Empty lines and comments starting with '#' are ignored.
+// Return 0 on success, -1 on error.
+//
+int profile_compile(const char *filename, gpio_plan_t *plan)
+{
+    FILE *fd = gpio_fopen_user(filename, "r");
+    if (!fd) {
+        fprintf(stderr, "gpio: %s: %s\n", filename, strerror(errno));
+        return -1;
+    }
+
+    int used_pin[64];               // Pins already configured
+    int used_mode[MODE_LAST];       // Input functions already mapped
+    int npins = 0, lineno = 0, nerrors = 0;
+    char line[256];
+
+    memset(used_mode, 0, sizeof(used_mode));
+    memset(plan, 0, sizeof(*plan));
+
+    while (fgets(line, sizeof(line), fd)) {
+        lineno++;
+
+        char *p = strchr(line, '#');
+        if (p)
+            *p = 0;
+
+        char *pin_name = strtok(line, " \t\r\n");
+        if (!pin_name)
+            continue;
+
+        char *mode_str = strtok(0, " \t\r\n");
+        if (!mode_str) {
+            fprintf(stderr, "%s:%d: Mode missing\n", filename, lineno);
+            nerrors++;
+            continue;
+        }
+
+        int pin = pin_lookup(pin_name);
+        if (pin < 0) {
+            fprintf(stderr, "%s:%d: Wrong pin name: %s\n", filename, lineno, pin_name);
+            nerrors++;
+            continue;
+        }
+
+        int mode = profile_mode(mode_str);
+        if (mode < 0) {
+            fprintf(stderr, "%s:%d: Invalid mode: %s\n", filename, lineno, mode_str);
+            nerrors++;
+            continue;
+        }
+        if (mode > MODE_ANALOG && !gpio_has_mapping(pin, mode)) {
+            fprintf(stderr, "%s:%d: Mode %s is not available on pin %s\n",
+                filename, lineno, mode_name[mode], pin_name);
+            nerrors++;
+            continue;
+        }
+
+        int i;
+        for (i = 0; i < npins; i++) {
+            if (used_pin[i] == pin)
+                break;
+        }
+        if (i < npins) {
+            fprintf(stderr, "%s:%d: Pin %s configured twice\n", filename, lineno, pin_name);
+            nerrors++;
+            continue;
+        }
+        if (npins < 64)
+            used_pin[npins++] = pin;
+
+        if (mode >= MODE_C1RX && mode < MODE_SCK1) {
+            if (used_mode[mode]) {
+                fprintf(stderr, "%s:%d: Function %s mapped twice\n",
+                    filename, lineno, mode_name[mode]);
+                nerrors++;
+                continue;
+            }
+            used_mode[mode] = 1;
+        }
+        gpio_plan_mode(plan, pin, mode);
+
+        // Optional pull and output value.
+        char *arg;
+        while ((arg = strtok(0, " \t\r\n")) != 0) {
+            if      (strcasecmp(arg, "up")   == 0) gpio_plan_pull(plan, pin, PULL_UP);
+            else if (strcasecmp(arg, "down") == 0) gpio_plan_pull(plan, pin, PULL_DOWN);
+            else if (strcasecmp(arg, "tri")  == 0) gpio_plan_pull(plan, pin, PULL_OFF);
+            else if (strcasecmp(arg, "off")  == 0) gpio_plan_pull(plan, pin, PULL_OFF);
+            else if (strcmp(arg, "0")        == 0) gpio_plan_write(plan, pin, 0);
+            else if (strcmp(arg, "1")        == 0) gpio_plan_write(plan, pin, 1);
+            else {
+                fprintf(stderr, "%s:%d: Invalid option: %s\n", filename, lineno, arg);
+                nerrors++;
+            }
+        }
+    }
+    fclose(fd);
+
+    if (nerrors > 0)
+        return -1;
+
+    gpio_plan_sort(plan);
+    return 0;
+}
@@ -0,0 +1,231 @@
+/*
+ * Snapshots of control registers.
+ *
+ * Copyright (C) 2019 Serge Vakulenko
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   1. Redistributions of source code must retain the above copyright notice,
+ *      this list of conditions and the following disclaimer.
+ *   2. Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer in the
+ *      documentation and/or other materials provided with the distribution.
+ *   3. The name of the author may not be used to endorse or promote products
+ *      derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR IMPLIED
+ * WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO
+ * EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+ * OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ * OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ * ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include "gpio.h"
+
+//
+// Binary image of register snapshot:
+// a header, followed by gpio_snapshot_t in native byte order.
+// Version is bumped whenever layout of gpio_snapshot_t changes.
+//
+#define SNAPSHOT_MAGIC      "PIC32SFR"
+#define SNAPSHOT_VERSION    1
+
+struct snapshot_header {
+    char     magic[8];
+    uint32_t version;
+    uint32_t size;                  // Size of gpio_snapshot_t
+};
+
+static const char port_name[GPIO_NPORTS] = "ABCDEFGHJK";
+
+static const char *reg_name[GPIO_NREGS] = {
+    [GPIO_ANSEL]  = "ANSEL",
+    [GPIO_TRIS]   = "TRIS",
+    [GPIO_PORT]   = "PORT",
+    [GPIO_LAT]    = "LAT",
+    [GPIO_ODC]    = "ODC",
+    [GPIO_CNPU]   = "CNPU",
+    [GPIO_CNPD]   = "CNPD",
+    [GPIO_CNCON]  = "CNCON",
+    [GPIO_CNEN]   = "CNEN",
+    [GPIO_CNSTAT] = "CNSTAT",
+};
+
+//
+// Read all registers into a snapshot.
+//
+void gpio_snapshot(gpio_snapshot_t *snap)
+{
+    memset(snap, 0, sizeof(*snap));
+    gpio_save_ports(snap);
+    gpio_save_pps(snap);
+    gpio_save_spi(snap);
+    gpio_save_i2c(snap);
+}
+
+//
+// Apply a snapshot to the hardware.
+// Pin levels and directions go first, then pin mapping,
+// and peripherals are enabled last.
+// Return a number of register writes, or -1 when some pins
+// are owned by another process.
+//
+int gpio_restore(const gpio_snapshot_t *snap)
+{
+    int nwrites;
+
+    if (gpio_check_no_owners() < 0)
+        return -1;
+    nwrites  = gpio_restore_ports(snap);
+    nwrites += gpio_restore_pps(snap);
+    nwrites += gpio_restore_spi(snap);
+    nwrites += gpio_restore_i2c(snap);
+    return nwrites;
+}
+
+//
+// Print differences between two snapshots.
+// Return a number of differing registers.
+//
+int gpio_snapshot_diff(const gpio_snapshot_t *a, const gpio_snapshot_t *b)
+{
+    int ndiffs = 0;
+    int port, i;
+
+    for (port = 0; port < GPIO_NPORTS; port++) {
+        for (i = 0; i < GPIO_NREGS; i++) {
+            if (a->port[port][i] != b->port[port][i]) {
+                printf("%s%c: %04x -> %04x\n", reg_name[i], port_name[port],
+                    a->port[port][i], b->port[port][i]);
+                ndiffs++;
+            }
+        }
+    }
+
+    for (i = 0; i < PPS_NINPUTS; i++) {
+        if (a->pps_input[i] != b->pps_input[i]) {
+            printf("%s: %u -> %u\n", gpio_pps_input_name(i),
+                a->pps_input[i], b->pps_input[i]);
+            ndiffs++;
+        }
+    }
+
+    for (i = 0; i < PPS_NOUTPUTS; i++) {
+        if (a->pps_output[i] != b->pps_output[i]) {
+            printf("%s: %u -> %u\n", gpio_pps_output_name(i),
+                a->pps_output[i], b->pps_output[i]);
+            ndiffs++;
+        }
+    }
+
+    for (i = 0; i < SPI_NPORTS; i++) {
+        if (a->spicon[i] != b->spicon[i]) {
+            printf("SPI%dCON: %08x -> %08x\n", i+1, a->spicon[i], b->spicon[i]);
+            ndiffs++;
+        }
+    }
+
+    for (i = 0; i < I2C_NPORTS; i++) {
+        if (a->i2ccon[i] != b->i2ccon[i]) {
+            printf("I2C%dCON: %08x -> %08x\n", i+1, a->i2ccon[i], b->i2ccon[i]);
+            ndiffs++;
+        }
+    }
+    return ndiffs;
+}
+
+//
+// Check whether pin modes could change between two snapshots:
+// pin mapping, direction, analog select or peripheral enables.
+//
+int gpio_snapshot_config_changed(const gpio_snapshot_t *a, const gpio_snapshot_t *b)
+{
+    int port;
+
+    if (memcmp(a->pps_input, b->pps_input, sizeof(a->pps_input)) != 0 ||
+        memcmp(a->pps_output, b->pps_output, sizeof(a->pps_output)) != 0 ||
+        memcmp(a->spicon, b->spicon, sizeof(a->spicon)) != 0 ||
+        memcmp(a->i2ccon, b->i2ccon, sizeof(a->i2ccon)) != 0)
+        return 1;
+
+    for (port = 0; port < GPIO_NPORTS; port++) {
+        if (a->port[port][GPIO_TRIS] != b->port[port][GPIO_TRIS] ||
+            a->port[port][GPIO_ANSEL] != b->port[port][GPIO_ANSEL])
+            return 1;
+    }
+    return 0;
+}
+
+//
+// Save snapshot to a file.
+// Return 0 on success, -1 on error.
+//
+int gpio_snapshot_save(const gpio_snapshot_t *snap, const char *filename)
+{
+    struct snapshot_header hdr;
+
+    memset(&hdr, 0, sizeof(hdr));
+    memcpy(hdr.magic, SNAPSHOT_MAGIC, sizeof(hdr.magic));
+    hdr.version = SNAPSHOT_VERSION;
+    hdr.size = sizeof(*snap);
+
+    FILE *fd = gpio_fopen_user(filename, "wb");
+    if (!fd) {
+        fprintf(stderr, "gpio: %s: %s\n", filename, strerror(errno));
+        return -1;
+    }
+    if (fwrite(&hdr, sizeof(hdr), 1, fd) != 1 ||
+        fwrite(snap, sizeof(*snap), 1, fd) != 1) {
+        fprintf(stderr, "gpio: %s: Write error\n", filename);
+        fclose(fd);
+        return -1;
+    }
+    if (fclose(fd) != 0) {
+        fprintf(stderr, "gpio: %s: %s\n", filename, strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+//
+// Load snapshot from a file.
+// Return 0 on success, -1 on error.
+//
+int gpio_snapshot_load(gpio_snapshot_t *snap, const char *filename)
+{
+    struct snapshot_header hdr;
+
+    FILE *fd = gpio_fopen_user(filename, "rb");
+    if (!fd) {
+        fprintf(stderr, "gpio: %s: %s\n", filename, strerror(errno));
+        return -1;
+    }
+    if (fread(&hdr, sizeof(hdr), 1, fd) != 1 ||
+        memcmp(hdr.magic, SNAPSHOT_MAGIC, sizeof(hdr.magic)) != 0) {
+        fprintf(stderr, "gpio: %s: Not a register snapshot\n", filename);
+        fclose(fd);
+        return -1;
+    }
+    if (hdr.version != SNAPSHOT_VERSION || hdr.size != sizeof(*snap)) {
+        fprintf(stderr, "gpio: %s: Unsupported snapshot version %u\n",
+            filename, hdr.version);
+        fclose(fd);
+        return -1;
+    }
+    if (fread(snap, sizeof(*snap), 1, fd) != 1) {
+        fprintf(stderr, "gpio: %s: Truncated snapshot\n", filename);
+        fclose(fd);
+        return -1;
+    }
+    fclose(fd);
+    return 0;
+}
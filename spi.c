@@ -31,7 +31,9 @@
 #include <string.h>
 #include <stdint.h>
 #include <errno.h>
+#include <time.h>
 #include <sys/mman.h>
+#include <pthread.h>
 #include "gpio.h"
 
 //
@@ -46,7 +48,33 @@
 
 static const int SPI_ADDR = 0x1f821000;
 
+//
+// Registers of SPIx, as offsets from SPIxCON, in words.
+//
+#define SPISTAT     (0x10/4)
+#define SPIBUF      (0x20/4)
+#define SPIBRG      (0x30/4)
+#define SPICON2     (0x40/4)
+
+#define CON_ENHBUF  0x00010000      // Enhanced buffer: 128-bit FIFOs
+#define CON_ON      0x00008000
+#define CON_MODE32  0x00000800
+#define CON_MODE16  0x00000400
+#define CON_SMP     0x00000200      // Sample input at end of data time
+#define CON_CKE     0x00000100      // Output changes on active-to-idle clock
+#define CON_CKP     0x00000040      // Idle state of clock is high
+#define CON_MSTEN   0x00000020
+#define CON_MSSEN   0x10000000      // Drive SSx in master mode
+
+#define STAT_SPIRBE 0x00000020      // Receive FIFO empty
+#define STAT_SPITBF 0x00000002      // Transmit FIFO full
+#define STAT_SPIRBF 0x00000001      // Receive FIFO full
+
+#define SPI_FIFO_BYTES 16
+#define SPI_TIMEOUT_MS 1000        // Longest wait without progress
+
 static ptrdiff_t spi_base;          // PPS registers mapped here
+static pthread_once_t spi_once = PTHREAD_ONCE_INIT;
 
 //
 // Get access to PPS control registers.
@@ -56,6 +84,8 @@ static void spi_init()
 {
     extern int gpio_mem_fd;
 
+    gpio_open();
+
     // Map a page of memory to the PPS address
     spi_base = (ptrdiff_t) mmap(0, 4096, PROT_READ|PROT_WRITE, MAP_SHARED,
         gpio_mem_fd, SPI_ADDR);
@@ -84,14 +114,13 @@ gpio_mode_t gpio_get_spi_function(int pin)
     case GPIO_PIN('D',15): offset = SPI6CON; mode = MODE_SCK6; break;
     }
 
-    if (!spi_base)
-        spi_init();
+    pthread_once(&spi_once, spi_init);
 
     // Read SPICON register.
     volatile uint32_t *regp = (uint32_t*) (spi_base + offset);
     uint32_t spicon = *regp;
-    if (gpio_debug > 1)
-        printf("--- %s: [%08x] -> %08x\n", __func__, SPI_ADDR + offset, spicon);
+    gpio_stats_mmio(1, 0);
+    gpio_trace_read(SPI_ADDR + offset, spicon);
 
     // Check ON bit.
     if (spicon & 0x00008000) {
@@ -100,3 +129,255 @@ gpio_mode_t gpio_get_spi_function(int pin)
     }
     return 0;
 }
+
+//
+// SPIxCON registers, in order of snapshot.
+//
+static const int spicon_offset[SPI_NPORTS] = {
+    SPI1CON, SPI2CON, SPI3CON, SPI4CON, SPI5CON, SPI6CON,
+};
+
+//
+// Save SPI control registers into a snapshot.
+//
+void gpio_save_spi(gpio_snapshot_t *snap)
+{
+    int i;
+
+    pthread_once(&spi_once, spi_init);
+
+    for (i = 0; i < SPI_NPORTS; i++)
+        snap->spicon[i] = *(volatile uint32_t*) (spi_base + spicon_offset[i]);
+}
+
+//
+// Restore SPI control registers from a snapshot.
+// Write only registers which differ from the live state.
+// Return a number of writes.
+//
+int gpio_restore_spi(const gpio_snapshot_t *snap)
+{
+    int i, nwrites = 0;
+
+    pthread_once(&spi_once, spi_init);
+
+    for (i = 0; i < SPI_NPORTS; i++) {
+        volatile uint32_t *regp = (uint32_t*) (spi_base + spicon_offset[i]);
+
+        uint32_t old = *regp;
+
+        if (old != snap->spicon[i]) {
+            *regp = snap->spicon[i];
+            nwrites++;
+            gpio_trace_write(SPI_ADDR + spicon_offset[i], old, snap->spicon[i]);
+        }
+    }
+    return nwrites;
+}
+
+//
+// Dedicated SCKx pins, and state of open ports.
+//
+static const int spi_sck[SPI_NPORTS+1] = {
+    0, GPIO_PIN('D',1), GPIO_PIN('G',6), GPIO_PIN('B',14),
+    GPIO_PIN('D',10), GPIO_PIN('F',13), GPIO_PIN('D',15),
+};
+
+static struct {
+    int bytes;                      // Word size, 1, 2 or 4
+    int sdo, sdi, ss;               // Routed pins, or 0
+} spi_port[SPI_NPORTS+1];
+
+static volatile uint32_t *spi_reg(int port)
+{
+    pthread_once(&spi_once, spi_init);
+    return (uint32_t*) (spi_base + spicon_offset[port - 1]);
+}
+
+//
+// Start SPIx, x = 1...6, as master with a given clock rate in Hz,
+// mode 0...3 and word width 8, 16 or 32 bits.
+// Pins SDOx, SDIx and SSx are routed by PPS; any of them can be 0,
+// when not used.  SCKx has a dedicated pin.
+// A module which is already enabled is left alone.
+// Return actual clock rate, or 0 on error.
+//
+unsigned gpio_spi_start(int port, unsigned hz, int mode, int bits,
+    int sdo, int sdi, int ss)
+{
+    if (port < 1 || port > SPI_NPORTS) {
+        fprintf(stderr, "gpio: Bad SPI port %d\n", port);
+        return 0;
+    }
+    if (mode < 0 || mode > 3 || (bits != 8 && bits != 16 && bits != 32)) {
+        fprintf(stderr, "gpio: Bad SPI mode %d or word width %d\n", mode, bits);
+        return 0;
+    }
+    if ((sdo && !gpio_has_mapping(sdo, MODE_SDO1 + port - 1)) ||
+        (sdi && !gpio_has_mapping(sdi, MODE_SDI1 + port - 1)) ||
+        (ss && !gpio_has_mapping(ss, MODE_SS1O + port - 1))) {
+        fprintf(stderr, "gpio: Pin cannot be mapped to SPI%d\n", port);
+        return 0;
+    }
+
+    // SCK = PBCLK2 / (2 * (BRG + 1)), rounded to not exceed the rate.
+    unsigned pbclk = gpio_pbclk(2);
+    unsigned brg = hz ? (pbclk / 2 + hz - 1) / hz : 0;
+    if (brg > 0)
+        brg--;
+    if (hz == 0 || brg > 0x1fff) {
+        fprintf(stderr, "gpio: SPI rate must be %u...%u Hz\n",
+            pbclk / 2 / 0x2000 + 1, pbclk / 2);
+        return 0;
+    }
+    if (gpio_claim_function(MODE_SCK1 + port - 1, "spi") < 0)
+        return 0;
+
+    volatile uint32_t *spi = spi_reg(port);
+    if (spi[0] & CON_ON) {
+        fprintf(stderr, "gpio: SPI%d is busy\n", port);
+        gpio_release_function(MODE_SCK1 + port - 1);
+        return 0;
+    }
+
+    uint32_t con = CON_ENHBUF | CON_MSTEN | CON_SMP;
+
+    if (!(mode & 1))
+        con |= CON_CKE;
+    if (mode & 2)
+        con |= CON_CKP;
+    if (bits == 16)
+        con |= CON_MODE16;
+    if (bits == 32)
+        con |= CON_MODE32;
+    if (ss)
+        con |= CON_MSSEN;
+
+    // Disabled module has its FIFOs reset.
+    spi[0] = 0;
+    spi[SPIBRG] = brg;
+    spi[SPICON2] = 0;
+    spi[0] = con;
+
+    // Route the pins.  On failure, pins routed so far
+    // are made input again.
+    int pin[4] = { spi_sck[port], sdo, sdi, ss };
+    gpio_mode_t func[4] = { MODE_SCK1 + port - 1, MODE_SDO1 + port - 1,
+                            MODE_SDI1 + port - 1, MODE_SS1O + port - 1 };
+    int i;
+    for (i = 0; i < 4; i++) {
+        if (pin[i] && gpio_set_mode(pin[i], func[i]) < 0) {
+            while (--i >= 0) {
+                if (pin[i])
+                    gpio_set_mode(pin[i], MODE_INPUT);
+            }
+            spi[0] = 0;
+            gpio_release_function(MODE_SCK1 + port - 1);
+            return 0;
+        }
+    }
+
+    spi_port[port].bytes = bits / 8;
+    spi_port[port].sdo = sdo;
+    spi_port[port].sdi = sdi;
+    spi_port[port].ss = ss;
+    spi[0] = con | CON_ON;
+    return pbclk / 2 / (brg + 1);
+}
+
+//
+// Get monotonic time in milliseconds.
+//
+static unsigned long long spi_msec()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000ULL + ts.tv_nsec / 1000000;
+}
+
+//
+// Full-duplex transfer of nwords words on SPIx.
+// Transmit data is taken from tx, or all ones when tx is 0.
+// Received data is stored to rx, unless it is 0.
+// Words are uint8_t, uint16_t or uint32_t, by width of the port.
+// Transmit FIFO is kept filled, but never ahead of the receive side
+// by more than the FIFO depth, so that receive FIFO cannot overflow.
+// Return 0 on success, -1 when the port is not started,
+// or when the module makes no progress for a long time.
+//
+int gpio_spi_transfer(int port, const void *tx, void *rx, unsigned nwords)
+{
+    if (port < 1 || port > SPI_NPORTS || spi_port[port].bytes == 0) {
+        fprintf(stderr, "gpio: SPI%d is not started\n", port);
+        return -1;
+    }
+
+    volatile uint32_t *spi = spi_reg(port);
+    int bytes = spi_port[port].bytes;
+    unsigned depth = SPI_FIFO_BYTES / bytes;
+    unsigned nsent = 0, nrecv = 0;
+    unsigned long long deadline = spi_msec() + SPI_TIMEOUT_MS;
+
+    while (nrecv < nwords) {
+        unsigned progress = nsent + nrecv;
+
+        // Top up the transmit FIFO.
+        while (nsent < nwords && nsent - nrecv < depth &&
+               !(spi[SPISTAT] & STAT_SPITBF)) {
+            uint32_t word = 0xffffffff;
+
+            if (tx) {
+                switch (bytes) {
+                case 1: word = ((const uint8_t*) tx)[nsent]; break;
+                case 2: word = ((const uint16_t*) tx)[nsent]; break;
+                case 4: word = ((const uint32_t*) tx)[nsent]; break;
+                }
+            }
+            spi[SPIBUF] = word;
+            nsent++;
+        }
+
+        // Drain the receive FIFO.
+        while (nrecv < nsent && !(spi[SPISTAT] & STAT_SPIRBE)) {
+            uint32_t word = spi[SPIBUF];
+
+            if (rx) {
+                switch (bytes) {
+                case 1: ((uint8_t*) rx)[nrecv] = word; break;
+                case 2: ((uint16_t*) rx)[nrecv] = word; break;
+                case 4: ((uint32_t*) rx)[nrecv] = word; break;
+                }
+            }
+            nrecv++;
+        }
+
+        if (nsent + nrecv != progress)
+            deadline = spi_msec() + SPI_TIMEOUT_MS;
+        else if (spi_msec() > deadline) {
+            fprintf(stderr, "gpio: SPI%d transfer timed out\n", port);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+//
+// Stop SPIx, and make its pins input.
+//
+void gpio_spi_stop(int port)
+{
+    if (port < 1 || port > SPI_NPORTS || spi_port[port].bytes == 0)
+        return;
+
+    *spi_reg(port) = 0;
+    gpio_set_mode(spi_sck[port], MODE_INPUT);
+    if (spi_port[port].sdo)
+        gpio_set_mode(spi_port[port].sdo, MODE_INPUT);
+    if (spi_port[port].sdi)
+        gpio_set_mode(spi_port[port].sdi, MODE_INPUT);
+    if (spi_port[port].ss)
+        gpio_set_mode(spi_port[port].ss, MODE_INPUT);
+    gpio_release_function(MODE_SCK1 + port - 1);
+    spi_port[port].bytes = 0;
+}
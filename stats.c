@@ -0,0 +1,390 @@
+/*
+ * Counters and latency histograms of library calls.
+ *
+ * Copyright (C) 2019 Serge Vakulenko
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   1. Redistributions of source code must retain the above copyright notice,
+ *      this list of conditions and the following disclaimer.
+ *   2. Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer in the
+ *      documentation and/or other materials provided with the distribution.
+ *   3. The name of the author may not be used to endorse or promote products
+ *      derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR IMPLIED
+ * WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO
+ * EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+ * OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ * OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ * ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <errno.h>
+#include <signal.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "gpio.h"
+
+//
+// Statistics of a process live in a shared memory segment,
+// named by its PID, so that gpio stats can read them while
+// the process runs.  Every thread has its own slot, written
+// without atomics; readers sum all slots.
+//
+#define STATS_SHM       "/gpio-pic32-stats."
+#define STATS_NTHREADS  16
+#define STATS_NBUCKETS  32              // Latency up to 2^31 nsec
+
+struct stats_op {
+    unsigned long long calls;
+    unsigned long long reads;           // MMIO reads
+    unsigned long long writes;          // MMIO writes
+    unsigned long long nsec;            // Total latency
+    unsigned long long hist[STATS_NBUCKETS]; // By log2 of latency in nsec
+};
+
+struct stats_thread {
+    struct stats_op op[GPIO_STAT_LAST];
+};
+
+struct stats_table {
+    int pid;
+    int nthreads;                       // Slots taken
+    char name[16];                      // Command of the process
+    struct stats_thread thread[STATS_NTHREADS];
+};
+
+static const char *op_name[GPIO_STAT_LAST] = {
+    [GPIO_STAT_READ]        = "gpio_read",
+    [GPIO_STAT_WRITE]       = "gpio_write",
+    [GPIO_STAT_TOGGLE]      = "gpio_toggle",
+    [GPIO_STAT_GET_MODE]    = "gpio_get_mode",
+    [GPIO_STAT_SET_MODE]    = "gpio_set_mode",
+    [GPIO_STAT_SET_PULL]    = "gpio_set_pull",
+    [GPIO_STAT_GET_OUTPUT]  = "gpio_get_output_mapping",
+    [GPIO_STAT_GET_INPUT]   = "gpio_get_input_mapping",
+    [GPIO_STAT_SET_MAPPING] = "gpio_set_mapping",
+    [GPIO_STAT_CLEAR_MAPPING] = "gpio_clear_mapping",
+    [GPIO_STAT_HAS_MAPPING] = "gpio_has_mapping",
+};
+
+static struct stats_table *stats;       // Shared segment of this process
+static pthread_mutex_t stats_lock = PTHREAD_MUTEX_INITIALIZER;
+static char stats_shm[32];
+
+//
+// Slot of this thread, and the call in progress,
+// to which MMIO accesses are counted.
+//
+static __thread struct stats_thread *stats_self;
+static __thread struct stats_thread stats_private;
+static __thread int stats_current = -1;
+
+//
+// Print statistics, and remove the segment at exit.
+//
+static void stats_exit()
+{
+    if (getenv("GPIO_STATS"))
+        gpio_stats_print(stderr, stats);
+    shm_unlink(stats_shm);
+}
+
+//
+// Take a slot for this thread.  The segment is created on first use:
+// a stale one of the same name is removed, and a new one is made
+// exclusively, so nobody else can have it mapped.
+// Threads above the limit count into private storage, not reported.
+//
+static struct stats_thread *stats_thread_init()
+{
+    pthread_mutex_lock(&stats_lock);
+    if (!stats) {
+        snprintf(stats_shm, sizeof(stats_shm), "%s%d", STATS_SHM, getpid());
+        shm_unlink(stats_shm);
+        int fd = shm_open(stats_shm, O_RDWR | O_CREAT | O_EXCL, 0644);
+        if (fd >= 0) {
+            void *p = MAP_FAILED;
+
+            if (ftruncate(fd, sizeof(struct stats_table)) == 0)
+                p = mmap(0, sizeof(struct stats_table), PROT_READ|PROT_WRITE,
+                    MAP_SHARED, fd, 0);
+            close(fd);
+            if (p != MAP_FAILED) {
+                stats = p;
+                stats->pid = getpid();
+                FILE *f = fopen("/proc/self/comm", "r");
+                if (f) {
+                    if (fgets(stats->name, sizeof(stats->name), f))
+                        stats->name[strcspn(stats->name, "\n")] = 0;
+                    fclose(f);
+                }
+                atexit(stats_exit);
+            } else {
+                shm_unlink(stats_shm);
+            }
+        }
+    }
+    if (stats && stats->nthreads >= 0 && stats->nthreads < STATS_NTHREADS)
+        stats_self = &stats->thread[stats->nthreads++];
+    else
+        stats_self = &stats_private;
+    pthread_mutex_unlock(&stats_lock);
+    return stats_self;
+}
+
+//
+// Start timing of a call.  Called through gpio_stats_enter() macro,
+// only in builds with GPIO_STATS defined.
+//
+gpio_stats_ctx_t gpio_stats_begin(int op)
+{
+    gpio_stats_ctx_t ctx;
+    struct timespec ts;
+
+    if (!stats_self)
+        stats_thread_init();
+
+    ctx.op = op;
+    ctx.prev = stats_current;
+    stats_current = op;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    ctx.start = ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+    return ctx;
+}
+
+//
+// Finish timing of a call, on exit from the scope.
+//
+void gpio_stats_leave(gpio_stats_ctx_t *ctx)
+{
+    struct stats_op *s = &stats_self->op[ctx->op];
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    unsigned long long nsec = ts.tv_sec * 1000000000ULL + ts.tv_nsec - ctx->start;
+    int bucket = 63 - __builtin_clzll(nsec | 1);
+
+    if (bucket >= STATS_NBUCKETS)
+        bucket = STATS_NBUCKETS - 1;
+    s->calls++;
+    s->nsec += nsec;
+    s->hist[bucket]++;
+    stats_current = ctx->prev;
+}
+
+//
+// Count MMIO accesses of the call in progress.
+//
+void gpio_stats_count(int nreads, int nwrites)
+{
+    if (stats_current < 0)
+        return;
+    stats_self->op[stats_current].reads += nreads;
+    stats_self->op[stats_current].writes += nwrites;
+}
+
+//
+// Sum counters of a function over threads of a process.
+//
+static void stats_sum(const struct stats_table *t, int op, struct stats_op *sum)
+{
+    int i, b;
+
+    memset(sum, 0, sizeof(*sum));
+    for (i = 0; i < t->nthreads && i < STATS_NTHREADS; i++) {
+        const struct stats_op *s = &t->thread[i].op[op];
+
+        sum->calls += s->calls;
+        sum->reads += s->reads;
+        sum->writes += s->writes;
+        sum->nsec += s->nsec;
+        for (b = 0; b < STATS_NBUCKETS; b++)
+            sum->hist[b] += s->hist[b];
+    }
+}
+
+//
+// Print statistics of a process, summed over threads.
+//
+void gpio_stats_print(FILE *out, const void *table)
+{
+    const struct stats_table *t = table;
+    int op, b;
+
+    if (!t)
+        return;
+    fprintf(out, "Process %d (%s), %d threads\n", t->pid, t->name, t->nthreads);
+    fprintf(out, "  Function                    Calls      Reads     Writes   Avg nsec\n");
+    for (op = 0; op < GPIO_STAT_LAST; op++) {
+        struct stats_op sum;
+
+        stats_sum(t, op, &sum);
+        if (sum.calls == 0)
+            continue;
+
+        fprintf(out, "  %-24s %8llu %10llu %10llu %10.0f\n", op_name[op],
+            sum.calls, sum.reads, sum.writes, (double) sum.nsec / sum.calls);
+
+        // Histogram: bucket lower bound in nsec, and count.
+        fprintf(out, "     ");
+        for (b = 0; b < STATS_NBUCKETS; b++) {
+            if (sum.hist[b])
+                fprintf(out, " %llu:%llu", 1ULL << b, sum.hist[b]);
+        }
+        fprintf(out, "\n");
+    }
+}
+
+//
+// Call a function for statistics of every running process,
+// or of a given one.  Segments of terminated processes are removed.
+// Return number of processes found.
+//
+static int stats_foreach(int pid, void (*func)(const struct stats_table*, void*),
+    void *arg)
+{
+    DIR *dir = opendir("/dev/shm");
+    struct dirent *d;
+    int nfound = 0;
+
+    if (!dir)
+        return 0;
+    while ((d = readdir(dir)) != 0) {
+        char name[300];
+        int p;
+
+        if (strncmp(d->d_name, STATS_SHM + 1, strlen(STATS_SHM) - 1) != 0)
+            continue;
+        p = atoi(d->d_name + strlen(STATS_SHM) - 1);
+        snprintf(name, sizeof(name), "/%s", d->d_name);
+
+        if (p <= 0 || (kill(p, 0) < 0 && errno == ESRCH)) {
+            shm_unlink(name);
+            continue;
+        }
+        if (pid != 0 && p != pid)
+            continue;
+
+        // Segment could be not yet extended by its process.
+        struct stat st;
+        int fd = shm_open(name, O_RDONLY, 0);
+        if (fd < 0)
+            continue;
+        if (fstat(fd, &st) < 0 || st.st_size < sizeof(struct stats_table)) {
+            close(fd);
+            continue;
+        }
+        void *t = mmap(0, sizeof(struct stats_table), PROT_READ, MAP_SHARED, fd, 0);
+        close(fd);
+        if (t == MAP_FAILED)
+            continue;
+        func(t, arg);
+        munmap(t, sizeof(struct stats_table));
+        nfound++;
+    }
+    closedir(dir);
+    return nfound;
+}
+
+static void print_table(const struct stats_table *t, void *out)
+{
+    gpio_stats_print(out, t);
+}
+
+//
+// Print statistics of all running processes, or of a given one.
+// Return number of processes found.
+//
+int gpio_stats_print_all(FILE *out, int pid)
+{
+    return stats_foreach(pid, print_table, out);
+}
+
+//
+// Write one metric family for a process in OpenMetrics text format.
+// Latency histogram buckets are cumulative, in seconds.
+//
+enum { FAMILY_READS, FAMILY_WRITES, FAMILY_LATENCY, FAMILY_LAST };
+
+struct export_arg {
+    FILE *out;
+    int family;
+};
+
+static void export_table(const struct stats_table *t, void *arg)
+{
+    FILE *out = ((struct export_arg*) arg)->out;
+    int family = ((struct export_arg*) arg)->family;
+    int op, b;
+
+    for (op = 0; op < GPIO_STAT_LAST; op++) {
+        struct stats_op sum;
+        unsigned long long cumulative = 0;
+
+        stats_sum(t, op, &sum);
+        if (sum.calls == 0)
+            continue;
+
+        switch (family) {
+        case FAMILY_READS:
+            fprintf(out, "gpio_mmio_reads_total{pid=\"%d\",function=\"%s\"} %llu\n",
+                t->pid, op_name[op], sum.reads);
+            break;
+        case FAMILY_WRITES:
+            fprintf(out, "gpio_mmio_writes_total{pid=\"%d\",function=\"%s\"} %llu\n",
+                t->pid, op_name[op], sum.writes);
+            break;
+        case FAMILY_LATENCY:
+            for (b = 0; b < STATS_NBUCKETS - 1; b++) {
+                cumulative += sum.hist[b];
+                fprintf(out, "gpio_call_seconds_bucket{pid=\"%d\",function=\"%s\",le=\"%g\"} %llu\n",
+                    t->pid, op_name[op], (double) (2ULL << b) / 1e9, cumulative);
+            }
+            fprintf(out, "gpio_call_seconds_bucket{pid=\"%d\",function=\"%s\",le=\"+Inf\"} %llu\n",
+                t->pid, op_name[op], sum.calls);
+            fprintf(out, "gpio_call_seconds_sum{pid=\"%d\",function=\"%s\"} %g\n",
+                t->pid, op_name[op], sum.nsec / 1e9);
+            fprintf(out, "gpio_call_seconds_count{pid=\"%d\",function=\"%s\"} %llu\n",
+                t->pid, op_name[op], sum.calls);
+            break;
+        }
+    }
+}
+
+//
+// Write counters of all running processes in OpenMetrics text format.
+// Samples of every family must be contiguous, so processes are
+// scanned once per family.
+//
+void gpio_stats_export(FILE *out)
+{
+    static const char *header[FAMILY_LAST] = {
+        "# TYPE gpio_mmio_reads counter\n"
+        "# HELP gpio_mmio_reads Register reads by library function.\n",
+        "# TYPE gpio_mmio_writes counter\n"
+        "# HELP gpio_mmio_writes Register writes by library function.\n",
+        "# TYPE gpio_call_seconds histogram\n"
+        "# HELP gpio_call_seconds Latency of library function calls.\n",
+    };
+    struct export_arg arg = { out, 0 };
+
+    for (arg.family = 0; arg.family < FAMILY_LAST; arg.family++) {
+        fputs(header[arg.family], out);
+        stats_foreach(0, export_table, &arg);
+    }
+}
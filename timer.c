@@ -0,0 +1,263 @@
+/*
+ * Timers of PIC32MZ: time base for DMA and other peripherals, pulse counters.
+ *
+ * Copyright (C) 2019 Serge Vakulenko
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   1. Redistributions of source code must retain the above copyright notice,
+ *      this list of conditions and the following disclaimer.
+ *   2. Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer in the
+ *      documentation and/or other materials provided with the distribution.
+ *   3. The name of the author may not be used to endorse or promote products
+ *      derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR IMPLIED
+ * WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO
+ * EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+ * OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ * OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ * ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#include <stdio.h>
+#include "gpio.h"
+
+//
+// Timer registers.  Timers 2-9 are of type B, with prescaler
+// selected by TCKPS field: 1, 2, 4, 8, 16, 32, 64 or 256.
+//
+#define T1CON       0x1f840000      // Next timers follow with step 0x200
+#define TCON_ON     0x8000
+#define TCON_T32    0x0008          // Pair with next timer as 32-bit
+#define TCON_TGATE  0x0080          // Count PBCLK3 while TxCK is high
+#define TCON_TCS    0x0002          // Count edges of TxCK
+
+#define TMR_OFFSET  0x10
+#define PR_OFFSET   0x20
+
+static const unsigned prescale[8] = { 1, 2, 4, 8, 16, 32, 64, 256 };
+
+//
+// Interrupt numbers of timers 1-9, used as DMA start requests.
+//
+static const int timer_irq[1+9] = { 0, 4, 9, 14, 19, 24, 28, 32, 36, 40 };
+
+//
+// Get physical address of TxCON register.
+//
+unsigned gpio_timer_addr(int timer)
+{
+    return T1CON + (timer - 1) * 0x200;
+}
+
+//
+// Get interrupt number of the timer.
+//
+int gpio_timer_irq(int timer)
+{
+    return timer_irq[timer];
+}
+
+//
+// Find prescaler and period for a given frequency in Hz.
+// The smallest prescaler which fits the period into 16 bits
+// is used, for best resolution.
+// Return actual frequency, or 0 when it is out of range.
+//
+static unsigned timer_divider(int timer, unsigned hz, unsigned *ps, unsigned *period)
+{
+    if (timer < 2 || timer > 9 || hz == 0) {
+        fprintf(stderr, "gpio: Bad timer %d or frequency %u\n", timer, hz);
+        return 0;
+    }
+
+    unsigned pbclk = gpio_pbclk(3);
+
+    for (*ps = 0; *ps < 8; (*ps)++) {
+        *period = (pbclk / prescale[*ps] + hz/2) / hz;
+        if (*period <= 0x10000)
+            break;
+    }
+    if (*ps == 8 || *period < 2) {
+        fprintf(stderr, "gpio: Frequency %u Hz is out of range for timer %d\n", hz, timer);
+        return 0;
+    }
+    return pbclk / prescale[*ps] / *period;
+}
+
+//
+// Get actual frequency the timer would run at, without starting it.
+// Return 0 when it is out of range.
+//
+unsigned gpio_timer_rate(int timer, unsigned hz)
+{
+    unsigned ps, period;
+
+    return timer_divider(timer, hz, &ps, &period);
+}
+
+//
+// Start timer 2...9 with a given period in Hz, clocked from PBCLK3.
+// Return actual frequency, or 0 when it is out of range.
+//
+unsigned gpio_timer_start(int timer, unsigned hz)
+{
+    unsigned ps, period;
+    unsigned actual = timer_divider(timer, hz, &ps, &period);
+
+    if (actual == 0)
+        return 0;
+
+    volatile unsigned *tcon = gpio_sfr(gpio_timer_addr(timer));
+
+    tcon[0] = 0;
+    tcon[TMR_OFFSET/4] = 0;
+    tcon[PR_OFFSET/4] = period - 1;
+    tcon[0] = ps << 4 | TCON_ON;
+    return actual;
+}
+
+//
+// Start a pair of timers 2/3, 4/5, 6/7 or 8/9 as a free-running
+// 32-bit counter of PBCLK3, without prescaler.
+// Return the count rate, or 0 on error.
+//
+unsigned gpio_timer_start32(int timer)
+{
+    if (timer < 2 || timer > 8 || (timer & 1)) {
+        fprintf(stderr, "gpio: Bad timer pair %d/%d\n", timer, timer + 1);
+        return 0;
+    }
+
+    volatile unsigned *tcon = gpio_sfr(gpio_timer_addr(timer));
+    volatile unsigned *next = gpio_sfr(gpio_timer_addr(timer + 1));
+
+    tcon[0] = 0;
+    next[0] = 0;
+    tcon[TMR_OFFSET/4] = 0;
+    next[TMR_OFFSET/4] = 0;
+    tcon[PR_OFFSET/4] = 0xffffffff;     // Low half of 32-bit period
+    next[PR_OFFSET/4] = 0xffffffff;     // High half
+    tcon[0] = TCON_T32 | TCON_ON;
+    return gpio_pbclk(3);
+}
+
+//
+// Check whether the timer is running, by itself or as
+// upper half of a 32-bit pair.
+//
+int gpio_timer_busy(int timer)
+{
+    if (*gpio_sfr(gpio_timer_addr(timer)) & TCON_ON)
+        return 1;
+    if (timer & 1) {
+        unsigned prev = *gpio_sfr(gpio_timer_addr(timer - 1));
+        if ((prev & TCON_ON) && (prev & TCON_T32))
+            return 1;
+    }
+    return 0;
+}
+
+//
+// Get current frequency of the timer, by its registers.
+// Return 0 when the timer is stopped, is a part of 32-bit pair,
+// or counts external clock, or is gated by TxCK pin.
+//
+unsigned gpio_timer_freq(int timer)
+{
+    volatile unsigned *tcon = gpio_sfr(gpio_timer_addr(timer));
+    unsigned con = tcon[0];
+
+    if (!(con & TCON_ON) || (con & (TCON_T32 | TCON_TCS | TCON_TGATE)))
+        return 0;
+    return gpio_pbclk(3) / prescale[con >> 4 & 7] / (tcon[PR_OFFSET/4] + 1);
+}
+
+//
+// Stop the timer.
+//
+void gpio_timer_stop(int timer)
+{
+    volatile unsigned *tcon = gpio_sfr(gpio_timer_addr(timer));
+
+    tcon[0] = 0;
+}
+
+//
+// Start counting rising edges on a pin, by timer clocked from TxCK.
+// A free timer, whose TxCK input the pin can be mapped to, is used.
+// Prescaler is 1, 2, 4, 8, 16, 32, 64 or 256.
+// Flags: TIMER_GATE to count PBCLK3 ticks while the pin is high,
+// TIMER_32BIT to use a pair of timers, like 2/3, as 32-bit counter.
+// Return the timer number, or 0 on error.
+//
+int gpio_counter_start(int pin, unsigned ps, int flags)
+{
+    int timer, index;
+
+    for (index = 0; index < 8; index++) {
+        if (prescale[index] == ps)
+            break;
+    }
+    if (index == 8) {
+        fprintf(stderr, "gpio: Bad prescaler %u\n", ps);
+        return 0;
+    }
+
+    for (timer = 2; timer <= 9; timer++) {
+        if ((flags & TIMER_32BIT) && (timer & 1 || gpio_timer_busy(timer + 1)))
+            continue;
+        if (!gpio_has_mapping(pin, MODE_T2CK + timer - 2) || gpio_timer_busy(timer))
+            continue;
+        if (gpio_claim_function(MODE_T2CK + timer - 2, "count") == 0)
+            break;
+    }
+    if (timer > 9) {
+        fprintf(stderr, "gpio: No free timer with external clock for this pin\n");
+        return 0;
+    }
+    if (gpio_set_mode(pin, MODE_T2CK + timer - 2) < 0) {
+        gpio_release_function(MODE_T2CK + timer - 2);
+        return 0;
+    }
+
+    volatile unsigned *tcon = gpio_sfr(gpio_timer_addr(timer));
+    unsigned con = index << 4 | TCON_ON;
+
+    if (flags & TIMER_GATE)
+        con |= TCON_TGATE;
+    else
+        con |= TCON_TCS;
+    if (flags & TIMER_32BIT)
+        con |= TCON_T32;
+
+    tcon[0] = 0;
+    tcon[TMR_OFFSET/4] = 0;
+    tcon[PR_OFFSET/4] = (flags & TIMER_32BIT) ? 0xffffffff : 0xffff;
+    tcon[0] = con;
+    return timer;
+}
+
+//
+// Read the counter.  In 32-bit mode, TMRx holds the whole value.
+//
+unsigned gpio_counter_read(int timer)
+{
+    return gpio_sfr(gpio_timer_addr(timer))[TMR_OFFSET/4];
+}
+
+//
+// Stop counting, and make the pin input.
+//
+void gpio_counter_stop(int timer, int pin)
+{
+    gpio_timer_stop(timer);
+    gpio_set_mode(pin, MODE_INPUT);
+    gpio_release_function(MODE_T2CK + timer - 2);
+}
@@ -0,0 +1,408 @@
+/*
+ * Binary trace of register accesses.
+ *
+ * Copyright (C) 2019 Serge Vakulenko
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   1. Redistributions of source code must retain the above copyright notice,
+ *      this list of conditions and the following disclaimer.
+ *   2. Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer in the
+ *      documentation and/or other materials provided with the distribution.
+ *   3. The name of the author may not be used to endorse or promote products
+ *      derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR IMPLIED
+ * WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO
+ * EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+ * OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ * OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ * ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include "gpio.h"
+
+//
+// Entry of the trace ring in memory.  Call site is kept as pointer
+// to function name, which is valid for the life of the process.
+//
+typedef struct {
+    unsigned long long time;        // CLOCK_MONOTONIC, nanoseconds
+    unsigned addr;                  // Physical address
+    unsigned old;                   // Value before access
+    unsigned value;                 // Value after access
+    unsigned short line;            // Line of call site
+    unsigned short op;              // GPIO_TRACE_READ or GPIO_TRACE_WRITE
+    const char *func;               // Function of call site
+} trace_entry_t;
+
+//
+// A trace file starts with magic "PIC32TRC" and the count of entries,
+// followed by entries of gpio_trace_entry_t: call site is stored by name.
+//
+static const char TRACE_MAGIC[8] = "PIC32TRC";
+
+//
+// Register blocks a trace can access: GPIO ports A-K, PPS, I2C and SPI
+// control registers, with their CLR, SET and INV companions.
+// A trace file is just data: replay touches nothing else.
+//
+static const struct {
+    unsigned addr;
+    unsigned size;
+} trace_block[] = {
+    { 0x1f860000, 0xa00 },          // GPIO ports
+    { 0x1f801400, 0x400 },          // PPS inputs and outputs
+    { 0x1f820000, 0xa00 },          // I2C1-I2C5
+    { 0x1f821000, 0xc00 },          // SPI1-SPI6
+    { 0, 0 },
+};
+
+//
+// Size of the ring, in entries: 2 Mbytes of memory.
+//
+#define TRACE_SIZE  65536
+
+static trace_entry_t *trace_ring;
+static unsigned long long trace_count;  // Entries put, ring wraps
+static pthread_once_t trace_once = PTHREAD_ONCE_INIT;
+
+//
+// Write the trace on exit: to a file named by GPIO_TRACE environment
+// variable, or decoded to stdout when debug output is enabled.
+//
+static void trace_exit()
+{
+    const char *filename = getenv("GPIO_TRACE");
+
+    if (filename && *filename) {
+        if (gpio_trace_save(filename) < 0)
+            fprintf(stderr, "gpio: %s: %s\n", filename, strerror(errno));
+    } else if (gpio_debug > 0) {
+        gpio_trace_print(stdout);
+    }
+}
+
+//
+// Allocate the ring, and register the exit hook, once.
+//
+static void trace_init()
+{
+    trace_ring = calloc(TRACE_SIZE, sizeof(trace_entry_t));
+    if (trace_ring)
+        atexit(trace_exit);
+}
+
+//
+// Append an entry.  Called through gpio_trace() macro, only in builds
+// with GPIO_TRACE defined.  Threads get distinct slots by atomic index.
+//
+void gpio_trace_put(int op, unsigned addr, unsigned old, unsigned value,
+    const char *func, unsigned line)
+{
+    struct timespec ts;
+
+    pthread_once(&trace_once, trace_init);
+    if (!trace_ring)
+        return;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    unsigned long long n = __atomic_fetch_add(&trace_count, 1, __ATOMIC_RELAXED);
+    trace_entry_t *e = &trace_ring[n % TRACE_SIZE];
+
+    e->time = ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+    e->addr = addr;
+    e->old = old;
+    e->value = value;
+    e->line = line;
+    e->op = op;
+    e->func = func;
+}
+
+//
+// Get range of valid entries in the ring: first index and count.
+//
+static unsigned long long trace_range(unsigned long long *first)
+{
+    unsigned long long count = __atomic_load_n(&trace_count, __ATOMIC_RELAXED);
+
+    if (!trace_ring)
+        count = 0;
+    *first = (count > TRACE_SIZE) ? count - TRACE_SIZE : 0;
+    return count - *first;
+}
+
+//
+// Print one entry, with time in microseconds from the first one.
+//
+static void trace_print_entry(FILE *out, unsigned long long t0,
+    unsigned long long time, int op, unsigned addr, unsigned old,
+    unsigned value, const char *func, unsigned line)
+{
+    if (op == GPIO_TRACE_READ)
+        fprintf(out, "%12.3f  [%08x] -> %08x              %s:%u\n",
+            (time - t0) / 1e3, addr, value, func, line);
+    else
+        fprintf(out, "%12.3f  [%08x] <- %08x, was %08x  %s:%u\n",
+            (time - t0) / 1e3, addr, value, old, func, line);
+}
+
+//
+// Decode the ring, in order of time.
+//
+void gpio_trace_print(FILE *out)
+{
+    unsigned long long first, n, count = trace_range(&first);
+
+    if (count == 0)
+        return;
+    fprintf(out, "--- Trace: %llu accesses", count);
+    if (first > 0)
+        fprintf(out, ", %llu dropped", first);
+    fprintf(out, "\n");
+    for (n = first; n < first + count; n++) {
+        trace_entry_t *e = &trace_ring[n % TRACE_SIZE];
+
+        trace_print_entry(out, trace_ring[first % TRACE_SIZE].time,
+            e->time, e->op, e->addr, e->old, e->value, e->func, e->line);
+    }
+}
+
+//
+// Save the ring to a file, created as the real user.
+// Return 0 on success, -1 on error.
+//
+int gpio_trace_save(const char *filename)
+{
+    unsigned long long first, n, count = trace_range(&first);
+    FILE *fd = gpio_fopen_user(filename, "wb");
+    int status = 0;
+
+    if (!fd)
+        return -1;
+    if (fwrite(TRACE_MAGIC, sizeof(TRACE_MAGIC), 1, fd) != 1 ||
+        fwrite(&count, sizeof(count), 1, fd) != 1)
+        status = -1;
+    for (n = first; n < first + count && status == 0; n++) {
+        trace_entry_t *e = &trace_ring[n % TRACE_SIZE];
+        gpio_trace_entry_t r;
+
+        memset(&r, 0, sizeof(r));
+        r.time = e->time;
+        r.addr = e->addr;
+        r.old = e->old;
+        r.value = e->value;
+        r.line = e->line;
+        r.op = e->op;
+        strncpy(r.func, e->func, sizeof(r.func) - 1);
+        if (fwrite(&r, sizeof(r), 1, fd) != 1)
+            status = -1;
+    }
+    if (fclose(fd) != 0)
+        status = -1;
+    return status;
+}
+
+//
+// Open a trace file as the real user, and read the header.
+// The count of entries is checked against the file size.
+// Return the file, or 0 on error.
+//
+static FILE *trace_open(const char *filename, unsigned long long *count)
+{
+    char magic[sizeof(TRACE_MAGIC)];
+    FILE *fd = gpio_fopen_user(filename, "rb");
+    struct stat st;
+
+    if (!fd || fstat(fileno(fd), &st) < 0) {
+        fprintf(stderr, "gpio: %s: %s\n", filename, strerror(errno));
+        if (fd)
+            fclose(fd);
+        return 0;
+    }
+    if (fread(magic, sizeof(magic), 1, fd) != 1 ||
+        memcmp(magic, TRACE_MAGIC, sizeof(magic)) != 0 ||
+        fread(count, sizeof(*count), 1, fd) != 1 ||
+        *count > (st.st_size - sizeof(magic) - sizeof(*count)) / sizeof(gpio_trace_entry_t)) {
+        fprintf(stderr, "gpio: %s: Not a trace file\n", filename);
+        fclose(fd);
+        return 0;
+    }
+    return fd;
+}
+
+//
+// Read entries of a trace file, one at a time.
+// Return 1 on success, 0 at end of file.
+//
+int gpio_trace_next(FILE *fd, gpio_trace_entry_t *e)
+{
+    if (fread(e, sizeof(*e), 1, fd) != 1)
+        return 0;
+    e->func[sizeof(e->func) - 1] = 0;
+    return 1;
+}
+
+//
+// Open a trace file for reading by gpio_trace_next().
+// Return 0 on error.
+//
+FILE *gpio_trace_open(const char *filename)
+{
+    unsigned long long count;
+
+    return trace_open(filename, &count);
+}
+
+//
+// Decode a trace file.  Return 0 on success, -1 on error.
+//
+int gpio_trace_decode(const char *filename, FILE *out)
+{
+    unsigned long long count, t0 = 0, n = 0;
+    gpio_trace_entry_t e;
+    FILE *fd = trace_open(filename, &count);
+
+    if (!fd)
+        return -1;
+    fprintf(out, "--- Trace: %llu accesses\n", count);
+    while (gpio_trace_next(fd, &e)) {
+        if (n++ == 0)
+            t0 = e.time;
+        trace_print_entry(out, t0, e.time, e.op, e.addr, e.old, e.value,
+            e.func, e.line);
+    }
+    fclose(fd);
+    return 0;
+}
+
+//
+// Check that an entry accesses a register the library traces.
+//
+static int trace_entry_valid(const gpio_trace_entry_t *e)
+{
+    int i;
+
+    if (e->addr & 3)
+        return 0;
+    if (e->op != GPIO_TRACE_READ && e->op != GPIO_TRACE_WRITE)
+        return 0;
+    for (i = 0; trace_block[i].size != 0; i++) {
+        if (e->addr - trace_block[i].addr < trace_block[i].size)
+            return 1;
+    }
+    return 0;
+}
+
+//
+// Re-execute accesses once.  Statistics are added to *stat.
+//
+static void trace_run(const gpio_trace_entry_t *e, volatile unsigned **reg,
+    unsigned long long nentries, int timed, FILE *out, gpio_replay_stat_t *stat)
+{
+    unsigned long long n, start;
+    struct timespec ts;
+
+    if (nentries > 0)
+        stat->recorded += e[nentries-1].time - e[0].time;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    start = ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+
+    for (n = 0; n < nentries; n++) {
+        if (timed) {
+            unsigned long long deadline = start + (e[n].time - e[0].time);
+
+            ts.tv_sec = deadline / 1000000000;
+            ts.tv_nsec = deadline % 1000000000;
+            clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, 0);
+        }
+
+        if (e[n].op == GPIO_TRACE_WRITE) {
+            *reg[n] = e[n].value;
+            stat->writes++;
+        } else {
+            unsigned value = *reg[n];
+
+            stat->reads++;
+            if (value != e[n].value) {
+                stat->divergences++;
+                if (out)
+                    fprintf(out, "%llu: [%08x] -> %08x, recorded %08x  %s:%u\n",
+                        n, e[n].addr, value, e[n].value, e[n].func, e[n].line);
+            }
+        }
+    }
+    stat->accesses += nentries;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    stat->elapsed += ts.tv_sec * 1000000000ULL + ts.tv_nsec - start;
+}
+
+//
+// Re-execute accesses of a trace file against registers: live
+// hardware, or the page of GPIO_MEM file.  Writes store the recorded
+// value; reads compare the value with the recorded one, and every
+// divergence is printed to out, unless out is 0.  With timed set,
+// accesses follow at the original intervals, by absolute deadlines;
+// otherwise as fast as possible.  The trace is loaded once, checked
+// to touch only registers of GPIO, PPS, I2C and SPI, and registers
+// are mapped in advance, so only the accesses are timed.
+// Replay is refused while anything is owned by another process.
+// The trace is run a given number of times, and statistics
+// of all runs are returned in *stat.  Return 0 on success, -1 on error.
+//
+int gpio_trace_replay(const char *filename, int timed, long repeat, FILE *out,
+    gpio_replay_stat_t *stat)
+{
+    unsigned long long count, nentries = 0;
+    gpio_trace_entry_t *e;
+    volatile unsigned **reg;
+    FILE *fd;
+
+    if (gpio_check_no_owners() < 0)
+        return -1;
+    fd = trace_open(filename, &count);
+    if (!fd)
+        return -1;
+    e = calloc(count + 1, sizeof(*e));
+    reg = calloc(count + 1, sizeof(*reg));
+    if (!e || !reg) {
+        fprintf(stderr, "gpio: Out of memory\n");
+        fclose(fd);
+        free(e);
+        free(reg);
+        return -1;
+    }
+    while (nentries < count && gpio_trace_next(fd, &e[nentries])) {
+        if (!trace_entry_valid(&e[nentries])) {
+            fprintf(stderr, "gpio: %s: Entry %llu at [%08x] is out of GPIO, PPS, I2C and SPI registers\n",
+                filename, nentries, e[nentries].addr);
+            fclose(fd);
+            free(e);
+            free(reg);
+            return -1;
+        }
+        reg[nentries] = gpio_sfr(e[nentries].addr);
+        nentries++;
+    }
+    fclose(fd);
+
+    memset(stat, 0, sizeof(*stat));
+    while (repeat-- > 0)
+        trace_run(e, reg, nentries, timed, out, stat);
+    free(e);
+    free(reg);
+    return 0;
+}
@@ -0,0 +1,349 @@
+/*
+ * Trigger conditions and pre-trigger history for capture.
+ *
+ * Copyright (C) 2019 Serge Vakulenko
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   1. Redistributions of source code must retain the above copyright notice,
+ *      this list of conditions and the following disclaimer.
+ *   2. Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer in the
+ *      documentation and/or other materials provided with the distribution.
+ *   3. The name of the author may not be used to endorse or promote products
+ *      derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR IMPLIED
+ * WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO
+ * EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+ * OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ * OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ * ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+#include <stdint.h>
+#include "gpio.h"
+
+extern int pin_by_name(const char *name);
+
+//
+// Parse time interval with optional suffix: ns, us, ms or s.
+// Without suffix, the value is in microseconds.
+// Return interval in nanoseconds, or -1 on error.
+//
+long long gpio_parse_time(const char *str)
+{
+    char *ep;
+    double value = strtod(str, &ep);
+
+    if (ep == str || value < 0)
+        return -1;
+    if (*ep == 0 || strcmp(ep, "us") == 0)
+        return value * 1e3;
+    if (strcmp(ep, "ns") == 0)
+        return value;
+    if (strcmp(ep, "ms") == 0)
+        return value * 1e6;
+    if (strcmp(ep, "s") == 0)
+        return value * 1e9;
+    return -1;
+}
+
+//
+// Find port index by letter A-K.
+//
+static int port_by_letter(const char *str)
+{
+    const char *letters = "ABCDEFGHJK";
+    const char *p;
+
+    if (str[0] == 0 || str[1] != ':')
+        return -1;
+    p = strchr(letters, toupper(str[0]));
+    if (!p)
+        return -1;
+    return p - letters;
+}
+
+//
+// Add a stage to the trigger, given as text:
+//      <pin>=0, <pin>=1            - pin level
+//      <port>:<mask>=<value>       - masked port word, like B:00f0=0030
+//      <pin>:rise, <pin>:fall, <pin>:edge  - pin transition
+//      <pin>:high><time>, <pin>:high<<time>,
+//      <pin>:low><time>, <pin>:low<<time> - pulse width
+// Stages fire one after another, the last one fires the trigger.
+// Return 0 on success, -1 on error.
+//
+int gpio_trigger_add(gpio_trigger_t *trig, const char *spec)
+{
+    gpio_trigger_stage_t *st;
+    char name[16], *p;
+    int port, pin;
+
+    if (trig->nstages >= GPIO_TRIGGER_MAXSTAGES) {
+        fprintf(stderr, "gpio: Too many trigger stages\n");
+        return -1;
+    }
+    st = &trig->stage[trig->nstages];
+    memset(st, 0, sizeof(*st));
+
+    port = port_by_letter(spec);
+    if (port >= 0) {
+        // Port word match.
+        unsigned mask = strtoul(spec + 2, &p, 16);
+        if (*p++ != '=' || mask == 0 || mask > 0xffff)
+            goto error;
+        st->kind = TRIGGER_MATCH;
+        st->port = port;
+        st->mask = mask;
+        st->value = strtoul(p, &p, 16) & mask;
+        if (*p != 0)
+            goto error;
+        trig->nstages++;
+        return 0;
+    }
+
+    // Get pin name.
+    int len = strcspn(spec, "=:");
+    if (len == 0 || len >= sizeof(name) || spec[len] == 0)
+        goto error;
+    memcpy(name, spec, len);
+    name[len] = 0;
+    pin = pin_by_name(name);
+    st->port = GPIO_PORTNUM(pin);
+    st->mask = (uint16_t) pin;
+    p = (char*) spec + len + 1;
+
+    if (spec[len] == '=') {
+        // Pin level.
+        if (strcmp(p, "0") != 0 && strcmp(p, "1") != 0)
+            goto error;
+        st->kind = TRIGGER_MATCH;
+        st->value = (*p == '1') ? st->mask : 0;
+    } else if (strcasecmp(p, "rise") == 0) {
+        st->kind = TRIGGER_EDGE;
+        st->value = st->mask;
+    } else if (strcasecmp(p, "fall") == 0) {
+        st->kind = TRIGGER_EDGE;
+        st->value = 0;
+    } else if (strcasecmp(p, "edge") == 0) {
+        st->kind = TRIGGER_ANY_EDGE;
+    } else if (strncasecmp(p, "high", 4) == 0 || strncasecmp(p, "low", 3) == 0) {
+        long long width;
+
+        st->kind = TRIGGER_PULSE;
+        if (*p == 'h' || *p == 'H') {
+            st->value = st->mask;
+            p += 4;
+        } else
+            p += 3;
+        if (*p != '<' && *p != '>')
+            goto error;
+        width = gpio_parse_time(p + 1);
+        if (width < 0)
+            goto error;
+        if (*p == '>') {
+            st->min = width;
+            st->max = ~0ULL;
+        } else {
+            st->min = 0;
+            st->max = width;
+        }
+    } else
+        goto error;
+
+    trig->nstages++;
+    return 0;
+error:
+    fprintf(stderr, "gpio: Bad trigger: %s\n", spec);
+    return -1;
+}
+
+//
+// Get per-port masks of pins used by the trigger.
+//
+void gpio_trigger_mask(const gpio_trigger_t *trig, unsigned mask[GPIO_NPORTS])
+{
+    int i;
+
+    for (i = 0; i < trig->nstages; i++)
+        mask[trig->stage[i].port] |= trig->stage[i].mask;
+}
+
+//
+// Arm the trigger: start from the first stage.
+//
+void gpio_trigger_reset(gpio_trigger_t *trig)
+{
+    trig->current = 0;
+    trig->known = 0;
+    trig->pulse_start = 0;
+    memset(trig->state, 0, sizeof(trig->state));
+}
+
+//
+// Check the trigger against next event.
+// Only the current stage is evaluated, so the cost per event is
+// a few logic operations on port words.
+// Return 1 when the trigger fires.
+//
+int gpio_trigger_check(gpio_trigger_t *trig, const gpio_event_t *ev)
+{
+    unsigned bit = 1 << ev->port;
+    unsigned old = trig->state[ev->port];
+    int known = trig->known & bit;
+    int fired = 0;
+
+    trig->state[ev->port] = ev->value;
+    trig->known |= bit;
+    if (trig->current >= trig->nstages)
+        return 0;
+
+    const gpio_trigger_stage_t *st = &trig->stage[trig->current];
+    if (ev->port != st->port)
+        return 0;
+
+    unsigned now = ev->value & st->mask;
+    unsigned changed = (old ^ ev->value) & st->mask;
+
+    switch (st->kind) {
+    case TRIGGER_MATCH:
+        // Fire when the port comes to the pattern.
+        fired = (now == st->value) && (!known || changed);
+        break;
+    case TRIGGER_EDGE:
+        fired = known && changed && now == st->value;
+        break;
+    case TRIGGER_ANY_EDGE:
+        fired = known && changed;
+        break;
+    case TRIGGER_PULSE:
+        // Measure time from entering the level till leaving it.
+        if (!known || !changed)
+            break;
+        if (now == st->value) {
+            trig->pulse_start = ev->timestamp;
+        } else if (trig->pulse_start != 0) {
+            unsigned long long width = ev->timestamp - trig->pulse_start;
+
+            fired = (width >= st->min && width <= st->max);
+            trig->pulse_start = 0;
+        }
+        break;
+    }
+    if (!fired)
+        return 0;
+
+    trig->current++;
+    trig->pulse_start = 0;
+    return trig->current == trig->nstages;
+}
+
+//
+// Allocate history for a given number of events,
+// keeping span nanoseconds before the trigger.
+// Return 0 on success, -1 on error.
+//
+int gpio_history_init(gpio_history_t *h, int nslots, unsigned long long span)
+{
+    memset(h, 0, sizeof(*h));
+    h->slot = calloc(nslots, sizeof(gpio_event_t));
+    if (!h->slot) {
+        fprintf(stderr, "gpio: Cannot allocate %d events\n", nslots);
+        return -1;
+    }
+    h->size = nslots;
+    h->span = span;
+    return 0;
+}
+
+void gpio_history_free(gpio_history_t *h)
+{
+    free(h->slot);
+    h->slot = 0;
+}
+
+//
+// Drop the oldest event, moving it into the base state.
+//
+static void history_drop(gpio_history_t *h)
+{
+    const gpio_event_t *ev = &h->slot[h->first];
+
+    h->state[ev->port] = ev->value;
+    h->time = ev->timestamp;
+    h->first = (h->first + 1) % h->size;
+    h->count--;
+}
+
+//
+// Put event into the history.  Events older than the span,
+// or not fitting into the buffer, are forgotten.
+//
+void gpio_history_put(gpio_history_t *h, const gpio_event_t *ev)
+{
+    if (h->count == h->size)
+        history_drop(h);
+    h->slot[(h->first + h->count) % h->size] = *ev;
+    h->count++;
+
+    while (h->count > 1 && h->slot[h->first].timestamp + h->span < ev->timestamp)
+        history_drop(h);
+}
+
+//
+// Create a capture file with the contents of the history,
+// for the trigger fired at a given time.  Writing of
+// the post-trigger window continues through the returned handle.
+// Return 0 on error.
+//
+gpio_capture_t *gpio_history_save(gpio_history_t *h, const char *filename,
+    const unsigned mask[GPIO_NPORTS], unsigned long long trigger_time)
+{
+    unsigned long long start;
+    gpio_capture_t *cap;
+    int port;
+    unsigned i;
+
+    if (h->count == 0)
+        return 0;
+
+    // Base state is known since the last dropped event.
+    start = h->slot[h->first].timestamp;
+    if (h->time != 0) {
+        unsigned long long from = (trigger_time > h->span) ? trigger_time - h->span : 0;
+
+        if (from < h->time)
+            from = h->time;
+        if (from < start)
+            start = from;
+    }
+
+    cap = gpio_capture_create(filename, mask, start);
+    if (!cap)
+        return 0;
+    gpio_capture_set_trigger(cap, trigger_time);
+
+    // Port state at the start of window.
+    for (port = 0; port < GPIO_NPORTS; port++)
+        gpio_capture_put(cap, start, port, h->state[port]);
+
+    for (i = 0; i < h->count; i++) {
+        const gpio_event_t *ev = &h->slot[(h->first + i) % h->size];
+
+        gpio_capture_put(cap, ev->timestamp, ev->port, ev->value);
+    }
+    h->first = 0;
+    h->count = 0;
+    return cap;
+}